@@ -0,0 +1,183 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// most associations to keep per child - the cache is emptied when it fills up with live ones
+#define ASSOCIATION_CACHE_SIZE 256
+
+namespace modauthopenid {
+  using namespace std;
+  using namespace opkele;
+
+  typedef struct cached_assoc {
+    string server;
+    string handle;
+    string type;
+    secret_t secret;
+    time_t expires_on;
+  } cached_assoc_t;
+
+  // entries are keyed by location, server and handle - the server index maps location and server
+  // to the key of the latest expiring association find should return for it
+  static map<string, cached_assoc_t> *assocs = NULL;
+  static map<string, string> *latest = NULL;
+#if APR_HAS_THREADS
+  static apr_thread_mutex_t *assoc_mutex = NULL;
+#endif
+
+  static void assoc_lock() {
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(assoc_mutex);
+#endif
+  };
+
+  static void assoc_unlock() {
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(assoc_mutex);
+#endif
+  };
+
+  static string server_key(const string& location, const string& server) {
+    return location + '\n' + server;
+  };
+
+  static string handle_key(const string& location, const string& server, const string& handle) {
+    return location + '\n' + server + '\n' + handle;
+  };
+
+  // make an association from a cached entry, or return false if it has expired (in which case
+  // it's removed).  Must be called with the lock held.
+  static bool use_entry(map<string, cached_assoc_t>::iterator it, assoc_t& assoc) {
+    const cached_assoc_t& entry = it->second;
+    if(entry.expires_on < time(0)) {
+      assocs->erase(it);
+      return false;
+    }
+    assoc = assoc_t(new association(entry.server, entry.handle, entry.type, entry.secret, entry.expires_on, false));
+    return true;
+  };
+
+  void AssociationCache::init(apr_pool_t *p) {
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&assoc_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+      print_to_error_log("could not create association cache mutex - not caching associations");
+      return;
+    }
+#endif
+    assocs = new map<string, cached_assoc_t>;
+    latest = new map<string, string>;
+    apr_pool_cleanup_register(p, NULL, AssociationCache::cleanup, apr_pool_cleanup_null);
+  };
+
+  apr_status_t AssociationCache::cleanup(void *data) {
+    delete assocs;
+    delete latest;
+    assocs = NULL;
+    latest = NULL;
+    return APR_SUCCESS;
+  };
+
+  bool AssociationCache::retrieve(const string& location, const string& server, const string& handle, assoc_t& assoc) {
+    if(assocs == NULL)
+      return false;
+    bool found = false;
+    assoc_lock();
+    map<string, cached_assoc_t>::iterator it = assocs->find(handle_key(location, server, handle));
+    if(it != assocs->end())
+      found = use_entry(it, assoc);
+    assoc_unlock();
+    return found;
+  };
+
+  bool AssociationCache::find(const string& location, const string& server, assoc_t& assoc) {
+    if(assocs == NULL)
+      return false;
+    bool found = false;
+    assoc_lock();
+    map<string, string>::iterator index = latest->find(server_key(location, server));
+    if(index != latest->end()) {
+      map<string, cached_assoc_t>::iterator it = assocs->find(index->second);
+      if(it != assocs->end())
+        found = use_entry(it, assoc);
+      if(!found)
+        latest->erase(index);
+    }
+    assoc_unlock();
+    return found;
+  };
+
+  void AssociationCache::store(const string& location, const string& server, const string& handle,
+			       const string& type, const secret_t& secret, time_t expires_on, bool for_server) {
+    if(assocs == NULL)
+      return;
+    string key = handle_key(location, server, handle);
+    assoc_lock();
+    if(assocs->size() >= ASSOCIATION_CACHE_SIZE) {
+      // drop whatever has expired, and start over if that didn't make room
+      time_t now = time(0);
+      for(map<string, cached_assoc_t>::iterator it = assocs->begin(); it != assocs->end(); ) {
+        if(it->second.expires_on < now)
+          assocs->erase(it++);
+        else
+          ++it;
+      }
+      if(assocs->size() >= ASSOCIATION_CACHE_SIZE) {
+        assocs->clear();
+        latest->clear();
+      }
+    }
+    cached_assoc_t& entry = (*assocs)[key];
+    entry.server = server;
+    entry.handle = handle;
+    entry.type = type;
+    entry.secret = secret;
+    entry.expires_on = expires_on;
+    if(for_server) {
+      // don't replace an association that lasts longer with this one
+      string& current = (*latest)[server_key(location, server)];
+      map<string, cached_assoc_t>::iterator it = assocs->find(current);
+      if(current == "" || it == assocs->end() || it->second.expires_on <= expires_on)
+        current = key;
+    }
+    assoc_unlock();
+  };
+
+  void AssociationCache::invalidate(const string& location, const string& server, const string& handle) {
+    if(assocs == NULL)
+      return;
+    string key = handle_key(location, server, handle);
+    assoc_lock();
+    assocs->erase(key);
+    map<string, string>::iterator index = latest->find(server_key(location, server));
+    if(index != latest->end() && index->second == key)
+      latest->erase(index);
+    assoc_unlock();
+  };
+}
+
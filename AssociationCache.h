@@ -0,0 +1,62 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace opkele;
+  using namespace std;
+
+  // Per-child cache of associations in front of the associations table, so that starting a login
+  // or checking an id_res doesn't query the db and decode the secret every time.  Entries are kept
+  // per database location, and are looked up either by server and handle or by server alone.
+  // Expired entries are never returned.  Associations invalidated in another child are only
+  // dropped here once they expire, in which case the OP's signature check fails and libopkele
+  // falls back to check_authentication.  All methods are safe to call from multiple threads.
+  class AssociationCache {
+  public:
+    // set up the cache for this child process (called from the child_init hook) - until this is
+    // called nothing is cached
+    static void init(apr_pool_t *p);
+
+    // find the association for server and handle - false if it isn't cached
+    static bool retrieve(const string& location, const string& server, const string& handle, assoc_t& assoc);
+
+    // find the latest expiring association stored as the server's - false if there isn't one cached
+    static bool find(const string& location, const string& server, assoc_t& assoc);
+
+    // remember an association - if for_server is true, find returns it for server from now on
+    // unless another one already cached for server expires later
+    static void store(const string& location, const string& server, const string& handle,
+		      const string& type, const secret_t& secret, time_t expires_on, bool for_server);
+
+    // forget an association
+    static void invalidate(const string& location, const string& server, const string& handle);
+  private:
+    static apr_status_t cleanup(void *data);
+  };
+}
+
@@ -0,0 +1,263 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// the default Diffie-Hellman modulus and generator from the OpenID 2.0 spec
+#define OPENID_DH_MODULUS "DCF93A0B883972EC0E19989AC5A2CE310E1D37717E8D9571BB7623731866E61EF75A2E27898B057F9891C2E27A639C3F29B60814581CD3B2CA3986D2683705577D45C2E7E52DC81C7A171876E5CEA74B1448BFDFAF18828EFD2519F14E45E3826634AF1949E5B535CC829A483B8A76223E5D490A257F05BDFF16F2FB22C583AB"
+#define OPENID_DH_GEN 2
+
+// bits in our private Diffie-Hellman key
+#define OPENID_DH_PRIVATE_BITS 256
+
+#define OPENID_NS_2_0 "http://specs.openid.net/auth/2.0"
+
+// how long what's been learned about an OP is kept before finding out again
+#define OP_CAPABILITIES_LIFESPAN 86400
+
+namespace modauthopenid {
+  using namespace std;
+  using namespace opkele;
+
+  // results of a single associate request
+  typedef enum { ATTEMPT_OK, ATTEMPT_UNSUPPORTED, ATTEMPT_REFUSED, ATTEMPT_FAILED } attempt_result_t;
+
+  // the Diffie-Hellman numbers for one associate request - freed when it goes out of scope
+  class dh_keys {
+  public:
+    dh_keys() : p(NULL), g(BN_new()), x(BN_new()), pub(BN_new()), ctx(BN_CTX_new()) {};
+    ~dh_keys() {
+      BN_free(p);
+      BN_free(g);
+      BN_clear_free(x);
+      BN_free(pub);
+      BN_CTX_free(ctx);
+    };
+
+    // make a private key and the matching public key - false on error
+    bool generate() {
+      return g != NULL && x != NULL && pub != NULL && ctx != NULL &&
+        BN_hex2bn(&p, OPENID_DH_MODULUS) != 0 && BN_set_word(g, OPENID_DH_GEN) &&
+        BN_rand(x, OPENID_DH_PRIVATE_BITS, -1, 0) && BN_mod_exp(pub, g, x, p, ctx);
+    };
+
+    BIGNUM *p, *g, *x, *pub;
+    BN_CTX *ctx;
+  };
+
+  // the big-endian two's complement form of n the spec uses
+  static string btwoc(const BIGNUM *n) {
+    string s(BN_num_bytes(n), '\0');
+    if(!s.empty())
+      BN_bn2bin(n, (unsigned char *) &s[0]);
+    if(s.empty() || (s[0] & 0x80))
+      s.insert(s.begin(), '\0');
+    return s;
+  };
+
+  static string to_base64(const string& s) {
+    return util::encode_base64(s.data(), s.size());
+  };
+
+  static string from_base64(const string& s) {
+    vector<unsigned char> data;
+    util::decode_base64(s, data);
+    return string(data.begin(), data.end());
+  };
+
+  // the hash a DH session type uses - NULL for no-encryption or an unknown type
+  static const EVP_MD *session_md(const string& session_type) {
+    if(session_type == "DH-SHA1")
+      return EVP_sha1();
+    if(session_type == "DH-SHA256")
+      return EVP_sha256();
+    return NULL;
+  };
+
+  // the size of the MAC key an association type uses - 0 for an unknown type
+  static size_t mac_key_size(const string& assoc_type) {
+    if(assoc_type == "HMAC-SHA1")
+      return 20;
+    if(assoc_type == "HMAC-SHA256")
+      return 32;
+    return 0;
+  };
+
+  // true if we can use this combination with server - the DH hash has to be as long as the
+  // MAC key, and the key may only be sent in the clear over https
+  static bool supported(const string& server, const string& assoc_type, const string& session_type) {
+    size_t size = mac_key_size(assoc_type);
+    if(size == 0)
+      return false;
+    if(session_type == "no-encryption")
+      return server.compare(0, 8, "https://") == 0;
+    const EVP_MD *md = session_md(session_type);
+    return md != NULL && (size_t) EVP_MD_size(md) == size;
+  };
+
+  static attempt_result_t attempt(const string& server, const string& assoc_type, const string& session_type,
+				  openid_message_t& reply, assoc_record_t& assoc) {
+    dh_keys dh;
+    const EVP_MD *md = session_md(session_type);
+    if(md != NULL && !dh.generate()) {
+      print_to_error_log("could not make Diffie-Hellman keys to associate with " + server);
+      return ATTEMPT_FAILED;
+    }
+
+    openid_message_t request;
+    request.set_field("ns", OPENID_NS_2_0);
+    request.set_field("mode", "associate");
+    request.set_field("assoc_type", assoc_type);
+    request.set_field("session_type", session_type);
+    if(md != NULL)
+      request.set_field("dh_consumer_public", to_base64(btwoc(dh.pub)));
+
+    debug("associating with " + server + " using " + assoc_type + "/" + session_type);
+    string response;
+    long status;
+    if(!CurlPool::post(server, request.query_string(), response, status))
+      return ATTEMPT_FAILED;
+    reply.from_keyvalues(response);
+
+    if(reply.has_field("error_code") && reply.get_field("error_code") == "unsupported-type")
+      return ATTEMPT_UNSUPPORTED;
+    if(reply.has_field("error")) {
+      debug(server + " refused to associate: " + reply.get_field("error"));
+      return ATTEMPT_REFUSED;
+    }
+    // anything else that isn't a 200 (a 404, a 429, a server error...) isn't an answer from
+    // the OP, so there's nothing to learn from it
+    if(status != 200) {
+      char code[16];
+      snprintf(code, sizeof(code), "%ld", status);
+      print_to_error_log("associate request to " + server + " returned HTTP status " + string(code));
+      return ATTEMPT_FAILED;
+    }
+
+    if(!reply.has_field("assoc_handle") || !reply.has_field("expires_in") || !reply.has_field("assoc_type") ||
+       reply.get_field("assoc_type") != assoc_type) {
+      print_to_error_log("broken associate response from " + server);
+      return ATTEMPT_FAILED;
+    }
+
+    string secret;
+    if(md == NULL) {
+      if(!reply.has_field("mac_key")) {
+        print_to_error_log("associate response from " + server + " has no mac_key");
+        return ATTEMPT_FAILED;
+      }
+      secret = from_base64(reply.get_field("mac_key"));
+    } else {
+      if(!reply.has_field("dh_server_public") || !reply.has_field("enc_mac_key")) {
+        print_to_error_log("associate response from " + server + " has no dh_server_public or enc_mac_key");
+        return ATTEMPT_FAILED;
+      }
+      string server_public = from_base64(reply.get_field("dh_server_public"));
+      BIGNUM *spub = BN_bin2bn((const unsigned char *) server_public.data(), server_public.size(), NULL);
+      BIGNUM *shared = BN_new();
+      BIGNUM *limit = BN_dup(dh.p);
+      bool ok = spub != NULL && shared != NULL && limit != NULL && BN_sub_word(limit, 1) &&
+        BN_cmp(spub, BN_value_one()) > 0 && BN_cmp(spub, limit) < 0 &&
+        BN_mod_exp(shared, spub, dh.x, dh.p, dh.ctx);
+      string shared_bytes = ok ? btwoc(shared) : "";
+      BN_free(spub);
+      BN_clear_free(shared);
+      BN_free(limit);
+      if(!ok) {
+        print_to_error_log("bad dh_server_public from " + server);
+        return ATTEMPT_FAILED;
+      }
+
+      // the MAC key comes xor'ed with the hash of the shared secret
+      unsigned char hash[EVP_MAX_MD_SIZE];
+      unsigned int hash_size = 0;
+      EVP_Digest(shared_bytes.data(), shared_bytes.size(), hash, &hash_size, md, NULL);
+      secret = from_base64(reply.get_field("enc_mac_key"));
+      if(secret.size() != hash_size) {
+        print_to_error_log("enc_mac_key from " + server + " is the wrong size");
+        return ATTEMPT_FAILED;
+      }
+      for(string::size_type i = 0; i < secret.size(); i++)
+        secret[i] ^= hash[i];
+    }
+    if(secret.size() != mac_key_size(assoc_type)) {
+      print_to_error_log("MAC key from " + server + " is the wrong size");
+      return ATTEMPT_FAILED;
+    }
+
+    assoc.server = server;
+    assoc.handle = reply.get_field("assoc_handle");
+    assoc.type = assoc_type;
+    assoc.secret.assign(secret.begin(), secret.end());
+    assoc.expires_on = time(0) + atol(reply.get_field("expires_in").c_str());
+    return ATTEMPT_OK;
+  };
+
+  assoc_result_t Associator::associate(const string& server, bool known, op_capabilities_t& caps, assoc_record_t& assoc) {
+    string assoc_type = "HMAC-SHA256", session_type = "DH-SHA256";
+    if(known && !caps.stateless && supported(server, caps.assoc_type, caps.session_type)) {
+      assoc_type = caps.assoc_type;
+      session_type = caps.session_type;
+    }
+
+    caps.server = server;
+    caps.expires_on = time(0) + OP_CAPABILITIES_LIFESPAN;
+    for(int tries = 0; tries < 2; tries++) {
+      openid_message_t reply;
+      attempt_result_t result = attempt(server, assoc_type, session_type, reply, assoc);
+      if(result == ATTEMPT_OK) {
+        caps.assoc_type = assoc_type;
+        caps.session_type = session_type;
+        caps.stateless = false;
+        return ASSOC_OK;
+      }
+      if(result == ATTEMPT_FAILED)
+        return ASSOC_FAILED;
+
+      // try what the OP suggests - OPs that don't suggest anything (OpenID 1.x ones never send
+      // an error_code, and just refuse) are asked for SHA1, like libopkele does
+      string next_assoc_type = "HMAC-SHA1", next_session_type = "DH-SHA1";
+      if(result == ATTEMPT_UNSUPPORTED && reply.has_field("assoc_type"))
+        next_assoc_type = reply.get_field("assoc_type");
+      if(result == ATTEMPT_UNSUPPORTED && reply.has_field("session_type"))
+        next_session_type = reply.get_field("session_type");
+      if((next_assoc_type == assoc_type && next_session_type == session_type) ||
+         !supported(server, next_assoc_type, next_session_type))
+        break;
+      assoc_type = next_assoc_type;
+      session_type = next_session_type;
+    }
+
+    debug(server + " won't associate with any type we support - using stateless mode");
+    caps.assoc_type = "";
+    caps.session_type = "";
+    caps.stateless = true;
+    return ASSOC_STATELESS;
+  };
+}
+
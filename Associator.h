@@ -0,0 +1,53 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+
+namespace modauthopenid {
+  using namespace opkele;
+  using namespace std;
+
+  // Results of Associator::associate
+  typedef enum { ASSOC_OK, ASSOC_STATELESS, ASSOC_FAILED } assoc_result_t;
+
+  // Makes associations with OPs (the OpenID 2.0 associate request, with a Diffie-Hellman
+  // session, or no-encryption over https) over a pooled curl handle.  Unlike libopkele, which
+  // always asks for HMAC-SHA256 first and retries with HMAC-SHA1, the first request uses the
+  // types the OP is already known to accept, and an OP's unsupported-type answer is followed
+  // to the types it suggests.  An OP that refuses without suggesting anything is asked for
+  // HMAC-SHA1 once before it's taken to be stateless.
+  class Associator {
+  public:
+    // associate with server, asking for the types in caps first if known is true.  Returns
+    // ASSOC_OK with the new association in assoc; ASSOC_STATELESS if the OP wouldn't associate
+    // with any type we support; or ASSOC_FAILED if the OP couldn't be reached or gave a broken
+    // (or non-OpenID) answer, in which case nothing was learned.  For ASSOC_OK and ASSOC_STATELESS caps is set
+    // to what was learned about the OP.
+    static assoc_result_t associate(const string& server, bool known, op_capabilities_t& caps, assoc_record_t& assoc);
+  };
+}
+
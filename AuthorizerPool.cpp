@@ -0,0 +1,247 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// what an AuthOpenIDUserProgram starts with to be kept running
+#define COPROCESS_PREFIX "prg:"
+
+// the longest answer line a program may give
+#define COPROCESS_MAX_ANSWER 256
+
+namespace modauthopenid {
+  using namespace std;
+
+  // a running copy of a program
+  typedef struct authorizer {
+    apr_pool_t *pool;   // destroying the pool kills the process
+    apr_proc_t proc;
+  } authorizer_t;
+
+  // the copies of one program running in this child
+  typedef struct authorizer_set {
+    authorizer_set() : running(0) {};
+    vector<authorizer_t *> idle;
+    int running;        // idle and busy
+  } authorizer_set_t;
+
+  // all pool state is per child process
+  static map<string, authorizer_set_t> *authorizers = NULL;
+  static apr_pool_t *authorizer_pool = NULL;
+  static int max_authorizers = 1;
+  static int authorizer_timeout = 10;
+#if APR_HAS_THREADS
+  static apr_thread_mutex_t *authorizer_mutex = NULL;
+  static apr_thread_cond_t *authorizer_released = NULL;
+#endif
+
+  static void authorizer_lock() {
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(authorizer_mutex);
+#endif
+  };
+
+  static void authorizer_unlock() {
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(authorizer_mutex);
+#endif
+  };
+
+  // wait (with the lock held) for a copy to be released, until at most until - false once
+  // until has passed
+  static bool authorizer_wait(apr_time_t until) {
+#if APR_HAS_THREADS
+    apr_time_t now = apr_time_now();
+    if(now >= until)
+      return false;
+    apr_thread_cond_timedwait(authorizer_released, authorizer_mutex, until - now);
+    return true;
+#else
+    return false;
+#endif
+  };
+
+  // start a copy of the program at path - NULL on error.  Must be called with the lock held.
+  static authorizer_t *start_authorizer(const string& path) {
+    apr_pool_t *pool;
+    if(apr_pool_create(&pool, authorizer_pool) != APR_SUCCESS)
+      return NULL;
+    authorizer_t *authorizer = new authorizer_t;
+    authorizer->pool = pool;
+    const char *argv[] = { path.c_str(), NULL };
+    apr_procattr_t *attr;
+    // the program's ends of the pipes block, ours don't so they can time out
+    if(apr_procattr_create(&attr, pool) != APR_SUCCESS ||
+       apr_procattr_io_set(attr, APR_CHILD_BLOCK, APR_CHILD_BLOCK, APR_NO_PIPE) != APR_SUCCESS ||
+       apr_procattr_cmdtype_set(attr, APR_PROGRAM) != APR_SUCCESS ||
+       apr_proc_create(&(authorizer->proc), path.c_str(), argv, NULL, attr, pool) != APR_SUCCESS) {
+      print_to_error_log("could not start authorization program " + path);
+      apr_pool_destroy(pool);
+      delete authorizer;
+      return NULL;
+    }
+    apr_pool_note_subprocess(pool, &(authorizer->proc), APR_KILL_ALWAYS);
+    debug("started authorization program " + path);
+    return authorizer;
+  };
+
+  // kill a copy of a program.  Must be called with the lock held.
+  static void stop_authorizer(authorizer_t *authorizer) {
+    apr_pool_destroy(authorizer->pool);
+    delete authorizer;
+  };
+
+  // ask a copy of a program about identity, setting answered to false if it didn't answer
+  // properly within the timeout (in which case it shouldn't be used again)
+  static bool ask_authorizer(authorizer_t *authorizer, const string& identity, bool& answered) {
+    answered = false;
+    apr_time_t until = apr_time_now() + apr_time_from_sec(authorizer_timeout);
+    string line = identity + "\n";
+    apr_file_pipe_timeout_set(authorizer->proc.in, apr_time_from_sec(authorizer_timeout));
+    if(apr_file_write_full(authorizer->proc.in, line.data(), line.size(), NULL) != APR_SUCCESS)
+      return false;
+
+    string answer;
+    while(answer.find('\n') == string::npos) {
+      apr_interval_time_t left = until - apr_time_now();
+      if(left <= 0 || answer.size() > COPROCESS_MAX_ANSWER)
+        return false;
+      char buf[COPROCESS_MAX_ANSWER];
+      apr_size_t size = sizeof(buf);
+      apr_file_pipe_timeout_set(authorizer->proc.out, left);
+      if(apr_file_read(authorizer->proc.out, buf, &size) != APR_SUCCESS)
+        return false;
+      answer.append(buf, size);
+    }
+    // anything after the answer line would be taken as the answer to the next question
+    if(answer.find('\n') != answer.size() - 1)
+      return false;
+    answered = true;
+    answer.erase(answer.size() - 1);
+    if(!answer.empty() && answer[answer.size() - 1] == '\r')
+      answer.erase(answer.size() - 1);
+    return answer == "OK";
+  };
+
+  static bool coprocess_auth(const string& path, const string& identity, bool& decided) {
+    decided = false;
+    if(authorizers == NULL) {
+      print_to_error_log("authorization programs haven't been set up - can't run " + path);
+      return false;
+    }
+
+    // take an idle copy, or start a new one if there's room, or wait for one to be released
+    apr_time_t until = apr_time_now() + apr_time_from_sec(authorizer_timeout);
+    authorizer_t *authorizer = NULL;
+    authorizer_lock();
+    authorizer_set_t& set = (*authorizers)[path];
+    while(authorizer == NULL) {
+      if(!set.idle.empty()) {
+        authorizer = set.idle.back();
+        set.idle.pop_back();
+      } else if(set.running < max_authorizers) {
+        authorizer = start_authorizer(path);
+        if(authorizer == NULL)
+          break;
+        set.running++;
+      } else if(!authorizer_wait(until)) {
+        break;
+      }
+    }
+    authorizer_unlock();
+    if(authorizer == NULL) {
+      print_to_error_log("no copy of " + path + " free to authorize " + identity);
+      return false;
+    }
+
+    bool result = ask_authorizer(authorizer, identity, decided);
+    authorizer_lock();
+    if(decided) {
+      set.idle.push_back(authorizer);
+    } else {
+      print_to_error_log(path + " didn't answer properly about " + identity + " - killing it");
+      stop_authorizer(authorizer);
+      set.running--;
+    }
+#if APR_HAS_THREADS
+    apr_thread_cond_signal(authorizer_released);
+#endif
+    authorizer_unlock();
+    debug(identity + (result ? " deemed authenticated by " : " deemed not authenticated by ") + path);
+    return result;
+  };
+
+  void AuthorizerPool::init(apr_pool_t *p, int max_instances, int timeout) {
+    max_authorizers = max_instances;
+    authorizer_timeout = timeout;
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&authorizer_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS ||
+       apr_thread_cond_create(&authorizer_released, p) != APR_SUCCESS) {
+      print_to_error_log("could not create authorization program mutex - not running prg: programs");
+      return;
+    }
+#endif
+    authorizer_pool = p;
+    authorizers = new map<string, authorizer_set_t>;
+    apr_pool_cleanup_register(p, NULL, AuthorizerPool::cleanup, apr_pool_cleanup_null);
+  };
+
+  apr_status_t AuthorizerPool::cleanup(void *data) {
+    // the processes themselves are killed along with their pools
+    if(authorizers != NULL) {
+      for(map<string, authorizer_set_t>::iterator it = authorizers->begin(); it != authorizers->end(); ++it)
+        for(vector<authorizer_t *>::iterator a = it->second.idle.begin(); a != it->second.idle.end(); ++a)
+          delete *a;
+      delete authorizers;
+      authorizers = NULL;
+    }
+    return APR_SUCCESS;
+  };
+
+  bool AuthorizerPool::authorize(const string& program, const string& identity) {
+    // the identity has to fit on one line
+    if(identity.find_first_of("\r\n") != string::npos) {
+      debug("not asking " + program + " about an identity with a line break in it");
+      return false;
+    }
+    bool authorized;
+    if(DecisionCache::lookup(program, identity, authorized))
+      return authorized;
+
+    // only real answers are remembered - not the ones from programs that couldn't be asked
+    bool decided;
+    if(program.compare(0, strlen(COPROCESS_PREFIX), COPROCESS_PREFIX) == 0)
+      authorized = coprocess_auth(program.substr(strlen(COPROCESS_PREFIX)), identity, decided);
+    else
+      authorized = exec_auth(program, identity, authorizer_timeout, decided);
+    if(decided)
+      DecisionCache::store(program, identity, authorized);
+    return authorized;
+  };
+}
+
@@ -0,0 +1,54 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace std;
+
+  // Runs AuthOpenIDUserProgram for each login.  A program given as "prg:<path>" is started
+  // once and kept running, like a RewriteMap prg: program: for each login it's sent the
+  // user's identity on a line of its own, and answers with a line that is "OK" if the user is
+  // authorized (anything else means they aren't).  Each child starts up to max_instances
+  // copies of each program as they're needed, and a login that finds them all busy waits for
+  // one.  A program given as just a path is run for each login with the identity as its only
+  // argument, and exits with 0 if the user is authorized.  Either way a program that hasn't
+  // answered within the timeout is killed, and the user isn't authorized.  All methods are
+  // safe to call from multiple threads.
+  class AuthorizerPool {
+  public:
+    // set up the pool for this child process (called from the child_init hook) - programs
+    // are killed when p is cleaned up.  Until this is called prg: programs can't be used.
+    static void init(apr_pool_t *p, int max_instances, int timeout);
+
+    // ask program whether identity is authorized - or, if it was asked recently, look up
+    // its answer in the DecisionCache
+    static bool authorize(const string& program, const string& identity);
+  private:
+    static apr_status_t cleanup(void *data);
+  };
+}
+
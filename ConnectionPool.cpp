@@ -0,0 +1,160 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+namespace modauthopenid {
+  using namespace std;
+
+  typedef struct pool_entry {
+    string type;
+    string location;
+    vector<Storage *> idle;
+    apr_time_t last_used;
+  } pool_entry_t;
+
+  // all pool state is per child process
+  static map<string, pool_entry_t> *entries = NULL;
+  static int pool_max_locations = 0;
+  static int pool_max_idle = 0;
+#if APR_HAS_THREADS
+  static apr_thread_mutex_t *pool_mutex = NULL;
+#endif
+
+  static void pool_lock() {
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(pool_mutex);
+#endif
+  };
+
+  static void pool_unlock() {
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(pool_mutex);
+#endif
+  };
+
+  static string pool_key(const string& type, const string& location) {
+    return type + ':' + location;
+  };
+
+  void ConnectionPool::init(apr_pool_t *p, int max_locations, int max_idle) {
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&pool_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+      print_to_error_log("could not create connection pool mutex - not pooling database connections");
+      return;
+    }
+#endif
+    pool_max_locations = (max_locations < 1) ? 1 : max_locations;
+    pool_max_idle = (max_idle < 1) ? 1 : max_idle;
+    entries = new map<string, pool_entry_t>;
+    apr_pool_cleanup_register(p, NULL, ConnectionPool::cleanup, apr_pool_cleanup_null);
+  };
+
+  Storage *ConnectionPool::acquire(const string& type, const string& location) {
+    if(entries == NULL)
+      return Storage::create(type, location);
+
+    Storage *storage = NULL;
+    pool_lock();
+    map<string, pool_entry_t>::iterator it = entries->find(pool_key(type, location));
+    if(it != entries->end()) {
+      it->second.last_used = apr_time_now();
+      if(!it->second.idle.empty()) {
+        storage = it->second.idle.back();
+        it->second.idle.pop_back();
+      }
+    }
+    pool_unlock();
+
+    if(storage == NULL)
+      storage = Storage::create(type, location);
+    return storage;
+  };
+
+  void ConnectionPool::release(Storage *storage) {
+    if(storage == NULL)
+      return;
+    if(entries == NULL || storage->failed()) {
+      delete storage;
+      return;
+    }
+
+    string key = pool_key(storage->type(), storage->location());
+    vector<Storage *> to_close;
+    pool_lock();
+    pool_entry_t& entry = (*entries)[key];
+    entry.type = storage->type();
+    entry.location = storage->location();
+    entry.last_used = apr_time_now();
+    if((int) entry.idle.size() < pool_max_idle)
+      entry.idle.push_back(storage);
+    else
+      to_close.push_back(storage);
+
+    // too many stores open - close everything for the least recently used one
+    if((int) entries->size() > pool_max_locations) {
+      map<string, pool_entry_t>::iterator lru = entries->end();
+      for(map<string, pool_entry_t>::iterator it = entries->begin(); it != entries->end(); ++it) {
+        if(it->first != key && (lru == entries->end() || it->second.last_used < lru->second.last_used))
+          lru = it;
+      }
+      if(lru != entries->end()) {
+        debug("closing idle connections to least recently used store " + lru->first);
+        to_close.insert(to_close.end(), lru->second.idle.begin(), lru->second.idle.end());
+        entries->erase(lru);
+      }
+    }
+    pool_unlock();
+
+    // close outside of the lock - closing may have to wait on the filesystem or network
+    for(vector<Storage *>::size_type i = 0; i < to_close.size(); i++)
+      delete to_close[i];
+  };
+
+  void ConnectionPool::locations(vector<pair<string, string> >& result) {
+    if(entries == NULL)
+      return;
+    pool_lock();
+    for(map<string, pool_entry_t>::iterator it = entries->begin(); it != entries->end(); ++it)
+      result.push_back(make_pair(it->second.type, it->second.location));
+    pool_unlock();
+  };
+
+  apr_status_t ConnectionPool::cleanup(void *data) {
+    if(entries == NULL)
+      return APR_SUCCESS;
+    for(map<string, pool_entry_t>::iterator it = entries->begin(); it != entries->end(); ++it) {
+      for(vector<Storage *>::size_type i = 0; i < it->second.idle.size(); i++)
+        delete it->second.idle[i];
+    }
+    delete entries;
+    entries = NULL;
+    return APR_SUCCESS;
+  };
+}
+
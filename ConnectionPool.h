@@ -0,0 +1,60 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace std;
+
+  // Per-child pool of open Storage instances, keyed by backend (AuthOpenIDStorage) and location
+  // (AuthOpenIDDBLocation).  Backends set themselves up (e.g., create their tables) once when
+  // an instance is opened rather than every time a SessionManager or MoidConsumer is
+  // constructed.  All methods are safe to call from multiple threads.
+  class ConnectionPool {
+  public:
+    // set up the pool for this child process (called from the child_init hook).  At most
+    // max_locations different stores are kept open (least recently used are closed first)
+    // and at most max_idle idle instances are kept for each one.  Everything is closed
+    // when p is cleaned up.
+    static void init(apr_pool_t *p, int max_locations, int max_idle);
+
+    // get a Storage of the given type for location, opening one if there isn't an idle one.
+    // If the pool hasn't been initialized (i.e., we're not in an apache child) a new
+    // one is opened every time.  Returns NULL if the store can't be opened.
+    static Storage *acquire(const string& type, const string& location);
+
+    // get the (type, location) of all stores this child currently keeps open
+    static void locations(vector<pair<string, string> >& result);
+
+    // hand a Storage back - if there was an error using it, it's closed rather than reused
+    static void release(Storage *storage);
+
+  private:
+    // pool cleanup function - close all idle instances
+    static apr_status_t cleanup(void *data);
+  };
+}
+
@@ -0,0 +1,186 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// seconds to wait for an OP to accept a connection, and to answer a request
+#define CURL_CONNECT_TIMEOUT 10
+#define CURL_REQUEST_TIMEOUT 30
+
+namespace modauthopenid {
+  using namespace std;
+
+  // all pool state is per child process
+  static vector<CURL *> *idle_handles = NULL;
+  static int curl_max_idle = 0;
+  static CURLSH *share = NULL;
+#if APR_HAS_THREADS
+  static apr_thread_mutex_t *curl_pool_mutex = NULL;
+  static apr_thread_mutex_t *share_mutexes[CURL_LOCK_DATA_LAST];
+#endif
+
+  static void curl_pool_lock() {
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(curl_pool_mutex);
+#endif
+  };
+
+  static void curl_pool_unlock() {
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(curl_pool_mutex);
+#endif
+  };
+
+#if APR_HAS_THREADS
+  static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    apr_thread_mutex_lock(share_mutexes[data]);
+  };
+
+  static void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    apr_thread_mutex_unlock(share_mutexes[data]);
+  };
+#endif
+
+  static size_t curl_write_string(char *data, size_t size, size_t nmemb, void *userp) {
+    ((string *) userp)->append(data, size * nmemb);
+    return size * nmemb;
+  };
+
+  void CurlPool::init(apr_pool_t *p, int max_idle) {
+    curl_global_init(CURL_GLOBAL_ALL);
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&curl_pool_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+      print_to_error_log("could not create curl pool mutex - not pooling curl handles");
+      return;
+    }
+    for(int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+      if(apr_thread_mutex_create(&share_mutexes[i], APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+        print_to_error_log("could not create curl share mutex - not pooling curl handles");
+        return;
+      }
+    }
+#endif
+    share = curl_share_init();
+    if(share != NULL) {
+#if APR_HAS_THREADS
+      curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+      curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+#endif
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    }
+    curl_max_idle = (max_idle < 1) ? 1 : max_idle;
+    idle_handles = new vector<CURL *>;
+    apr_pool_cleanup_register(p, NULL, CurlPool::cleanup, apr_pool_cleanup_null);
+  };
+
+  CURL *CurlPool::acquire() {
+    CURL *curl = NULL;
+    if(idle_handles != NULL) {
+      curl_pool_lock();
+      if(!idle_handles->empty()) {
+        curl = idle_handles->back();
+        idle_handles->pop_back();
+      }
+      curl_pool_unlock();
+    }
+    if(curl == NULL && (curl = curl_easy_init()) == NULL) {
+      print_to_error_log("could not create curl handle");
+      return NULL;
+    }
+    if(share != NULL)
+      curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    return curl;
+  };
+
+  void CurlPool::release(CURL *curl) {
+    if(curl == NULL)
+      return;
+    // clears the options but keeps the handle's open connections
+    curl_easy_reset(curl);
+    if(idle_handles != NULL) {
+      curl_pool_lock();
+      if((int) idle_handles->size() < curl_max_idle) {
+        idle_handles->push_back(curl);
+        curl = NULL;
+      }
+      curl_pool_unlock();
+    }
+    if(curl != NULL)
+      curl_easy_cleanup(curl);
+  };
+
+  bool CurlPool::post(const string& url, const string& body, string& response, long& status) {
+    CURL *curl = acquire();
+    if(curl == NULL)
+      return false;
+    response = "";
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.data());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) body.size());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_string);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long) CURL_CONNECT_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long) CURL_REQUEST_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, PACKAGE_STRING);
+
+    CURLcode rc = curl_easy_perform(curl);
+    status = 0;
+    double latency = 0;
+    if(rc == CURLE_OK)
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &latency);
+    release(curl);
+    EndpointHealth::record(url, rc != CURLE_OK || status >= 500, latency);
+    if(rc != CURLE_OK) {
+      print_to_error_log("request to " + url + " failed: " + string(curl_easy_strerror(rc)));
+      return false;
+    }
+    return true;
+  };
+
+  apr_status_t CurlPool::cleanup(void *data) {
+    if(idle_handles != NULL) {
+      for(vector<CURL *>::iterator it = idle_handles->begin(); it != idle_handles->end(); ++it)
+        curl_easy_cleanup(*it);
+      delete idle_handles;
+      idle_handles = NULL;
+    }
+    if(share != NULL) {
+      curl_share_cleanup(share);
+      share = NULL;
+    }
+    return APR_SUCCESS;
+  };
+}
+
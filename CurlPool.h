@@ -0,0 +1,60 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+
+namespace modauthopenid {
+  using namespace std;
+
+  // Per-child pool of curl easy handles for talking to OPs.  Handles keep their connections
+  // open between requests, and all of them share one DNS cache, TLS session cache and (with
+  // curl 7.57 or later) connection cache, so repeated requests to the same OP skip the TCP and
+  // TLS handshakes.  All methods are safe to call from multiple threads.
+  class CurlPool {
+  public:
+    // set up the pool for this child process (called from the child_init hook), keeping at
+    // most max_idle idle handles.  Everything is cleaned up with p.
+    static void init(apr_pool_t *p, int max_idle);
+
+    // get a handle with the shared caches attached and no other options set.  If the pool
+    // hasn't been initialized a new handle is made every time.  Returns NULL on error.
+    static CURL *acquire();
+
+    // hand a handle back
+    static void release(CURL *curl);
+
+    // POST body to url and put the response body in response and its HTTP status in status -
+    // false (with the error logged) if no response could be had.  How it went is recorded in
+    // EndpointHealth.
+    static bool post(const string& url, const string& body, string& response, long& status);
+
+  private:
+    // pool cleanup function - close all idle handles and the share
+    static apr_status_t cleanup(void *data);
+  };
+}
+
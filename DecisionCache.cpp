@@ -0,0 +1,95 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// maximum size of a program, identity and decision in the cache
+#define DECISION_CACHE_SLOT_SIZE 512
+
+// version byte at the start of a cached decision
+#define DECISION_CACHE_VERSION 1
+
+namespace modauthopenid {
+  using namespace std;
+
+  static SharedCache *decision_cache = NULL;
+  static int decision_allow_ttl = 0;
+  static int decision_deny_ttl = 0;
+  static string decision_flush_file = "";
+
+  static string decision_key(const string& program, const string& identity) {
+    return program + '\n' + identity;
+  };
+
+  // when the flush file was last touched - 0 if there isn't one
+  static time_t flushed_on() {
+    struct stat info;
+    if(decision_flush_file == "" || stat(decision_flush_file.c_str(), &info) != 0)
+      return 0;
+    return info.st_mtime;
+  };
+
+  void DecisionCache::init(apr_pool_t *p, int entries, int allow_ttl, int deny_ttl, const char *flush_file) {
+    decision_allow_ttl = allow_ttl;
+    decision_deny_ttl = deny_ttl;
+    decision_flush_file = (flush_file == NULL) ? "" : string(flush_file);
+    if(entries > 0 && (allow_ttl > 0 || deny_ttl > 0))
+      decision_cache = SharedCache::create(p, entries, DECISION_CACHE_SLOT_SIZE);
+  };
+
+  bool DecisionCache::lookup(const string& program, const string& identity, bool& authorized) {
+    string key = decision_key(program, identity);
+    string value;
+    if(decision_cache == NULL || !decision_cache->get(key, value))
+      return false;
+    string::size_type pos = 2;
+    apr_uint64_t decided_on;
+    if(value.size() < 2 || value[0] != (char) DECISION_CACHE_VERSION || !get_varint(value, pos, decided_on))
+      return false;
+    // a decision made in the same second as the flush might have been made just before it
+    if((time_t) decided_on <= flushed_on()) {
+      decision_cache->remove(key);
+      return false;
+    }
+    authorized = (value[1] != 0);
+    debug("found decision about " + identity + " by " + program + " in cache");
+    return true;
+  };
+
+  void DecisionCache::store(const string& program, const string& identity, bool authorized) {
+    int ttl = authorized ? decision_allow_ttl : decision_deny_ttl;
+    if(decision_cache == NULL || ttl <= 0)
+      return;
+    time_t now = time(0);
+    string value(1, (char) DECISION_CACHE_VERSION);
+    value += (char) (authorized ? 1 : 0);
+    put_varint(value, (apr_uint64_t) now);
+    decision_cache->put(decision_key(program, identity), value, now + ttl);
+  };
+}
+
@@ -0,0 +1,50 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace std;
+
+  // Shared memory cache of AuthOpenIDUserProgram decisions, keyed by program and identity, so a
+  // user logging in again doesn't have to ask the program again.  Users that were allowed and
+  // users that were refused are remembered for separate lengths of time.  Touching the flush
+  // file (if there is one) throws away every decision made before then.
+  class DecisionCache {
+  public:
+    // create the cache with room for entries decisions (none if entries is 0), keeping allowed
+    // users for allow_ttl seconds and refused ones for deny_ttl seconds (0 for not at all).
+    // flush_file may be NULL.  Called from post_config.
+    static void init(apr_pool_t *p, int entries, int allow_ttl, int deny_ttl, const char *flush_file);
+
+    // look up what program decided about identity - false on a miss
+    static bool lookup(const string& program, const string& identity, bool& authorized);
+
+    // remember what program decided about identity
+    static void store(const string& program, const string& identity, bool authorized);
+  };
+}
+
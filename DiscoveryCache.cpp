@@ -0,0 +1,87 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// maximum size of an identifier and its serialized discovery result in the cache
+#define DISCOVERY_CACHE_SLOT_SIZE 2048
+
+// version byte at the start of a cached discovery result
+#define DISCOVERY_CACHE_VERSION 1
+
+namespace modauthopenid {
+  using namespace std;
+  using namespace opkele;
+
+  static SharedCache *discovery_cache = NULL;
+  static int discovery_ttl = 0;
+  static int discovery_negative_ttl = 0;
+
+  void DiscoveryCache::init(apr_pool_t *p, int entries, int ttl, int negative_ttl) {
+    discovery_ttl = ttl;
+    discovery_negative_ttl = negative_ttl;
+    if(entries > 0 && ttl > 0)
+      discovery_cache = SharedCache::create(p, entries, DISCOVERY_CACHE_SLOT_SIZE);
+  };
+
+  bool DiscoveryCache::lookup(const string& identity, bool& found, string& normalized_id, vector<openid_endpoint_t>& endpoints) {
+    string value;
+    if(discovery_cache == NULL || !discovery_cache->get(identity, value))
+      return false;
+    if(value.size() < 2 || value[0] != (char) DISCOVERY_CACHE_VERSION)
+      return false;
+    found = (value[1] != 0);
+    endpoints.clear();
+    if(!found)
+      return true;
+
+    string::size_type pos = 2;
+    if(!get_string(value, pos, normalized_id) || !get_endpoints(value, pos, endpoints))
+      return false;
+    return !endpoints.empty();
+  };
+
+  void DiscoveryCache::store(const string& identity, const string& normalized_id, const vector<openid_endpoint_t>& endpoints) {
+    if(discovery_cache == NULL || endpoints.empty())
+      return;
+    string value(1, (char) DISCOVERY_CACHE_VERSION);
+    value += (char) 1;
+    put_string(value, normalized_id);
+    put_endpoints(value, endpoints);
+    discovery_cache->put(identity, value, time(0) + discovery_ttl);
+  };
+
+  void DiscoveryCache::store_failure(const string& identity) {
+    if(discovery_cache == NULL || discovery_negative_ttl <= 0)
+      return;
+    string value(1, (char) DISCOVERY_CACHE_VERSION);
+    value += (char) 0;
+    discovery_cache->put(identity, value, time(0) + discovery_negative_ttl);
+  };
+}
+
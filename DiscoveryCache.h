@@ -0,0 +1,55 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+
+namespace modauthopenid {
+  using namespace opkele;
+  using namespace std;
+
+  // Shared memory cache of discovery results, keyed by the identifier the user gave, so that
+  // starting a login for an identifier (or OP) that was used recently doesn't do Yadis/XRDS/HTML
+  // discovery again.  Identifiers that couldn't be discovered are remembered for a shorter time
+  // so that repeated attempts don't each wait for the discovery to fail.
+  class DiscoveryCache {
+  public:
+    // create the cache with room for entries identifiers (none if entries is 0), keeping
+    // results for ttl seconds and failures for negative_ttl seconds.  Called from post_config.
+    static void init(apr_pool_t *p, int entries, int ttl, int negative_ttl);
+
+    // look up identity - returns false on a miss.  On a hit, found is false if discovery
+    // failed for identity recently; otherwise normalized_id and endpoints hold the result.
+    static bool lookup(const string& identity, bool& found, string& normalized_id, vector<openid_endpoint_t>& endpoints);
+
+    // remember the result of discovering identity
+    static void store(const string& identity, const string& normalized_id, const vector<openid_endpoint_t>& endpoints);
+
+    // remember that identity couldn't be discovered
+    static void store_failure(const string& identity);
+  };
+}
+
@@ -0,0 +1,164 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// most endpoints to keep track of per child - everything is forgotten when it fills up
+#define ENDPOINT_HEALTH_SIZE 1024
+
+// seconds to leave an endpoint alone after it fails - doubled for each further failure in a
+// row, up to the maximum
+#define ENDPOINT_RETRY_INTERVAL 30
+#define ENDPOINT_MAX_RETRY_INTERVAL 600
+
+// average seconds per request above which an endpoint counts as slow
+#define ENDPOINT_SLOW_LATENCY 5.0
+
+namespace modauthopenid {
+  using namespace std;
+  using namespace opkele;
+
+  typedef struct endpoint_health {
+    int failures;         // failed requests in a row
+    time_t retry_after;   // when to try the endpoint again after failures
+    double latency;       // moving average of seconds per successful request
+  } endpoint_health_t;
+
+  // where endpoints rank in order
+  typedef enum { ENDPOINT_HEALTHY, ENDPOINT_SLOW, ENDPOINT_FAILING } endpoint_state_t;
+
+  static map<string, endpoint_health_t> *endpoints_health = NULL;
+#if APR_HAS_THREADS
+  static apr_thread_mutex_t *health_mutex = NULL;
+#endif
+
+  static void health_lock() {
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(health_mutex);
+#endif
+  };
+
+  static void health_unlock() {
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(health_mutex);
+#endif
+  };
+
+  // must be called with the lock held
+  static endpoint_state_t endpoint_state(const string& uri, time_t now) {
+    map<string, endpoint_health_t>::const_iterator it = endpoints_health->find(uri);
+    if(it == endpoints_health->end())
+      return ENDPOINT_HEALTHY;
+    if(it->second.failures > 0 && it->second.retry_after > now)
+      return ENDPOINT_FAILING;
+    if(it->second.latency > ENDPOINT_SLOW_LATENCY)
+      return ENDPOINT_SLOW;
+    return ENDPOINT_HEALTHY;
+  };
+
+  void EndpointHealth::init(apr_pool_t *p) {
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&health_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+      print_to_error_log("could not create endpoint health mutex - not tracking endpoint health");
+      return;
+    }
+#endif
+    endpoints_health = new map<string, endpoint_health_t>;
+    apr_pool_cleanup_register(p, NULL, EndpointHealth::cleanup, apr_pool_cleanup_null);
+  };
+
+  apr_status_t EndpointHealth::cleanup(void *data) {
+    delete endpoints_health;
+    endpoints_health = NULL;
+    return APR_SUCCESS;
+  };
+
+  void EndpointHealth::record(const string& uri, bool failed, double latency) {
+    if(endpoints_health == NULL)
+      return;
+    health_lock();
+    map<string, endpoint_health_t>::iterator it = endpoints_health->find(uri);
+    if(it == endpoints_health->end()) {
+      if(endpoints_health->size() >= ENDPOINT_HEALTH_SIZE)
+        endpoints_health->clear();
+      endpoint_health_t health;
+      health.failures = 0;
+      health.retry_after = 0;
+      health.latency = latency;
+      it = endpoints_health->insert(make_pair(uri, health)).first;
+    }
+    endpoint_health_t& health = it->second;
+    if(failed) {
+      int interval = ENDPOINT_RETRY_INTERVAL;
+      for(int i = 0; i < health.failures && interval < ENDPOINT_MAX_RETRY_INTERVAL; i++)
+        interval *= 2;
+      if(interval > ENDPOINT_MAX_RETRY_INTERVAL)
+        interval = ENDPOINT_MAX_RETRY_INTERVAL;
+      health.failures++;
+      health.retry_after = time(0) + interval;
+    } else {
+      health.failures = 0;
+      health.latency = (3 * health.latency + latency) / 4;
+    }
+    health_unlock();
+  };
+
+  bool EndpointHealth::healthy(const string& uri) {
+    if(endpoints_health == NULL)
+      return true;
+    health_lock();
+    bool failing = (endpoint_state(uri, time(0)) == ENDPOINT_FAILING);
+    health_unlock();
+    return !failing;
+  };
+
+  void EndpointHealth::order(vector<openid_endpoint_t>& endpoints) {
+    if(endpoints_health == NULL || endpoints.size() < 2)
+      return;
+    vector<openid_endpoint_t> slow, failing;
+    vector<openid_endpoint_t>::iterator healthy_end = endpoints.begin();
+    time_t now = time(0);
+    health_lock();
+    for(vector<openid_endpoint_t>::iterator it = endpoints.begin(); it != endpoints.end(); ++it) {
+      endpoint_state_t state = endpoint_state(it->uri, now);
+      if(state == ENDPOINT_HEALTHY)
+        *(healthy_end++) = *it;
+      else if(state == ENDPOINT_SLOW)
+        slow.push_back(*it);
+      else
+        failing.push_back(*it);
+    }
+    health_unlock();
+    if(healthy_end == endpoints.end())
+      return;
+    debug("moving slow or failing endpoints to the end of the queue");
+    vector<openid_endpoint_t>::iterator out = copy(slow.begin(), slow.end(), healthy_end);
+    copy(failing.begin(), failing.end(), out);
+  };
+}
+
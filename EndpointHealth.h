@@ -0,0 +1,58 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace opkele;
+  using namespace std;
+
+  // Per-child record of how OP endpoints have been doing - consecutive failed requests and the
+  // average time taken by recent ones - fed by every request CurlPool makes.  An endpoint that
+  // failed recently is left alone for a while (longer after each further failure), and one that
+  // has been slow to answer is only tried after the quick ones.  All methods are safe to call
+  // from multiple threads.
+  class EndpointHealth {
+  public:
+    // set up the tracker for this child process (called from the child_init hook) - until this is
+    // called every endpoint counts as healthy
+    static void init(apr_pool_t *p);
+
+    // record a request to uri that took latency seconds - failed is true if the OP couldn't be
+    // reached or gave a server error
+    static void record(const string& uri, bool failed, double latency);
+
+    // false if uri failed recently
+    static bool healthy(const string& uri);
+
+    // reorder endpoints so healthy ones come first, then slow ones, then ones that failed
+    // recently - otherwise keeping their order (the OP's priorities)
+    static void order(vector<openid_endpoint_t>& endpoints);
+  private:
+    static apr_status_t cleanup(void *data);
+  };
+}
+
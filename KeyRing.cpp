@@ -0,0 +1,192 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// bytes of the HMAC-SHA256 kept in a token
+#define TOKEN_MAC_SIZE 16
+#define TOKEN_IV_SIZE 16
+
+namespace modauthopenid {
+  using namespace std;
+
+  // base64 with the url safe alphabet (RFC 4648 section 5) and no padding
+  static string base64url_encode(const string& data) {
+    if(data.empty())
+      return "";
+    string s = util::encode_base64(data.data(), data.size());
+    string::size_type end = s.find('=');
+    if(end != string::npos)
+      s.erase(end);
+    for(string::size_type i = 0; i < s.size(); i++) {
+      if(s[i] == '+') s[i] = '-';
+      else if(s[i] == '/') s[i] = '_';
+    }
+    return s;
+  };
+
+  static bool base64url_decode(string s, string& data) {
+    for(string::size_type i = 0; i < s.size(); i++) {
+      if(s[i] == '-') s[i] = '+';
+      else if(s[i] == '_') s[i] = '/';
+      else if(!isalnum((unsigned char) s[i])) return false;
+    }
+    while(s.size() % 4 != 0)
+      s += '=';
+    vector<unsigned char> bytes;
+    try {
+      util::decode_base64(s, bytes);
+    } catch(opkele::exception &e) {
+      return false;
+    }
+    data.assign(bytes.begin(), bytes.end());
+    return true;
+  };
+
+  // compare without bailing out at the first difference, so timing doesn't leak how much
+  // of a forged mac was right
+  static bool constant_time_equals(const string& a, const string& b) {
+    if(a.size() != b.size())
+      return false;
+    unsigned char diff = 0;
+    for(string::size_type i = 0; i < a.size(); i++)
+      diff |= (unsigned char) (a[i] ^ b[i]);
+    return diff == 0;
+  };
+
+  static string hmac_sha256(const unsigned char *key, int key_len, const string& data) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    HMAC(EVP_sha256(), key, key_len, (const unsigned char *) data.data(), data.size(), md, &md_len);
+    return string((char *) md, md_len);
+  };
+
+  // AES-128-CTR - the same call encrypts and decrypts
+  static bool aes_ctr(const unsigned char *key, const string& iv, const string& in, string& out) {
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if(ctx == NULL)
+      return false;
+    vector<unsigned char> buf(in.size() + TOKEN_IV_SIZE);
+    int len = 0, final_len = 0;
+    bool ok = EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), NULL, key, (const unsigned char *) iv.data()) == 1 &&
+      EVP_EncryptUpdate(ctx, &buf[0], &len, (const unsigned char *) in.data(), in.size()) == 1 &&
+      EVP_EncryptFinal_ex(ctx, &buf[0] + len, &final_len) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    if(ok)
+      out.assign((char *) &buf[0], len + final_len);
+    return ok;
+  };
+
+  string KeyRing::add_key(const string& id, const string& secret) {
+    if(id.empty() || id.size() > 16)
+      return "key id must be between 1 and 16 characters long";
+    for(string::size_type i = 0; i < id.size(); i++)
+      if(!isalnum((unsigned char) id[i]))
+        return "key id may only contain letters and numbers";
+    if(secret.size() < 16)
+      return "secret must be at least 16 characters long";
+    if(find_key(id) != NULL)
+      return "key id is already in use";
+
+    // derive separate signing and encryption keys from the secret
+    ring_key_t k;
+    k.id = id;
+    string mac_key = hmac_sha256((const unsigned char *) secret.data(), secret.size(), "mod_auth_openid signing key");
+    string enc_key = hmac_sha256((const unsigned char *) secret.data(), secret.size(), "mod_auth_openid encryption key");
+    memcpy(k.mac_key, mac_key.data(), sizeof(k.mac_key));
+    memcpy(k.enc_key, enc_key.data(), sizeof(k.enc_key));
+    keys.push_back(k);
+    return "";
+  };
+
+  const KeyRing::ring_key_t *KeyRing::find_key(const string& id) const {
+    for(vector<ring_key_t>::size_type i = 0; i < keys.size(); i++)
+      if(keys[i].id == id)
+        return &keys[i];
+    return NULL;
+  };
+
+  // the mac of a token's signed part, made for purpose
+  static string token_mac(const unsigned char *mac_key, int key_len, token_purpose_t purpose, const string& signed_part) {
+    return hmac_sha256(mac_key, key_len, string(1, (char) purpose) + signed_part).substr(0, TOKEN_MAC_SIZE);
+  };
+
+  // tokens look like <key id>.<p|e>.<payload>.<mac>, where the payload is base64url encoded
+  // (for 'e', after AES-CTR encryption with a random iv in front) and the mac is a truncated
+  // HMAC-SHA256 of the token's purpose followed by everything before the mac
+  string KeyRing::seal(token_purpose_t purpose, const string& payload, bool encrypt) const {
+    if(keys.empty())
+      return "";
+    const ring_key_t& k = keys[0];
+    string body = payload;
+    if(encrypt) {
+      unsigned char iv[TOKEN_IV_SIZE];
+      if(RAND_bytes(iv, sizeof(iv)) != 1)
+        return "";
+      string ciphertext;
+      if(!aes_ctr(k.enc_key, string((char *) iv, sizeof(iv)), payload, ciphertext))
+        return "";
+      body = string((char *) iv, sizeof(iv)) + ciphertext;
+    }
+    string token = k.id + (encrypt ? ".e." : ".p.") + base64url_encode(body);
+    return token + "." + base64url_encode(token_mac(k.mac_key, sizeof(k.mac_key), purpose, token));
+  };
+
+  bool KeyRing::open(token_purpose_t purpose, const string& token, string& payload) const {
+    string::size_type kid_end = token.find('.');
+    string::size_type mac_start = token.rfind('.');
+    if(kid_end == string::npos || mac_start == kid_end || token.size() < kid_end + 3 || token[kid_end + 2] != '.')
+      return false;
+    const ring_key_t *k = find_key(token.substr(0, kid_end));
+    if(k == NULL) {
+      debug("token signed with unknown key " + token.substr(0, kid_end));
+      return false;
+    }
+
+    string mac;
+    if(!base64url_decode(token.substr(mac_start + 1), mac))
+      return false;
+    string signed_part = token.substr(0, mac_start);
+    if(!constant_time_equals(mac, token_mac(k->mac_key, sizeof(k->mac_key), purpose, signed_part))) {
+      debug("token has a bad signature");
+      return false;
+    }
+
+    string body;
+    if(!base64url_decode(signed_part.substr(kid_end + 3), body))
+      return false;
+    char mode = token[kid_end + 1];
+    if(mode == 'p') {
+      payload = body;
+      return true;
+    }
+    if(mode != 'e' || body.size() < TOKEN_IV_SIZE)
+      return false;
+    return aes_ctr(k->enc_key, body.substr(0, TOKEN_IV_SIZE), body.substr(TOKEN_IV_SIZE), payload);
+  };
+}
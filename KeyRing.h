@@ -0,0 +1,70 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace std;
+
+  // What a token is for.  The purpose is signed along with the token, so a token made for one
+  // purpose (say, a session cookie) is never accepted for another (say, a login token).
+  typedef enum { TOKEN_SESSION = 's', TOKEN_LOGIN = 'l' } token_purpose_t;
+
+  // A set of secret keys used to sign (and optionally encrypt) data that is handed to the
+  // browser, such as stateless session cookies.  The first key added signs everything new;
+  // all keys are tried when verifying, so keys can be rotated by adding a new key in front
+  // and removing the old one once everything it signed has expired.
+  class KeyRing {
+  public:
+    // add a key with the given id - returns an error message, or "" if the key is fine
+    string add_key(const string& id, const string& secret);
+
+    // true if no keys have been added
+    bool empty() const { return keys.empty(); };
+
+    // make a url and cookie safe token for purpose holding payload, signed with the first key
+    // and encrypted as well if encrypt is true
+    string seal(token_purpose_t purpose, const string& payload, bool encrypt) const;
+
+    // check token's signature and get the payload out of it - returns false if the token
+    // is malformed, has been tampered with, wasn't made with one of our keys or was made for
+    // another purpose
+    bool open(token_purpose_t purpose, const string& token, string& payload) const;
+
+  private:
+    typedef struct key {
+      string id;
+      unsigned char mac_key[32];
+      unsigned char enc_key[16];
+    } ring_key_t;
+
+    vector<ring_key_t> keys;
+
+    // the key with the given id - NULL if there isn't one
+    const ring_key_t *find_key(const string& id) const;
+  };
+}
+
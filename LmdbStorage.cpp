@@ -0,0 +1,542 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+#ifdef HAVE_LMDB
+
+// size of the memory map - this is address space, not memory, and is the most the database
+// file can ever grow to
+#define LMDB_MAP_SIZE (256 * 1024 * 1024)
+
+// each pooled LmdbStorage keeps one reader slot, and every thread of every child may hold one
+#define LMDB_MAX_READERS 1024
+
+// bytes at the start of every value holding its expiry time
+#define LMDB_EXPIRES_SIZE 8
+
+namespace modauthopenid {
+  using namespace std;
+  using namespace opkele;
+
+  // environments opened by this child process, by location
+  static map<string, lmdb_env_t *> *envs = NULL;
+#if APR_HAS_THREADS
+  static apr_thread_mutex_t *envs_mutex = NULL;
+#endif
+
+  static void envs_lock() {
+#if APR_HAS_THREADS
+    if(envs_mutex != NULL)
+      apr_thread_mutex_lock(envs_mutex);
+#endif
+  };
+
+  static void envs_unlock() {
+#if APR_HAS_THREADS
+    if(envs_mutex != NULL)
+      apr_thread_mutex_unlock(envs_mutex);
+#endif
+  };
+
+  static apr_status_t lmdb_envs_cleanup(void *data) {
+    if(envs == NULL)
+      return APR_SUCCESS;
+    for(map<string, lmdb_env_t *>::iterator it = envs->begin(); it != envs->end(); ++it) {
+      mdb_env_close(it->second->env);
+      delete it->second;
+    }
+    delete envs;
+    envs = NULL;
+    return APR_SUCCESS;
+  };
+
+  static MDB_val make_val(const string& s) {
+    MDB_val v;
+    v.mv_size = s.size();
+    v.mv_data = (void *) s.data();
+    return v;
+  };
+
+  static string val_string(const MDB_val& v) {
+    return string((const char *) v.mv_data, v.mv_size);
+  };
+
+  // read the expiry time at the start of a value straight out of the map
+  static time_t val_expires(const MDB_val& v) {
+    if(v.mv_size < LMDB_EXPIRES_SIZE)
+      return 0;
+    const unsigned char *p = (const unsigned char *) v.mv_data;
+    apr_uint64_t expires_on = 0;
+    for(int i = 0; i < LMDB_EXPIRES_SIZE; i++)
+      expires_on = (expires_on << 8) | p[i];
+    return (time_t) expires_on;
+  };
+
+  static string val_payload(const MDB_val& v) {
+    if(v.mv_size < LMDB_EXPIRES_SIZE)
+      return "";
+    return string((const char *) v.mv_data + LMDB_EXPIRES_SIZE, v.mv_size - LMDB_EXPIRES_SIZE);
+  };
+
+  static string make_value(time_t expires_on, const string& payload) {
+    string value(LMDB_EXPIRES_SIZE, '\0');
+    apr_uint64_t e = (apr_uint64_t) expires_on;
+    for(int i = LMDB_EXPIRES_SIZE - 1; i >= 0; i--, e >>= 8)
+      value[i] = (char) (e & 0xff);
+    return value + payload;
+  };
+
+  // associations are keyed by server and handle, so that all of a server's associations are
+  // next to each other
+  static string assoc_key(const string& server, const string& handle) {
+    return server + '\n' + handle;
+  };
+
+  static void log_lmdb_error(int rc, const string& context) {
+    print_to_error_log("LMDB error - " + context + ": " + string(mdb_strerror(rc)));
+  };
+
+  static lmdb_env_t *open_env(const string& location) {
+    int rc;
+    lmdb_env_t *e = new lmdb_env_t;
+    if((rc = mdb_env_create(&(e->env))) != MDB_SUCCESS) {
+      log_lmdb_error(rc, "problem creating environment");
+      delete e;
+      return NULL;
+    }
+    mdb_env_set_mapsize(e->env, LMDB_MAP_SIZE);
+    mdb_env_set_maxdbs(e->env, 8);
+    mdb_env_set_maxreaders(e->env, LMDB_MAX_READERS);
+
+    // MDB_NOTLS because a pooled instance's reader may be used by any thread; MDB_NOSYNC
+    // because nothing here is worth an fsync per login - a crash loses the last few sessions
+    // and nonces, but never corrupts the database
+    rc = mdb_env_open(e->env, location.c_str(), MDB_NOSUBDIR | MDB_NOTLS | MDB_NOSYNC, 0600);
+    if(rc != MDB_SUCCESS) {
+      log_lmdb_error(rc, "problem opening database " + location);
+      mdb_env_close(e->env);
+      delete e;
+      return NULL;
+    }
+
+    // free reader slots left behind by children that died
+    int dead;
+    mdb_reader_check(e->env, &dead);
+
+    MDB_txn *txn;
+    if((rc = mdb_txn_begin(e->env, NULL, 0, &txn)) != MDB_SUCCESS) {
+      log_lmdb_error(rc, "problem starting transaction");
+      mdb_env_close(e->env);
+      delete e;
+      return NULL;
+    }
+    if((rc = mdb_dbi_open(txn, "sessions", MDB_CREATE, &(e->sessions))) != MDB_SUCCESS ||
+       (rc = mdb_dbi_open(txn, "associations", MDB_CREATE, &(e->assocs))) != MDB_SUCCESS ||
+       (rc = mdb_dbi_open(txn, "authentication_sessions", MDB_CREATE, &(e->auth_sessions))) != MDB_SUCCESS ||
+       (rc = mdb_dbi_open(txn, "response_nonces", MDB_CREATE, &(e->nonces))) != MDB_SUCCESS ||
+       (rc = mdb_dbi_open(txn, "op_capabilities", MDB_CREATE, &(e->capabilities))) != MDB_SUCCESS ||
+       (rc = mdb_dbi_open(txn, "maintenance", MDB_CREATE, &(e->maintenance))) != MDB_SUCCESS ||
+       (rc = mdb_txn_commit(txn)) != MDB_SUCCESS) {
+      if(rc != MDB_SUCCESS)
+        mdb_txn_abort(txn);
+      log_lmdb_error(rc, "problem creating databases in " + location);
+      mdb_env_close(e->env);
+      delete e;
+      return NULL;
+    }
+    debug("opened lmdb environment " + location);
+    return e;
+  };
+
+  void LmdbStorage::init(apr_pool_t *p) {
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&envs_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+      print_to_error_log("could not create lmdb environment mutex - lmdb storage is unavailable");
+      return;
+    }
+#endif
+    envs = new map<string, lmdb_env_t *>;
+    apr_pool_cleanup_register(p, NULL, lmdb_envs_cleanup, apr_pool_cleanup_null);
+  };
+
+  LmdbStorage::LmdbStorage(lmdb_env_t *_env) : env(_env), reader(NULL) {
+  };
+
+  LmdbStorage *LmdbStorage::open(const string& location) {
+    lmdb_env_t *e = NULL;
+    envs_lock();
+    // outside of an apache child (i.e., db_info) there's only ever one instance
+    if(envs == NULL)
+      envs = new map<string, lmdb_env_t *>;
+    map<string, lmdb_env_t *>::iterator it = envs->find(location);
+    if(it != envs->end())
+      e = it->second;
+    else if((e = open_env(location)) != NULL)
+      (*envs)[location] = e;
+    envs_unlock();
+    return (e == NULL) ? NULL : new LmdbStorage(e);
+  };
+
+  LmdbStorage::~LmdbStorage() {
+    // the environment stays open for the other instances, and is closed with the child's pool
+    if(reader != NULL)
+      mdb_txn_abort(reader);
+  };
+
+  bool LmdbStorage::test_result(int result, const string& context) {
+    if(result != MDB_SUCCESS) {
+      log_lmdb_error(result, context);
+      has_failed = true;
+      return false;
+    }
+    return true;
+  };
+
+  bool LmdbStorage::begin_read() {
+    if(reader != NULL)
+      return test_result(mdb_txn_renew(reader), "problem renewing read transaction");
+    return test_result(mdb_txn_begin(env->env, NULL, MDB_RDONLY, &reader), "problem starting read transaction");
+  };
+
+  void LmdbStorage::end_read() {
+    // keeps the reader slot, but lets writers reuse the pages this transaction was looking at
+    mdb_txn_reset(reader);
+  };
+
+  bool LmdbStorage::get(MDB_dbi dbi, const string& key, string& value) {
+    if(!begin_read())
+      return false;
+    MDB_val k = make_val(key), v;
+    int rc = mdb_get(reader, dbi, &k, &v);
+    bool found = (rc == MDB_SUCCESS && val_expires(v) >= time(0));
+    if(found)
+      value = val_payload(v);
+    end_read();
+    if(rc != MDB_NOTFOUND)
+      test_result(rc, "problem fetching " + key);
+    return found;
+  };
+
+  void LmdbStorage::put(MDB_dbi dbi, const string& key, const string& value, time_t expires_on) {
+    MDB_txn *txn;
+    if(!test_result(mdb_txn_begin(env->env, NULL, 0, &txn), "problem starting write transaction"))
+      return;
+    string data = make_value(expires_on, value);
+    MDB_val k = make_val(key), v = make_val(data);
+    int rc = mdb_put(txn, dbi, &k, &v, 0);
+    if(rc != MDB_SUCCESS) {
+      mdb_txn_abort(txn);
+      test_result(rc, "problem storing " + key);
+      return;
+    }
+    test_result(mdb_txn_commit(txn), "problem committing " + key);
+  };
+
+  void LmdbStorage::del(MDB_dbi dbi, const string& key) {
+    MDB_txn *txn;
+    if(!test_result(mdb_txn_begin(env->env, NULL, 0, &txn), "problem starting write transaction"))
+      return;
+    MDB_val k = make_val(key);
+    int rc = mdb_del(txn, dbi, &k, NULL);
+    if(rc != MDB_SUCCESS) {
+      mdb_txn_abort(txn);
+      if(rc != MDB_NOTFOUND)
+        test_result(rc, "problem deleting " + key);
+      return;
+    }
+    test_result(mdb_txn_commit(txn), "problem committing delete of " + key);
+  };
+
+  bool LmdbStorage::get_session(const string& session_id, session_t& session) {
+    string value;
+    if(!get(env->sessions, session_id, value))
+      return false;
+    if(!unserialize_session(value, session)) {
+      print_to_error_log("could not read session " + session_id + " - ignoring the session");
+      return false;
+    }
+    return true;
+  };
+
+  void LmdbStorage::store_session(const session_t& session) {
+    string value;
+    serialize_session(session, value);
+    put(env->sessions, session.session_id, value, session.expires_on);
+  };
+
+  void LmdbStorage::store_assoc(const assoc_record_t& assoc) {
+    string value;
+    put_string(value, assoc.type);
+    put_string(value, string(assoc.secret.begin(), assoc.secret.end()));
+    put(env->assocs, assoc_key(assoc.server, assoc.handle), value, assoc.expires_on);
+  };
+
+  // fill in assoc from its key and a value made by store_assoc
+  static bool read_assoc(const string& key, const MDB_val& v, assoc_record_t& assoc) {
+    string::size_type split = key.find('\n');
+    string value = val_payload(v), secret;
+    string::size_type pos = 0;
+    if(split == string::npos || !get_string(value, pos, assoc.type) || !get_string(value, pos, secret))
+      return false;
+    assoc.server = key.substr(0, split);
+    assoc.handle = key.substr(split + 1);
+    assoc.secret.assign(secret.begin(), secret.end());
+    assoc.expires_on = val_expires(v);
+    return true;
+  };
+
+  bool LmdbStorage::get_assoc(const string& server, const string& handle, assoc_record_t& assoc) {
+    if(!begin_read())
+      return false;
+    string key = assoc_key(server, handle);
+    MDB_val k = make_val(key), v;
+    int rc = mdb_get(reader, env->assocs, &k, &v);
+    bool found = (rc == MDB_SUCCESS && val_expires(v) >= time(0) && read_assoc(key, v, assoc));
+    end_read();
+    if(rc != MDB_NOTFOUND)
+      test_result(rc, "problem fetching association");
+    return found;
+  };
+
+  bool LmdbStorage::find_assoc(const string& server, assoc_record_t& assoc) {
+    if(!begin_read())
+      return false;
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(reader, env->assocs, &cursor);
+    if(rc != MDB_SUCCESS) {
+      end_read();
+      return test_result(rc, "problem opening association cursor");
+    }
+
+    // all of server's associations sort right after "server\n"
+    string prefix = server + '\n';
+    MDB_val k = make_val(prefix), v;
+    time_t now = time(0), latest = 0;
+    bool found = false;
+    for(rc = mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE); rc == MDB_SUCCESS; rc = mdb_cursor_get(cursor, &k, &v, MDB_NEXT)) {
+      if(k.mv_size < prefix.size() || memcmp(k.mv_data, prefix.data(), prefix.size()) != 0)
+        break;
+      // the one that lasts longest
+      if(val_expires(v) >= now && val_expires(v) > latest && read_assoc(val_string(k), v, assoc)) {
+        latest = val_expires(v);
+        found = true;
+      }
+    }
+    mdb_cursor_close(cursor);
+    end_read();
+    if(rc != MDB_SUCCESS && rc != MDB_NOTFOUND)
+      test_result(rc, "problem looking up association");
+    return found;
+  };
+
+  void LmdbStorage::remove_assoc(const string& server, const string& handle) {
+    del(env->assocs, assoc_key(server, handle));
+  };
+
+  bool LmdbStorage::get_capabilities(const string& server, op_capabilities_t& caps) {
+    string value;
+    if(!get(env->capabilities, server, value))
+      return false;
+    string::size_type pos = 0;
+    apr_uint64_t stateless, expires_on;
+    if(!get_string(value, pos, caps.assoc_type) || !get_string(value, pos, caps.session_type) ||
+       !get_varint(value, pos, stateless) || !get_varint(value, pos, expires_on))
+      return false;
+    caps.server = server;
+    caps.stateless = (stateless != 0);
+    caps.expires_on = (time_t) expires_on;
+    return true;
+  };
+
+  void LmdbStorage::store_capabilities(const op_capabilities_t& caps) {
+    string value;
+    put_string(value, caps.assoc_type);
+    put_string(value, caps.session_type);
+    put_varint(value, caps.stateless ? 1 : 0);
+    put_varint(value, (apr_uint64_t) caps.expires_on);
+    put(env->capabilities, caps.server, value, caps.expires_on);
+  };
+
+  void LmdbStorage::store_auth_session(const auth_session_t& auth_session) {
+    string value;
+    put_string(value, auth_session.endpoint.uri);
+    put_string(value, auth_session.endpoint.claimed_id);
+    put_string(value, auth_session.endpoint.local_id);
+    put_string(value, auth_session.normalized_id);
+    put_endpoints(value, auth_session.fallbacks);
+    put(env->auth_sessions, auth_session.nonce, value, auth_session.expires_on);
+  };
+
+  bool LmdbStorage::get_auth_session(const string& nonce, auth_session_t& auth_session) {
+    if(!begin_read())
+      return false;
+    MDB_val k = make_val(nonce), v;
+    int rc = mdb_get(reader, env->auth_sessions, &k, &v);
+    bool found = false;
+    if(rc == MDB_SUCCESS && val_expires(v) >= time(0)) {
+      string value = val_payload(v);
+      string::size_type pos = 0;
+      found = get_string(value, pos, auth_session.endpoint.uri) && get_string(value, pos, auth_session.endpoint.claimed_id) &&
+        get_string(value, pos, auth_session.endpoint.local_id) && get_string(value, pos, auth_session.normalized_id) &&
+        get_endpoints(value, pos, auth_session.fallbacks);
+      auth_session.nonce = nonce;
+      auth_session.expires_on = val_expires(v);
+    }
+    end_read();
+    if(rc != MDB_NOTFOUND)
+      test_result(rc, "problem fetching authentication session");
+    return found;
+  };
+
+  void LmdbStorage::remove_auth_session(const string& nonce) {
+    del(env->auth_sessions, nonce);
+  };
+
+  bool LmdbStorage::add_nonce(const string& server, const string& nonce, time_t expires_on) {
+    // the check and the insert have to be in the same write transaction, otherwise two
+    // children could both accept the nonce
+    MDB_txn *txn;
+    if(!test_result(mdb_txn_begin(env->env, NULL, 0, &txn), "problem starting write transaction"))
+      return false;
+    string key = server + '\n' + nonce;
+    MDB_val k = make_val(key), v;
+    int rc = mdb_get(txn, env->nonces, &k, &v);
+    if(rc == MDB_SUCCESS && val_expires(v) >= time(0)) {
+      mdb_txn_abort(txn);
+      return false;
+    }
+    if(rc != MDB_SUCCESS && rc != MDB_NOTFOUND) {
+      mdb_txn_abort(txn);
+      return test_result(rc, "problem looking up nonce");
+    }
+    string data = make_value(expires_on, "");
+    v = make_val(data);
+    if((rc = mdb_put(txn, env->nonces, &k, &v, 0)) != MDB_SUCCESS) {
+      mdb_txn_abort(txn);
+      return test_result(rc, "problem adding new nonce");
+    }
+    return test_result(mdb_txn_commit(txn), "problem committing new nonce");
+  };
+
+  void LmdbStorage::ween_dbi(MDB_dbi dbi, int batch_size) {
+    MDB_txn *txn;
+    if(!test_result(mdb_txn_begin(env->env, NULL, 0, &txn), "problem starting write transaction"))
+      return;
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(txn, dbi, &cursor);
+    if(rc != MDB_SUCCESS) {
+      mdb_txn_abort(txn);
+      test_result(rc, "problem opening cursor");
+      return;
+    }
+    time_t now = time(0);
+    int removed = 0;
+    MDB_val k, v;
+    for(rc = mdb_cursor_get(cursor, &k, &v, MDB_FIRST); rc == MDB_SUCCESS && (batch_size < 0 || removed < batch_size);
+        rc = mdb_cursor_get(cursor, &k, &v, MDB_NEXT)) {
+      if(val_expires(v) >= now)
+        continue;
+      if((rc = mdb_cursor_del(cursor, 0)) != MDB_SUCCESS)
+        break;
+      removed++;
+    }
+    mdb_cursor_close(cursor);
+    if(rc != MDB_SUCCESS && rc != MDB_NOTFOUND) {
+      mdb_txn_abort(txn);
+      test_result(rc, "problem weening expired entries");
+      return;
+    }
+    test_result(mdb_txn_commit(txn), "problem committing weened entries");
+  };
+
+  void LmdbStorage::ween_expired(int batch_size) {
+    MDB_dbi dbis[] = { env->sessions, env->assocs, env->auth_sessions, env->nonces, env->capabilities };
+    for(int i = 0; i < 5 && !has_failed; i++)
+      ween_dbi(dbis[i], batch_size);
+  };
+
+  bool LmdbStorage::claim_task(const string& task, time_t now, int interval) {
+    MDB_txn *txn;
+    if(!test_result(mdb_txn_begin(env->env, NULL, 0, &txn), "problem starting write transaction"))
+      return false;
+    // the value's expiry time is used as the time the task was last run
+    MDB_val k = make_val(task), v;
+    int rc = mdb_get(txn, env->maintenance, &k, &v);
+    if(rc == MDB_SUCCESS && val_expires(v) > now - interval) {
+      mdb_txn_abort(txn);
+      return false;
+    }
+    if(rc != MDB_SUCCESS && rc != MDB_NOTFOUND) {
+      mdb_txn_abort(txn);
+      return test_result(rc, "problem looking up " + task + " in maintenance table");
+    }
+    string data = make_value(now, "");
+    v = make_val(data);
+    if((rc = mdb_put(txn, env->maintenance, &k, &v, 0)) != MDB_SUCCESS) {
+      mdb_txn_abort(txn);
+      return test_result(rc, "problem claiming " + task + " run");
+    }
+    return test_result(mdb_txn_commit(txn), "problem claiming " + task + " run");
+  };
+
+  void LmdbStorage::print_dbi(MDB_dbi dbi, const string& name) {
+    if(!begin_read())
+      return;
+    MDB_cursor *cursor;
+    if(!test_result(mdb_cursor_open(reader, dbi, &cursor), "problem opening cursor")) {
+      end_read();
+      return;
+    }
+    string rows;
+    MDB_val k, v;
+    int count = 0;
+    for(int rc = mdb_cursor_get(cursor, &k, &v, MDB_FIRST); rc == MDB_SUCCESS; rc = mdb_cursor_get(cursor, &k, &v, MDB_NEXT), count++) {
+      string key = val_string(k);
+      replace(key.begin(), key.end(), '\n', '\t');
+      char expires_on[32];
+      snprintf(expires_on, sizeof(expires_on), "%ld", (long) val_expires(v));
+      rows += key + "\t" + expires_on + "\n";
+    }
+    fprintf(stdout, "Printing table: %s.  There are %d rows.\n%s\n", name.c_str(), count, rows.c_str());
+    mdb_cursor_close(cursor);
+    end_read();
+  };
+
+  // This is a method to be used by a utility program, never the apache module
+  void LmdbStorage::print() {
+    print_dbi(env->sessions, "sessions");
+    print_dbi(env->auth_sessions, "authentication_sessions");
+    print_dbi(env->nonces, "response_nonces");
+    print_dbi(env->assocs, "associations");
+    print_dbi(env->capabilities, "op_capabilities");
+  };
+}
+
+#endif
+
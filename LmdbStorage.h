@@ -0,0 +1,107 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#ifdef HAVE_LMDB
+
+namespace modauthopenid {
+  using namespace opkele;
+  using namespace std;
+
+  // the environment and named databases for one location - shared by every LmdbStorage for
+  // that location in this process, since lmdb doesn't allow an environment to be opened twice
+  typedef struct lmdb_env {
+    MDB_env *env;
+    MDB_dbi sessions, assocs, auth_sessions, nonces, capabilities, maintenance;
+  } lmdb_env_t;
+
+  // Storage in an LMDB memory mapped B+tree (AuthOpenIDStorage lmdb).  Readers never block
+  // and never wait on writers, and look at values directly in the map; writers are
+  // serialized by lmdb but only hold its lock for as long as a single put takes.  Every
+  // value starts with its expiry time so that expired entries can be skipped without
+  // decoding them.  AuthOpenIDDBLocation is the path of the data file (the lock file is
+  // the same path followed by -lock).
+  class LmdbStorage : public Storage {
+  public:
+    // set up the environment table for this child process (called from Storage::init)
+    static void init(apr_pool_t *p);
+
+    // open the environment at location (if this process hasn't already) - NULL if it can't be
+    // opened
+    static LmdbStorage *open(const string& location);
+
+    virtual ~LmdbStorage();
+
+    virtual bool get_session(const string& session_id, session_t& session);
+    virtual void store_session(const session_t& session);
+    virtual void store_assoc(const assoc_record_t& assoc);
+    virtual bool get_assoc(const string& server, const string& handle, assoc_record_t& assoc);
+    virtual bool find_assoc(const string& server, assoc_record_t& assoc);
+    virtual void remove_assoc(const string& server, const string& handle);
+    virtual bool get_capabilities(const string& server, op_capabilities_t& caps);
+    virtual void store_capabilities(const op_capabilities_t& caps);
+    virtual void store_auth_session(const auth_session_t& auth_session);
+    virtual bool get_auth_session(const string& nonce, auth_session_t& auth_session);
+    virtual void remove_auth_session(const string& nonce);
+    virtual bool add_nonce(const string& server, const string& nonce, time_t expires_on);
+    virtual void ween_expired(int batch_size);
+    virtual bool claim_task(const string& task, time_t now, int interval);
+    virtual void print();
+
+  private:
+    LmdbStorage(lmdb_env_t *_env);
+
+    // start and end a read only transaction - the transaction is kept between reads and
+    // just renewed, so starting one is cheap
+    bool begin_read();
+    void end_read();
+
+    // get the unexpired value for key (without its expiry time) - false if there isn't one
+    bool get(MDB_dbi dbi, const string& key, string& value);
+
+    // store value under key until expires_on
+    void put(MDB_dbi dbi, const string& key, const string& value, time_t expires_on);
+
+    // delete key
+    void del(MDB_dbi dbi, const string& key);
+
+    // delete at most batch_size expired entries from dbi (all of them if batch_size is negative)
+    void ween_dbi(MDB_dbi dbi, int batch_size);
+
+    // print the keys and expiry times in dbi
+    void print_dbi(MDB_dbi dbi, const string& name);
+
+    // test result from an lmdb call - print error and set failed() if there is one
+    bool test_result(int result, const string& context);
+
+    lmdb_env_t *env;
+    MDB_txn *reader;
+  };
+}
+
+#endif
+
@@ -25,261 +25,361 @@ OTHER DEALINGS IN THE SOFTWARE.
 Created by bmuller <bmuller@butterfat.net>
 */
 
+
 #include "mod_auth_openid.h"
 
+// how long an authentication session may exist without being returned from the OP
+#define AUTHENTICATION_SESSION_LIFESPAN 3600
+
+// version byte at the start of an authentication session token's payload
+#define SESSION_TOKEN_VERSION 1
+
 namespace modauthopenid {
   using namespace std;
   using namespace opkele;
+
+  ReplayCache *MoidConsumer::nonce_cache = NULL;
+  int MoidConsumer::nonce_skew = DEFAULT_NONCE_SKEW;
+  SingleFlight *MoidConsumer::flights = NULL;
+  int MoidConsumer::flight_timeout = 0;
  
-  MoidConsumer::MoidConsumer(const string& storage_location, const string& _asnonceid, const string& _serverurl) :
-                             asnonceid(_asnonceid), serverurl(_serverurl), is_closed(false), endpoint_set(false), normalized_id("") {
-    int rc = sqlite3_open(storage_location.c_str(), &db);
-    if(!test_result(rc, "problem opening database"))
-      return;
-    sqlite3_busy_timeout(db, 5000);
-
-    string query = "CREATE TABLE IF NOT EXISTS authentication_sessions "
-      "(nonce VARCHAR(255), uri VARCHAR(255), claimed_id VARCHAR(255), local_id VARCHAR(255), normalized_id VARCHAR(255), expires_on INT)";
-    rc = sqlite3_exec(db, query.c_str(), 0, 0, 0);
-    test_result(rc, "problem creating sessions table if it didn't exist already");
-
-    query = "CREATE TABLE IF NOT EXISTS associations "
-      "(server VARCHAR(255), handle VARCHAR(100), encryption_type VARCHAR(50), secret VARCHAR(30), expires_on INT)";
-    rc = sqlite3_exec(db, query.c_str(), 0, 0, 0);
-    test_result(rc, "problem creating associations table if it didn't exist already");
-
-    query = "CREATE TABLE IF NOT EXISTS response_nonces "
-      "(server VARCHAR(255), response_nonce VARCHAR(100), expires_on INT)";
-    rc = sqlite3_exec(db, query.c_str(), 0, 0, 0);
-    test_result(rc, "problem creating response_nonces table if it didn't exist already");
+  MoidConsumer::MoidConsumer(const string& storage_type, const string& storage_location, const string& _asnonceid, const string& _serverurl) :
+                             location(storage_location), asnonceid(_asnonceid), serverurl(_serverurl), endpoint_set(false), token_session(false), normalized_id("") {
+    storage = ConnectionPool::acquire(storage_type, storage_location);
   };
 
+  void MoidConsumer::init_nonce_cache(apr_pool_t *p, int entries, int skew) {
+    nonce_skew = skew;
+    nonce_cache = ReplayCache::create(p, entries, skew);
+  };
+
+  void MoidConsumer::init_single_flight(apr_pool_t *p, int entries, int timeout) {
+    flight_timeout = timeout;
+    if(timeout > 0)
+      flights = SingleFlight::create(p, entries);
+  };
 
   assoc_t MoidConsumer::store_assoc(const string& server,const string& handle,const string& type,const secret_t& secret,int expires_in) {
     debug("Storing association for \"" + server + "\" and handle \"" + handle + "\" in db");
-    ween_expired();
 
     time_t rawtime;
     time (&rawtime);
-    int expires_on = rawtime + expires_in;
-
-    const char *query = "INSERT INTO associations (server, handle, secret, expires_on, encryption_type) VALUES(%Q,%Q,%Q,%d,%Q)";
-    char *sql = sqlite3_mprintf(query, 
-				server.c_str(), 
-				handle.c_str(), 
-				util::encode_base64(&(secret.front()),secret.size()).c_str(),
-				expires_on,
-				type.c_str());
-    int rc = sqlite3_exec(db, sql, 0, 0, 0);
-    sqlite3_free(sql);
-    test_result(rc, "problem storing association in associations table");
-
-    return assoc_t(new association(server, handle, type, secret, expires_on, false));
+    assoc_record_t assoc;
+    assoc.server = server;
+    assoc.handle = handle;
+    assoc.type = type;
+    assoc.secret = secret;
+    assoc.expires_on = rawtime + expires_in;
+
+    if(storage != NULL)
+      storage->store_assoc(assoc);
+    release_assoc_flight();
+    return make_assoc(assoc, true);
   };
 
   assoc_t MoidConsumer::retrieve_assoc(const string& server, const string& handle) {
-    ween_expired();
     debug("looking up association: server = " + server + " handle = " + handle);
+    assoc_t cached;
+    if(AssociationCache::retrieve(location, server, handle, cached)) {
+      debug("found association for server \"" + server + "\" and handle \"" + handle + "\" in cache.");
+      return cached;
+    }
 
-    const char *query = "SELECT server,handle,secret,expires_on,encryption_type FROM associations WHERE server=%Q AND handle=%Q LIMIT 1";
-    char *sql = sqlite3_mprintf(query, server.c_str(), handle.c_str());
-    int nr, nc;
-    char **table;
-    int rc = sqlite3_get_table(db, sql, &table, &nr, &nc, 0);
-    sqlite3_free(sql);
-    test_result(rc, "problem fetching association");
-    if(nr ==0) {
+    assoc_record_t assoc;
+    if(storage == NULL || !storage->get_assoc(server, handle, assoc)) {
       debug("could not find server \"" + server + "\" and handle \"" + handle + "\" in db.");
-      sqlite3_free_table(table);
       throw failed_lookup(OPKELE_CP_ "Could not find association.");
     }
-    // resulting row has table indexes: 
-    // server  handle  secret  expires_on  encryption_type
-    // 5       6       7       8           9
-    secret_t secret; 
-    util::decode_base64(table[7], secret);
-    assoc_t result = assoc_t(new association(table[5], table[6], table[9], secret, strtol(table[8], 0, 0), false));
-    sqlite3_free_table(table);
-    return result;
+    return make_assoc(assoc, false);
   };
 
   void MoidConsumer::invalidate_assoc(const string& server,const string& handle) {
     debug("invalidating association: server = " + server + " handle = " + handle);
-    char *query = sqlite3_mprintf("DELETE FROM associations WHERE server=%Q AND handle=%Q", server.c_str(), handle.c_str());
-    int rc = sqlite3_exec(db, query, 0, 0, 0);
-    sqlite3_free(query);
-    test_result(rc, "problem invalidating assocation for server \"" + server + "\" and handle \"" + handle + "\"");
+    AssociationCache::invalidate(location, server, handle);
+    if(storage != NULL)
+      storage->remove_assoc(server, handle);
   };
 
   assoc_t MoidConsumer::find_assoc(const string& server) {
-    ween_expired();
     debug("looking up association: server = " + server);
+    // an association about to expire may have been renewed in another child (by the
+    // Preassociator, say) - so only use it if the db doesn't have a newer one
+    assoc_t cached;
+    bool in_cache = AssociationCache::find(location, server, cached);
+    if(in_cache && cached->expires_in() > PREASSOCIATE_MARGIN) {
+      debug("found a handle for server \"" + server + "\" in cache.");
+      return cached;
+    }
 
-    const char *query = "SELECT server,handle,secret,expires_on,encryption_type FROM associations WHERE server=%Q LIMIT 1";
-    char *sql = sqlite3_mprintf(query, server.c_str());
-    int nr, nc;
-    char **table;
-    int rc = sqlite3_get_table(db, sql, &table, &nr, &nc, 0);
-    sqlite3_free(sql);
-    test_result(rc, "problem fetching association");
-    if(nr==0) {
-      debug("could not find handle for server \"" + server + "\" in db.");
-      sqlite3_free_table(table);
-      throw failed_lookup(OPKELE_CP_ "Could not find association.");
-    } else {
+    assoc_record_t assoc;
+    if(storage != NULL && storage->find_assoc(server, assoc)) {
       debug("found a handle for server \"" + server + "\" in db.");
+      return make_assoc(assoc, true);
+    }
+    if(in_cache) {
+      debug("found a handle for server \"" + server + "\" in cache.");
+      return cached;
+    }
+    if(storage == NULL)
+      throw failed_lookup(OPKELE_CP_ "Could not find association.");
+
+    // associate with server - unless another request is already doing that, in which case wait
+    // for its association to show up in the db
+    string key = "association\n" + location + '\n' + server;
+    if(flights != NULL && assoc_flight == "") {
+      if(flights->claim(key, flight_timeout)) {
+        assoc_flight = key;
+      } else {
+        debug("waiting for another request to associate with server \"" + server + "\"");
+        flights->wait(key, flight_timeout);
+        if(storage->find_assoc(server, assoc)) {
+          debug("found a handle for server \"" + server + "\" in db after waiting.");
+          return make_assoc(assoc, true);
+        }
+      }
     }
-    // resulting row has table indexes: 
-    // server  handle  secret  expires_on  encryption_type
-    // 5       6       7       8           9
-    secret_t secret; 
-    util::decode_base64(table[7], secret);
-    assoc_t result = assoc_t(new association(table[5], table[6], table[9], secret, strtol(table[8], 0, 0), false));
-    sqlite3_free_table(table);
-    return result;
+    debug("could not find handle for server \"" + server + "\" in db.");
+    return establish_assoc(server);
   };
 
-  bool MoidConsumer::test_result(int result, const string& context) {
-    if(result != SQLITE_OK){
-      string msg = "SQLite Error in MoidConsumer - " + context + ": %s\n";
-      fprintf(stderr, msg.c_str(), sqlite3_errmsg(db));
-      sqlite3_close(db);
-      is_closed = true;
-      return false;
+  assoc_t MoidConsumer::establish_assoc(const string& server) {
+    op_capabilities_t caps;
+    bool known = storage != NULL && storage->get_capabilities(server, caps);
+    if(known && caps.stateless) {
+      release_assoc_flight();
+      debug("server \"" + server + "\" is known not to associate - using stateless mode");
+      throw dumb_RP(OPKELE_CP_ "OP doesn't associate");
     }
-    return true;
+
+    assoc_record_t assoc;
+    assoc_result_t result = Associator::associate(server, known, caps, assoc);
+    if(result != ASSOC_FAILED && storage != NULL)
+      storage->store_capabilities(caps);
+    if(result == ASSOC_FAILED && has_next_endpoint()) {
+      release_assoc_flight();
+      throw exception_network(OPKELE_CP_ "Could not reach OP");
+    }
+    if(result != ASSOC_OK) {
+      release_assoc_flight();
+      throw dumb_RP(OPKELE_CP_ "Could not associate with OP");
+    }
+    return store_assoc(server, assoc.handle, assoc.type, assoc.secret, assoc.expires_on - time(0));
   };
 
-  void MoidConsumer::ween_expired() {
-    time_t rawtime;
-    time (&rawtime);
-    char *query = sqlite3_mprintf("DELETE FROM associations WHERE %d > expires_on", rawtime);
-    int rc = sqlite3_exec(db, query, 0, 0, 0);
-    sqlite3_free(query);
-    test_result(rc, "problem weening expired associations from table");
-
-    query = sqlite3_mprintf("DELETE FROM authentication_sessions WHERE %d > expires_on", rawtime);
-    rc = sqlite3_exec(db, query, 0, 0, 0);
-    sqlite3_free(query);
-    test_result(rc, "problem weening expired authentication sessions from table");
-
-    query = sqlite3_mprintf("DELETE FROM response_nonces WHERE %d > expires_on", rawtime);
-    rc = sqlite3_exec(db, query, 0, 0, 0);
-    sqlite3_free(query);
-    test_result(rc, "problem weening expired response nonces from table");
+  void MoidConsumer::release_assoc_flight() {
+    if(assoc_flight == "")
+      return;
+    flights->release(assoc_flight);
+    assoc_flight = "";
+  };
+
+  assoc_t MoidConsumer::make_assoc(const assoc_record_t& assoc, bool for_server) const {
+    AssociationCache::store(location, assoc.server, assoc.handle, assoc.type, assoc.secret, assoc.expires_on, for_server);
+    return assoc_t(new association(assoc.server, assoc.handle, assoc.type, assoc.secret, assoc.expires_on, false));
   };
 
+  void MoidConsumer::check_authentication(const string& OP, const basic_openid_message& om) {
+    debug("checking authentication with " + OP);
+    openid_message_t request;
+    om.copy_to(request);
+    request.set_field("mode", "check_authentication");
+    string response;
+    long status;
+    if(!CurlPool::post(OP, request.query_string(), response, status))
+      throw exception_network(OPKELE_CP_ "check_authentication request failed");
+    if(status != 200)
+      throw failed_check_authentication(OPKELE_CP_ "OP returned an error for check_authentication");
+
+    openid_message_t result;
+    result.from_keyvalues(response);
+    if(result.has_field("invalidate_handle"))
+      invalidate_assoc(OP, result.get_field("invalidate_handle"));
+    if(result.has_field("is_valid")) {
+      if(result.get_field("is_valid") == "true")
+        return;
+    } else if(result.has_field("lifetime")) {
+      // OpenID 1.1 OPs
+      if(atol(result.get_field("lifetime").c_str()) != 0)
+        return;
+    }
+    throw failed_check_authentication(OPKELE_CP_ "failed to verify response");
+  };
 
   void MoidConsumer::check_nonce(const string& server, const string& nonce) {
     debug("checking nonce " + nonce);
-    int nr, nc;
-    char **table;
-    char *query = sqlite3_mprintf("SELECT nonce FROM response_nonces WHERE server=%Q AND response_nonce=%Q", server.c_str(), nonce.c_str());
-    int rc = sqlite3_get_table(db, query, &table, &nr, &nc, 0);
-    sqlite3_free(query);
-    if(nr != 0) {
+    time_t timestamp;
+    if(!parse_nonce_time(nonce, timestamp))
+      throw opkele::id_res_bad_nonce(OPKELE_CP_ "nonce has no valid time stamp");
+    time_t now = time(0);
+    if(timestamp < now - nonce_skew || timestamp > now + nonce_skew) {
+      debug("nonce " + nonce + " is outside the allowed time window");
+      throw opkele::id_res_bad_nonce(OPKELE_CP_ "nonce is too old or from the future - possible replay attack");
+    }
+
+    if(nonce_cache != NULL) {
+      nonce_check_t result = nonce_cache->check(server + '\n' + nonce, timestamp);
+      if(result == NONCE_SEEN) {
+        debug("found preexisting nonce - could be a replay attack");
+        throw opkele::id_res_bad_nonce(OPKELE_CP_ "old nonce used again - possible replay attack");
+      }
+      // another request may be adding the same nonce right now, and the db won't know about
+      // it if it does - so there's no telling whether this is a replay
+      if(result == NONCE_BUSY) {
+        debug("nonce cache slot stayed busy - rejecting the nonce");
+        throw opkele::id_res_bad_nonce(OPKELE_CP_ "cannot check nonce - nonce cache is busy");
+      }
+      // a nonce new to this server may still have been used on another one
+      if(result == NONCE_NEW && (storage == NULL || !storage->shared()))
+        return;
+      if(result != NONCE_NEW)
+        debug("no room for nonce in the nonce cache - checking the db");
+    }
+
+    if(storage == NULL)
+      throw opkele::id_res_bad_nonce(OPKELE_CP_ "cannot check nonce - no database connection");
+
+    // the nonce only has to be kept until its time stamp falls out of the window, after which
+    // it would be rejected anyway
+    if(!storage->add_nonce(server, nonce, timestamp + nonce_skew)) {
+      if(storage->failed())
+        throw opkele::id_res_bad_nonce(OPKELE_CP_ "cannot check nonce - database error");
       debug("found preexisting nonce - could be a replay attack");
-      sqlite3_free_table(table);
       throw opkele::id_res_bad_nonce(OPKELE_CP_ "old nonce used again - possible replay attack");
     }
-    sqlite3_free_table(table);
-
-    // so, old nonce not found, insert it into nonces table.  Expiration time will be based on association
-    int expires_on = find_assoc(server)->expires_in() + time(0);
-    const char *sql = "INSERT INTO response_nonces (server,response_nonce,expires_on) VALUES(%Q,%Q,%d)";
-    query = sqlite3_mprintf(sql, server.c_str(), nonce.c_str(), expires_on);
-    rc = sqlite3_exec(db, query, 0, 0, 0);
-    sqlite3_free(query);
-    test_result(rc, "problem adding new nonce to resposne_nonces table");
   };
 
   bool MoidConsumer::session_exists() {
-    char *query = sqlite3_mprintf("SELECT nonce FROM authentication_sessions WHERE nonce=%Q LIMIT 1", asnonceid.c_str());
-    int nr, nc;
-    char **table;
-    int rc = sqlite3_get_table(db, query, &table, &nr, &nc, 0);
-    sqlite3_free(query);
-    test_result(rc, "problem fetching authentication session by nonce");
-    bool exists = true;
-    if(nr==0) {
+    if(token_session)
+      return endpoint_set;
+    auth_session_t auth_session;
+    if(storage == NULL || !storage->get_auth_session(asnonceid, auth_session)) {
       debug("could not find authentication session \"" + asnonceid + "\" in db.");
-      exists = false;
-    } 
-    sqlite3_free_table(table);
-    return exists;
+      return false;
+    }
+    return true;
+  };
+
+  void MoidConsumer::use_session_token() {
+    token_session = true;
+  };
+
+  string MoidConsumer::make_session_token(const KeyRing& keys) const {
+    string payload(1, (char) SESSION_TOKEN_VERSION);
+    put_string(payload, endpoint.uri);
+    put_string(payload, endpoint.claimed_id);
+    put_string(payload, endpoint.local_id);
+    put_string(payload, normalized_id);
+    put_varint(payload, (apr_uint64_t) (time(0) + AUTHENTICATION_SESSION_LIFESPAN));
+    return keys.seal(TOKEN_LOGIN, payload, false);
+  };
+
+  bool MoidConsumer::read_session_token(const KeyRing& keys, const string& token) {
+    token_session = true;
+    endpoint_set = false;
+    string payload;
+    if(!keys.open(TOKEN_LOGIN, token, payload) || payload.empty() || payload[0] != (char) SESSION_TOKEN_VERSION) {
+      debug("authentication session token is not valid");
+      return false;
+    }
+    string::size_type pos = 1;
+    apr_uint64_t expires_on;
+    if(!get_string(payload, pos, endpoint.uri) || !get_string(payload, pos, endpoint.claimed_id) ||
+       !get_string(payload, pos, endpoint.local_id) || !get_string(payload, pos, normalized_id) ||
+       !get_varint(payload, pos, expires_on) || pos != payload.size()) {
+      debug("authentication session token is malformed");
+      return false;
+    }
+    if((time_t) expires_on < time(0)) {
+      debug("authentication session token has expired");
+      return false;
+    }
+    endpoint_set = true;
+    return true;
   };
 
   void MoidConsumer::begin_queueing() {
     endpoint_set = false;
-    char *query = sqlite3_mprintf("DELETE FROM authentication_sessions WHERE nonce=%Q", asnonceid.c_str());
-    int rc = sqlite3_exec(db, query, 0, 0, 0);
-    sqlite3_free(query);
-    test_result(rc, "problem reseting authentication session");
+    fallbacks.clear();
+    if(token_session || storage == NULL)
+      return;
+    storage->remove_auth_session(asnonceid);
   };
 
   void MoidConsumer::queue_endpoint(const openid_endpoint_t& ep) {
-    if(!endpoint_set) {
-      debug("Queueing endpoint " + ep.claimed_id + " : " + ep.local_id + " @ " + ep.uri);
-      time_t rawtime;
-      time (&rawtime);
-      int expires_on = rawtime + 3600;  // allow nonce to exist for up to one hour without being returned
-      const char *query = "INSERT INTO authentication_sessions (nonce,uri,claimed_id,local_id,expires_on) VALUES(%Q,%Q,%Q,%Q,%d)";
-      char *sql = sqlite3_mprintf(query, asnonceid.c_str(), ep.uri.c_str(), ep.claimed_id.c_str(), ep.local_id.c_str(), expires_on);
-      debug(string(sql));
-      int rc = sqlite3_exec(db, sql, 0, 0, 0);
-      sqlite3_free(sql);
-      test_result(rc, "problem queuing endpoint");
-      endpoint_set = true;
+    debug("Queueing endpoint " + ep.claimed_id + " : " + ep.local_id + " @ " + ep.uri);
+    if(endpoint_set) {
+      fallbacks.push_back(ep);
+      return;
     }
-  }
+    endpoint = ep;
+    endpoint_set = true;
+  };
+
+  void MoidConsumer::store_auth_session() {
+    if(storage == NULL)
+      return;
+    auth_session_t auth_session;
+    auth_session.nonce = asnonceid;
+    auth_session.endpoint = endpoint;
+    auth_session.fallbacks = fallbacks;
+    auth_session.normalized_id = normalized_id;
+    auth_session.expires_on = time(0) + AUTHENTICATION_SESSION_LIFESPAN;
+    storage->store_auth_session(auth_session);
+  };
 
   const openid_endpoint_t& MoidConsumer::get_endpoint() const {
     debug("Fetching endpoint");
-    char *query = sqlite3_mprintf("SELECT uri,claimed_id,local_id FROM authentication_sessions WHERE nonce=%Q LIMIT 1", asnonceid.c_str());
-    int nr, nc;
-    char **table;
-    int rc = sqlite3_get_table(db, query, &table, &nr, &nc, 0);
-    sqlite3_free(query);
-    test_sqlite_return(db, rc, "problem fetching authentication session");
-    if(nr==0) {
+    if(endpoint_set)
+      return endpoint;
+    auth_session_t auth_session;
+    if(token_session || storage == NULL || !storage->get_auth_session(asnonceid, auth_session)) {
       debug("could not find an endpoint for authentication session \"" + asnonceid + "\" in db.");
-      sqlite3_free_table(table);
       throw opkele::exception(OPKELE_CP_ "No more endpoints queued");
-    } 
-    // resulting row has table indexes:                                                   
-    // uri   claimed_id   local_id
-    // 3     4            5
-    endpoint.uri = string(table[3]);
-    endpoint.claimed_id = string(table[4]);
-    endpoint.local_id = string(table[5]);
-    sqlite3_free_table(table);
+    }
+    endpoint = auth_session.endpoint;
+    fallbacks = auth_session.fallbacks;
     return endpoint;
   };
 
+  bool MoidConsumer::has_next_endpoint() const {
+    return !fallbacks.empty();
+  };
+
   void MoidConsumer::next_endpoint() {
-    debug("Clearing all session information - we're only storing one endpoint, can't get next one, cause we didn't store it.");
-    char *query = sqlite3_mprintf("DELETE FROM authentication_sessions WHERE nonce=%Q", asnonceid.c_str());
-    int rc = sqlite3_exec(db, query, 0, 0, 0);
-    sqlite3_free(query);
-    test_result(rc, "problem in next_endpoint()");
-    endpoint_set = false;
+    auth_session_t auth_session;
+    if(!endpoint_set && !token_session && storage != NULL && storage->get_auth_session(asnonceid, auth_session)) {
+      endpoint = auth_session.endpoint;
+      fallbacks = auth_session.fallbacks;
+    }
+    if(fallbacks.empty()) {
+      debug("No more endpoints queued - clearing all session information");
+      endpoint_set = false;
+      if(token_session || storage == NULL)
+        return;
+      storage->remove_auth_session(asnonceid);
+      return;
+    }
+    endpoint = fallbacks.front();
+    fallbacks.erase(fallbacks.begin());
+    endpoint_set = true;
+    debug("Moving on to endpoint " + endpoint.uri);
+    if(!token_session)
+      store_auth_session();
   };
 
   void MoidConsumer::kill_session() {
-    char *query = sqlite3_mprintf("DELETE FROM authentication_sessions WHERE nonce=%Q", asnonceid.c_str());
-    int rc = sqlite3_exec(db, query, 0, 0, 0);
-    sqlite3_free(query);
-    test_result(rc, "problem killing session");
+    // a session token can't be revoked - it expires on its own, and replaying the OP's response
+    // is caught by check_nonce
+    if(token_session || storage == NULL)
+      return;
+    storage->remove_auth_session(asnonceid);
   };
 
   void MoidConsumer::set_normalized_id(const string& nid) {
     debug("Set normalized id to: " + nid);
     normalized_id = nid;
-    char *query = sqlite3_mprintf("UPDATE authentication_sessions SET normalized_id=%Q WHERE nonce=%Q", normalized_id.c_str(), asnonceid.c_str());
-    debug(string(query));
-    int rc = sqlite3_exec(db, query, 0, 0, 0);
-    sqlite3_free(query);
-    test_result(rc, "problem settting normalized id");
+    if(!token_session && endpoint_set)
+      store_auth_session();
   };
 
   const string MoidConsumer::get_normalized_id() const {
@@ -287,42 +387,87 @@ namespace modauthopenid {
       debug("getting normalized id - " + normalized_id);
       return normalized_id;
     }
-    char *query = sqlite3_mprintf("SELECT normalized_id FROM authentication_sessions WHERE nonce=%Q LIMIT 1", asnonceid.c_str());
-    int nr, nc;
-    char **table;
-    int rc = sqlite3_get_table(db, query, &table, &nr, &nc, 0);
-    sqlite3_free(query);
-    test_sqlite_return(db, rc, "problem fetching authentication session");
-    if(nr==0) {
+    auth_session_t auth_session;
+    if(token_session || storage == NULL || !storage->get_auth_session(asnonceid, auth_session)) {
       debug("could not find an normalized_id for authentication session \"" + asnonceid + "\" in db.");
-      sqlite3_free_table(table);
       throw opkele::exception(OPKELE_CP_ "cannot get normalized id");
-    } 
-    normalized_id = string(table[1]);
-    sqlite3_free_table(table);  
+    }
+    normalized_id = auth_session.normalized_id;
     debug("getting normalized id - " + normalized_id);
     return normalized_id;
   };
 
-  const string MoidConsumer::get_this_url() const {
-    return serverurl;
+  const string MoidConsumer::discover(const string& id) {
+    bool found;
+    string nid;
+    vector<openid_endpoint_t> endpoints;
+    bool cached = DiscoveryCache::lookup(id, found, nid, endpoints);
+
+    // if another request is already discovering id, wait for its result rather than doing the
+    // same discovery again
+    string key = "discovery\n" + id;
+    bool claimed = false;
+    if(!cached && flights != NULL) {
+      claimed = flights->claim(key, flight_timeout);
+      if(!claimed) {
+        debug("waiting for another request to discover " + id);
+        flights->wait(key, flight_timeout);
+        cached = DiscoveryCache::lookup(id, found, nid, endpoints);
+      }
+    }
+
+    if(cached) {
+      if(!found) {
+        debug("discovery for " + id + " failed recently - not trying again yet");
+        throw failed_discovery(OPKELE_CP_ "discovery failed recently");
+      }
+      debug("found discovery result for " + id + " in cache");
+    } else {
+      try {
+        nid = discover_endpoints(id, endpoints);
+      } catch(...) {
+        if(claimed)
+          flights->release(key);
+        throw;
+      }
+      if(claimed)
+        flights->release(key);
+    }
+
+    EndpointHealth::order(endpoints);
+    for(vector<openid_endpoint_t>::const_iterator it = endpoints.begin(); it != endpoints.end(); ++it)
+      queue_endpoint(*it);
+    return nid;
+  };
+
+  const string MoidConsumer::discover_endpoints(const string& id, vector<openid_endpoint_t>& endpoints) {
+    string nid;
+    try {
+      nid = idiscover(back_inserter(endpoints), id);
+    } catch(failed_discovery& e) {
+      DiscoveryCache::store_failure(id);
+      throw;
+    } catch(bad_input& e) {
+      DiscoveryCache::store_failure(id);
+      throw;
+    }
+    if(endpoints.empty()) {
+      DiscoveryCache::store_failure(id);
+      throw failed_discovery(OPKELE_CP_ "no OpenID endpoints found");
+    }
+    DiscoveryCache::store(id, nid, endpoints);
+    return nid;
   };
 
-  // This is a method to be used by a utility program, never the apache module
-  void MoidConsumer::print_tables() {
-    ween_expired();
-    print_sqlite_table(db, "authentication_sessions");
-    print_sqlite_table(db, "response_nonces");
-    print_sqlite_table(db, "associations");
+  const string MoidConsumer::get_this_url() const {
+    return serverurl;
   };
 
   void MoidConsumer::close() {
-    if(is_closed)
-      return;
-    is_closed = true;
-    test_result(sqlite3_close(db), "problem closing database");
+    // if associating failed, let someone else try
+    release_assoc_flight();
+    ConnectionPool::release(storage);
+    storage = NULL;
   };
 }
 
-
-
@@ -34,9 +34,9 @@ namespace modauthopenid {
   // the params list
   class MoidConsumer : public prequeue_RP {
   public:
-    // storage location is db location, _asnonceid is the association session nonce, and serverurl is 
-    // the return to value (url initially requested by user)
-    MoidConsumer(const string& storage_location, const string& _asnonceid, const string& _serverurl);
+    // storage type and location select the store (a Storage is taken from the ConnectionPool), _asnonceid is the association session nonce,
+    // and serverurl is the return to value (url initially requested by user)
+    MoidConsumer(const string& storage_type, const string& storage_location, const string& _asnonceid, const string& _serverurl);
     virtual ~MoidConsumer() { close(); };
 
     // store a new assocation
@@ -48,24 +48,38 @@ namespace modauthopenid {
     // invalidate assocation - deletes from db
     void invalidate_assoc(const string& server,const string& handle);
 
-    // find any association for the given server OP
+    // find any association for the given server OP, associating with it if there isn't one.
+    // Throws dumb_RP if the OP can't be associated with, so the request goes on in stateless mode
     assoc_t find_assoc(const string& server);
 
-    // This is called with the openid.response_nonce - if isn't already in db, is stored for same amount of time
-    // as the association, at which point a replay attack is impossible since assocation key is deleted
+    // associate with server using the types it's known to accept, and remember what was
+    // learned about it - throws dumb_RP if the OP is stateless or can't be reached, or
+    // exception_network if it can't be reached and there's another endpoint to try
+    assoc_t establish_assoc(const string& server);
+
+    // ask the OP whether a response it signed with a private association is valid - the same
+    // as libopkele's, but using a pooled curl handle so the connection to the OP is reused
+    void check_authentication(const string& OP, const basic_openid_message& om);
+
+    // This is called with the openid.response_nonce - nonces with a time stamp more than the allowed skew
+    // from now are rejected outright.  Others are looked up in (and added to) the shared memory
+    // ReplayCache, or the db if there's no room there, and rejected if they have been seen before.
     void check_nonce(const string& OP,const string& nonce);
 
     // delete authentication session with the constructor param nonce if it exists
     void begin_queueing();
 
-    // store the given endpoint - there actually is no queue - we just keep track of the first one
-    // given - all subsequent calls are ignored
+    // queue the given endpoint - the first one queued is used, and the rest are kept (in order)
+    // to fail over to.  The queue is stored along with the normalized id.
     void queue_endpoint(const openid_endpoint_t& ep);
 
-    // get the endpoint set in queue_endpoint
+    // get the endpoint currently in use
     const openid_endpoint_t& get_endpoint() const;
 
-    // same as begin_queuing
+    // true if there's another endpoint queued after the current one
+    bool has_next_endpoint() const;
+
+    // move on to the next endpoint queued - once there are none left, the same as begin_queueing
     void next_endpoint();
 
     // set the normalized id for this authentication session
@@ -74,41 +88,94 @@ namespace modauthopenid {
     // get id set in set_normalized_id
     const string get_normalized_id() const;
 
+    // discover the identifier id and queue its endpoints, returning its normalized id.  Results
+    // (and identifiers that couldn't be discovered) are kept in the DiscoveryCache, so an
+    // identifier used recently isn't discovered again.  Endpoints that have been failing or slow
+    // are queued last (see EndpointHealth).
+    const string discover(const string& id);
+
     // get the url that was given as a constructor parameter
     const string get_this_url() const;
     
-    // check to see if a session exists with the nonce session id given in the constructor
+    // check to see if a session exists with the nonce session id given in the constructor (or, if the
+    // session was read from a token, that the token was valid)
     bool session_exists();
 
-    // print all tables to stdout
-    void print_tables();
+    // keep the authentication session in memory rather than in the db - it's handed to the browser
+    // with make_session_token and read back with read_session_token instead
+    void use_session_token();
 
-    // close db
+    // make a signed token holding the endpoint and normalized id (call after initiate)
+    string make_session_token(const KeyRing& keys) const;
+
+    // read the authentication session from a token made by make_session_token - false if the token
+    // isn't valid or has expired.  Switches to keeping the session in memory.
+    bool read_session_token(const KeyRing& keys, const string& token);
+
+    // give the storage back to the pool
     void close();
 
     // delete session with given session nonce id in constructor param list
     void kill_session();
+
+    // set how far (in seconds) a response nonce's time stamp may be from now, and create the shared
+    // memory cache of recently seen nonces with room for entries nonces (none if entries is 0).
+    // Called from post_config.
+    static void init_nonce_cache(apr_pool_t *p, int entries, int skew);
+
+    // create the shared memory table (with entries slots) used to make concurrent requests
+    // wait for one discovery or association rather than each doing their own - waiting for at
+    // most timeout seconds (no waiting at all if timeout is 0).  Called from post_config.
+    static void init_single_flight(apr_pool_t *p, int entries, int timeout);
   private:
-    sqlite3 *db;
+    Storage *storage;
 
-    // delete all expired sessions
-    void ween_expired();
+    // the db location - associations are cached per location
+    string location;
 
-    // test result from sqlite query - print error to stderr if there is one
-    bool test_result(int result, const string& context);
+    // recently seen response nonces, and the allowed skew of their time stamps
+    static ReplayCache *nonce_cache;
+    static int nonce_skew;
+
+    // markers for discoveries and associations in progress, and how long to wait on them
+    static SingleFlight *flights;
+    static int flight_timeout;
+
+    // the association marker this consumer has claimed ("" if none) - released once the
+    // association is stored, or when the consumer is closed
+    string assoc_flight;
+
+    // give up assoc_flight
+    void release_assoc_flight();
+
+    // discover id, and cache the result (or the failure) in the DiscoveryCache
+    const string discover_endpoints(const string& id, vector<openid_endpoint_t>& endpoints);
+
+    // make an association out of a stored one, and add it to the AssociationCache - as the one
+    // to use for its server if for_server is true (it isn't for one looked up by handle)
+    assoc_t make_assoc(const assoc_record_t& assoc, bool for_server) const;
+
+    // store the queued endpoint and normalized id as this authentication session
+    void store_auth_session();
 
     // strings for the nonce based authentication session and the server's url (the originally 
     // requested url)
     string asnonceid, serverurl; 
 
-    // booleans for the database state and whether any endpoint has been set yet
-    bool is_closed, endpoint_set;
+    // whether any endpoint has been set yet
+    bool endpoint_set;
+
+    // true if the authentication session is carried in a token rather than stored in the db
+    bool token_session;
     
     // The normalized id the user has attempted to use
     mutable string normalized_id;
 
     // the endpoint for the user's identity
     mutable openid_endpoint_t endpoint;
+
+    // the endpoints to try if endpoint fails, in order
+    mutable vector<openid_endpoint_t> fallbacks;
   };
 }
 
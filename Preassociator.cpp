@@ -0,0 +1,75 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// seconds between checks of the preassociated OPs
+#define PREASSOCIATE_INTERVAL 60
+
+namespace modauthopenid {
+  using namespace std;
+  using namespace opkele;
+
+  void Preassociator::add(const string& storage_type, const string& location, const string& server) {
+    preassociation_t entry;
+    entry.storage_type = storage_type;
+    entry.location = location;
+    entry.server = server;
+    entries.push_back(entry);
+  };
+
+  void Preassociator::refresh(time_t now) {
+    if(now - last_run < PREASSOCIATE_INTERVAL)
+      return;
+    last_run = now;
+    for(vector<preassociation_t>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+      refresh_one(*it, now);
+  };
+
+  void Preassociator::refresh_one(const preassociation_t& entry, time_t now) {
+    Storage *storage = ConnectionPool::acquire(entry.storage_type, entry.location);
+    if(storage == NULL)
+      return;
+    assoc_record_t assoc;
+    bool fresh = storage->find_assoc(entry.server, assoc) && assoc.expires_on > now + PREASSOCIATE_MARGIN;
+    bool claimed = !fresh && storage->claim_task("preassociate " + entry.server, now, PREASSOCIATE_INTERVAL);
+    ConnectionPool::release(storage);
+    if(!claimed)
+      return;
+
+    debug("associating with " + entry.server + " ahead of time");
+    MoidConsumer consumer(entry.storage_type, entry.location, "", "");
+    try {
+      consumer.establish_assoc(entry.server);
+    } catch(opkele::exception &e) {
+      print_to_error_log("could not associate with " + entry.server + ": " + string(e.what()));
+    }
+    consumer.close();
+  };
+}
+
@@ -0,0 +1,67 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+
+namespace modauthopenid {
+  using namespace std;
+
+  // An OP to keep an association with, and the store to keep it in
+  typedef struct preassociation {
+    string storage_type;
+    string location;
+    string server;
+  } preassociation_t;
+
+  // Keeps associations with the OPs listed with AuthOpenIDPreassociate from expiring, so that
+  // logins with them always find one with find_assoc instead of doing a DH exchange on the
+  // request path.  Run from the reaper thread: associations are made when a child starts and
+  // renewed a while before they expire, and Storage::claim_task makes sure only one child
+  // associates with a given OP at a time.
+  class Preassociator {
+  public:
+    Preassociator() : last_run(0) {};
+
+    // add server (an OP endpoint URL) - associations are kept in the given store
+    void add(const string& storage_type, const string& location, const string& server);
+
+    // true if no OPs have been added
+    bool empty() const { return entries.empty(); };
+
+    // associate with every OP that doesn't have an association that will last a while longer
+    // (checked at most once a minute)
+    void refresh(time_t now);
+
+  private:
+    // associate with one OP if it needs it and no other child is doing so
+    void refresh_one(const preassociation_t& entry, time_t now);
+
+    vector<preassociation_t> entries;
+    time_t last_run;
+  };
+}
+
@@ -0,0 +1,369 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// how many urls to remember the result for before starting over
+#define PROVIDER_DECISION_CACHE_SIZE 1024
+
+// flags for the kind of url a host pattern accepts
+#define PROVIDER_HTTP_PATH 1
+#define PROVIDER_HTTP_END 2
+#define PROVIDER_HTTPS_PATH 4
+#define PROVIDER_HTTPS_END 8
+
+namespace modauthopenid {
+  using namespace std;
+
+  vector<ProviderMatcher *> *ProviderMatcher::pending = NULL;
+
+  ProviderMatcher::ProviderMatcher(apr_pool_t *p) {
+    pool = p;
+    count = 0;
+    hosts = apr_hash_make(p);
+    suffixes = new suffix_node_t;
+    suffixes->flags = 0;
+    combined = NULL;
+    combined_extra = NULL;
+    prepared = false;
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS)
+      mutex = NULL;
+#endif
+  };
+
+  ProviderMatcher::~ProviderMatcher() {
+    if(pending != NULL)
+      pending->erase(remove(pending->begin(), pending->end(), this), pending->end());
+    free_suffix_node(suffixes);
+    if(combined_extra != NULL) {
+#ifdef PCRE_CONFIG_JIT
+      pcre_free_study(combined_extra);
+#else
+      pcre_free(combined_extra);
+#endif
+    }
+    if(combined != NULL)
+      pcre_free(combined);
+  };
+
+  void ProviderMatcher::free_suffix_node(suffix_node_t *node) {
+    for(map<string, suffix_node_t *>::iterator it = node->children.begin(); it != node->children.end(); ++it)
+      free_suffix_node(it->second);
+    delete node;
+  };
+
+  void ProviderMatcher::lock() {
+#if APR_HAS_THREADS
+    if(mutex != NULL)
+      apr_thread_mutex_lock(mutex);
+#endif
+  };
+
+  void ProviderMatcher::unlock() {
+#if APR_HAS_THREADS
+    if(mutex != NULL)
+      apr_thread_mutex_unlock(mutex);
+#endif
+  };
+
+  bool ProviderMatcher::host_pattern(const string& pattern, string& host, bool& subdomains, int& flags) {
+    if(pattern.empty() || pattern[0] != '^')
+      return false;
+    size_t i = 1;
+
+    // scheme
+    int schemes;
+    if(pattern.compare(i, 9, "https?://") == 0) {
+      schemes = PROVIDER_HTTP_PATH | PROVIDER_HTTPS_PATH;
+      i += 9;
+    } else if(pattern.compare(i, 11, "(https?)://") == 0) {
+      schemes = PROVIDER_HTTP_PATH | PROVIDER_HTTPS_PATH;
+      i += 11;
+    } else if(pattern.compare(i, 15, "(http|https)://") == 0 || pattern.compare(i, 15, "(https|http)://") == 0) {
+      schemes = PROVIDER_HTTP_PATH | PROVIDER_HTTPS_PATH;
+      i += 15;
+    } else if(pattern.compare(i, 8, "https://") == 0) {
+      schemes = PROVIDER_HTTPS_PATH;
+      i += 8;
+    } else if(pattern.compare(i, 7, "http://") == 0) {
+      schemes = PROVIDER_HTTP_PATH;
+      i += 7;
+    } else
+      return false;
+
+    // optional subdomains
+    subdomains = false;
+    if(pattern.compare(i, 10, "([^/]*\\.)?") == 0) {
+      subdomains = true;
+      i += 10;
+    }
+
+    // the host itself - only letters, digits, dashes and escaped dots
+    host = "";
+    while(i < pattern.size()) {
+      char c = pattern[i];
+      if(isalnum((unsigned char) c) || c == '-') {
+        host += c;
+        i++;
+      } else if(c == '\\' && i + 1 < pattern.size() && pattern[i+1] == '.') {
+        host += '.';
+        i += 2;
+      } else
+        break;
+    }
+    if(host.empty())
+      return false;
+
+    // what may follow the host
+    string rest = pattern.substr(i);
+    int ends;
+    if(rest == "/" || rest == "/.*")
+      ends = 1;
+    else if(rest == "$")
+      ends = 2;
+    else if(rest == "(/|$)" || rest == "($|/)")
+      ends = 3;
+    else
+      return false;
+
+    // the END flags are one bit above the PATH flags
+    flags = 0;
+    if(ends & 1)
+      flags |= schemes;
+    if(ends & 2)
+      flags |= (schemes << 1);
+    return true;
+  };
+
+  bool ProviderMatcher::can_combine(const string& pattern) {
+    // anything that refers to a group by number, or a verb that has to start the pattern,
+    // would change meaning inside an alternation
+    for(size_t i = 0; i + 1 < pattern.size(); i++) {
+      char c = pattern[i], n = pattern[i+1];
+      if(c == '\\' && (isdigit((unsigned char) n) || n == 'g' || n == 'k'))
+        return false;
+      if(c == '(' && n == '*')
+        return false;
+      if(c == '(' && n == '?' && i + 2 < pattern.size()) {
+        char o = pattern[i+2];
+        if(isdigit((unsigned char) o) || o == 'R' || o == '+' || o == '&' || o == 'P')
+          return false;
+        if(o == '-' && i + 3 < pattern.size() && isdigit((unsigned char) pattern[i+3]))
+          return false;
+      }
+    }
+    return true;
+  };
+
+  const char *ProviderMatcher::add_pattern(const char *pattern) {
+    string p = pattern;
+    string host;
+    bool subdomains;
+    int flags;
+    if(host_pattern(p, host, subdomains, flags)) {
+      if(subdomains) {
+        // walk down the labels from the right
+        suffix_node_t *node = suffixes;
+        size_t end = host.size();
+        while(true) {
+          size_t dot = (end == 0) ? string::npos : host.rfind('.', end - 1);
+          string label = (dot == string::npos) ? host.substr(0, end) : host.substr(dot + 1, end - dot - 1);
+          map<string, suffix_node_t *>::iterator it = node->children.find(label);
+          if(it == node->children.end()) {
+            suffix_node_t *child = new suffix_node_t;
+            child->flags = 0;
+            node->children[label] = child;
+            node = child;
+          } else
+            node = it->second;
+          if(dot == string::npos)
+            break;
+          end = dot;
+        }
+        node->flags |= flags;
+      } else {
+        int *existing = (int *) apr_hash_get(hosts, host.data(), host.size());
+        if(existing == NULL) {
+          existing = (int *) apr_pcalloc(pool, sizeof(int));
+          apr_hash_set(hosts, apr_pstrmemdup(pool, host.data(), host.size()), host.size(), existing);
+        }
+        *existing |= flags;
+      }
+    } else if(!can_combine(p)) {
+      compiled_regex_t re;
+      const char *error = regex_compile(pool, pattern, &re);
+      if(error != NULL)
+        return error;
+      separate.push_back(re);
+    } else {
+      // make sure it compiles on its own - the combined pattern is only built once the
+      // whole list has been read
+      const char *error;
+      int erroffset;
+      pcre *re = pcre_compile(pattern, 0, &error, &erroffset, NULL);
+      if(re == NULL)
+        return apr_psprintf(pool, "regex compilation failed for regex \"%s\" at offset %d: %s", pattern, erroffset, error);
+      pcre_free(re);
+      combinable.push_back(p);
+      prepared = false;
+    }
+    count++;
+    decisions.clear();
+    return NULL;
+  };
+
+  void ProviderMatcher::prepare_at_startup() {
+    if(pending == NULL)
+      pending = new vector<ProviderMatcher *>;
+    if(find(pending->begin(), pending->end(), this) == pending->end())
+      pending->push_back(this);
+  };
+
+  void ProviderMatcher::prepare_all() {
+    if(pending == NULL)
+      return;
+    for(vector<ProviderMatcher *>::iterator it = pending->begin(); it != pending->end(); ++it)
+      (*it)->prepare();
+    delete pending;
+    pending = NULL;
+  };
+
+  void ProviderMatcher::prepare() {
+    prepared = true;
+    if(combinable.empty())
+      return;
+    string pattern = "";
+    for(vector<string>::const_iterator it = combinable.begin(); it != combinable.end(); ++it)
+      pattern += ((it == combinable.begin()) ? "(?:" : "|(?:") + *it + ")";
+
+    const char *error;
+    int erroffset;
+    pcre *re = pcre_compile(pattern.c_str(), 0, &error, &erroffset, NULL);
+    if(re == NULL) {
+      // every pattern compiled alone, so this shouldn't happen - try them one at a time instead
+      print_to_error_log(string("could not combine provider patterns, matching them one by one: ") + error);
+      for(vector<string>::const_iterator it = combinable.begin(); it != combinable.end(); ++it) {
+        compiled_regex_t single;
+        if(regex_compile(pool, apr_pstrdup(pool, it->c_str()), &single) == NULL)
+          separate.push_back(single);
+      }
+      combinable.clear();
+      return;
+    }
+#ifdef PCRE_STUDY_JIT_COMPILE
+    pcre_extra *extra = pcre_study(re, PCRE_STUDY_JIT_COMPILE, &error);
+#else
+    pcre_extra *extra = pcre_study(re, 0, &error);
+#endif
+    if(combined_extra != NULL) {
+#ifdef PCRE_CONFIG_JIT
+      pcre_free_study(combined_extra);
+#else
+      pcre_free(combined_extra);
+#endif
+    }
+    if(combined != NULL)
+      pcre_free(combined);
+    combined = re;
+    combined_extra = extra;
+  };
+
+  bool ProviderMatcher::match_host(const string& url) const {
+    int path_flag;
+    size_t start;
+    if(url.compare(0, 7, "http://") == 0) {
+      path_flag = PROVIDER_HTTP_PATH;
+      start = 7;
+    } else if(url.compare(0, 8, "https://") == 0) {
+      path_flag = PROVIDER_HTTPS_PATH;
+      start = 8;
+    } else
+      return false;
+
+    size_t slash = url.find('/', start);
+    string authority = (slash == string::npos) ? url.substr(start) : url.substr(start, slash - start);
+    int flag = (slash == string::npos) ? (path_flag << 1) : path_flag;
+
+    int *exact = (int *) apr_hash_get(hosts, authority.data(), authority.size());
+    if(exact != NULL && (*exact & flag))
+      return true;
+
+    // any suffix ending on a label boundary with the right flags is a match
+    const suffix_node_t *node = suffixes;
+    size_t end = authority.size();
+    while(true) {
+      size_t dot = (end == 0) ? string::npos : authority.rfind('.', end - 1);
+      string label = (dot == string::npos) ? authority.substr(0, end) : authority.substr(dot + 1, end - dot - 1);
+      map<string, suffix_node_t *>::const_iterator it = node->children.find(label);
+      if(it == node->children.end())
+        return false;
+      node = it->second;
+      if(node->flags & flag)
+        return true;
+      if(dot == string::npos)
+        return false;
+      end = dot;
+    }
+  };
+
+  bool ProviderMatcher::match_regex(const string& url) const {
+    if(combined != NULL && pcre_exec(combined, combined_extra, url.c_str(), url.size(), 0, 0, NULL, 0) >= 0)
+      return true;
+    for(vector<compiled_regex_t>::const_iterator it = separate.begin(); it != separate.end(); ++it)
+      if(regex_match(url, &(*it)))
+        return true;
+    return false;
+  };
+
+  bool ProviderMatcher::matches(const string& url) {
+    if(count == 0)
+      return false;
+
+    lock();
+    map<string, bool>::const_iterator found = decisions.find(url);
+    if(found != decisions.end()) {
+      bool result = found->second;
+      unlock();
+      return result;
+    }
+    if(!prepared)
+      prepare();
+    unlock();
+
+    bool result = match_host(url) || match_regex(url);
+
+    lock();
+    if(decisions.size() >= PROVIDER_DECISION_CACHE_SIZE)
+      decisions.clear();
+    decisions[url] = result;
+    unlock();
+    return result;
+  };
+}
+
@@ -0,0 +1,114 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace std;
+
+  // Matches identity provider urls against a (possibly very long) AuthOpenIDTrusted or
+  // AuthOpenIDDistrusted list without trying every pattern in turn.  Patterns that only
+  // name a host, like ^https?://example\.com/ or ^https://([^/]*\.)?example\.com(/|$), are
+  // kept in a hash of hosts and a trie of domain suffixes.  All other patterns are joined
+  // into a single alternation so pcre only makes one pass over the url.  Results are also
+  // remembered for the most recently checked urls.
+  class ProviderMatcher {
+  public:
+    // everything is allocated from p
+    ProviderMatcher(apr_pool_t *p);
+    ~ProviderMatcher();
+
+    // add a regular expression to the list - returns an error message if it doesn't compile,
+    // or NULL on success
+    const char *add_pattern(const char *pattern);
+
+    // true if no patterns have been added
+    bool empty() const { return count == 0; };
+
+    // true if any pattern is found in url (which should have no query string)
+    bool matches(const string& url);
+
+    // have the combined alternation compiled by prepare_all rather than on the first match -
+    // for matchers filled in while the server config is read
+    void prepare_at_startup();
+
+    // compile the combined alternation of every matcher passed to prepare_at_startup (called
+    // from post_config, once the whole config has been read)
+    static void prepare_all();
+
+  private:
+    typedef struct suffix_node {
+      int flags;
+      map<string, struct suffix_node *> children;
+    } suffix_node_t;
+
+    // work out if pattern only names a host (and maybe its subdomains) - if so, set host,
+    // subdomains and the url flags it accepts
+    static bool host_pattern(const string& pattern, string& host, bool& subdomains, int& flags);
+
+    // true if pattern can be put into an alternation with others without changing its meaning
+    static bool can_combine(const string& pattern);
+
+    // compile the combined alternation - done by prepare_all, or the first time a url is
+    // matched for matchers that weren't passed to prepare_at_startup (i.e., from .htaccess files)
+    void prepare();
+
+    // check the host hash and suffix trie
+    bool match_host(const string& url) const;
+
+    // check the regular expressions
+    bool match_regex(const string& url) const;
+
+    static void free_suffix_node(suffix_node_t *node);
+
+    void lock();
+    void unlock();
+
+    apr_pool_t *pool;
+    int count;
+
+    // exact hosts, mapping to an int * of flags
+    apr_hash_t *hosts;
+    suffix_node_t *suffixes;
+
+    // patterns to join in one alternation, and ones that have to be tried alone
+    vector<string> combinable;
+    vector<compiled_regex_t> separate;
+    pcre *combined;
+    pcre_extra *combined_extra;
+    bool prepared;
+
+    // recently seen urls and whether they matched
+    map<string, bool> decisions;
+
+    // matchers waiting for prepare_all - only touched while the config is read
+    static vector<ProviderMatcher *> *pending;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+  };
+}
+
@@ -0,0 +1,130 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+namespace modauthopenid {
+  using namespace std;
+
+  static int reap_interval = 0;
+  static int reap_batch_size = 0;
+  static time_t last_tick = 0;
+  static Preassociator *reaper_preassociations = NULL;
+  static volatile bool stopping = false;
+#if APR_HAS_THREADS
+  static apr_thread_t *reaper_thread = NULL;
+  // keeps request threads from ticking at the same time when there's no reaper thread
+  static apr_thread_mutex_t *tick_mutex = NULL;
+#endif
+
+  void Reaper::start(apr_pool_t *p, int interval, int batch_size, Preassociator *preassociations) {
+    reap_interval = interval;
+    reap_batch_size = batch_size;
+    reaper_preassociations = (preassociations != NULL && !preassociations->empty()) ? preassociations : NULL;
+    stopping = false;
+    if(reap_interval <= 0 && reaper_preassociations == NULL)
+      return;
+#if APR_HAS_THREADS
+    if(apr_thread_create(&reaper_thread, NULL, Reaper::run, NULL, p) != APR_SUCCESS) {
+      print_to_error_log("could not start reaper thread - expired rows will be removed (and preassociations renewed) by the request handler");
+      reaper_thread = NULL;
+      if(apr_thread_mutex_create(&tick_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS)
+        tick_mutex = NULL;
+      return;
+    }
+    apr_pool_cleanup_register(p, NULL, Reaper::stop, apr_pool_cleanup_null);
+#endif
+  };
+
+  void Reaper::tick() {
+#if APR_HAS_THREADS
+    // another request is already at it
+    if(tick_mutex != NULL && apr_thread_mutex_trylock(tick_mutex) != APR_SUCCESS)
+      return;
+#endif
+    time_t now = time(0);
+    if(reaper_preassociations != NULL)
+      reaper_preassociations->refresh(now);
+    if(reap_interval > 0 && now - last_tick >= reap_interval) {
+      last_tick = now;
+      vector<pair<string, string> > locations;
+      ConnectionPool::locations(locations);
+      for(vector<pair<string, string> >::size_type i = 0; i < locations.size() && !stopping; i++)
+        reap(locations[i].first, locations[i].second, now);
+    }
+#if APR_HAS_THREADS
+    if(tick_mutex != NULL)
+      apr_thread_mutex_unlock(tick_mutex);
+#endif
+  };
+
+  bool Reaper::running() {
+#if APR_HAS_THREADS
+    return reaper_thread != NULL;
+#else
+    return false;
+#endif
+  };
+
+  void Reaper::reap(const string& type, const string& location, time_t now) {
+    // claim this interval's run - if another child got here first, there's nothing to do
+    Storage *storage = ConnectionPool::acquire(type, location);
+    if(storage == NULL)
+      return;
+    if(storage->claim_task("reap", now, reap_interval)) {
+      debug("reaping expired entries from " + location);
+      storage->ween_expired(reap_batch_size);
+    }
+    ConnectionPool::release(storage);
+  };
+
+#if APR_HAS_THREADS
+  void * APR_THREAD_FUNC Reaper::run(apr_thread_t *thread, void *data) {
+    while(!stopping) {
+      tick();
+      // sleep in small steps so that child shutdown isn't held up
+      for(int i = 0; i < 10 && !stopping; i++)
+        apr_sleep(apr_time_from_msec(100));
+    }
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+  };
+#endif
+
+  apr_status_t Reaper::stop(void *data) {
+    stopping = true;
+#if APR_HAS_THREADS
+    if(reaper_thread != NULL) {
+      apr_status_t rv;
+      apr_thread_join(&rv, reaper_thread);
+      reaper_thread = NULL;
+    }
+#endif
+    return APR_SUCCESS;
+  };
+}
@@ -0,0 +1,63 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace std;
+
+  // Deletes expired sessions, associations, authentication sessions and nonces in the
+  // background so that lookups on the request path never have to write.  Each child runs
+  // a reaper thread, but Storage::claim_task makes sure only one child actually reaps a
+  // given store per interval.
+  class Reaper {
+  public:
+    // start reaping every interval seconds, deleting at most batch_size rows from each
+    // table per run, and keeping the associations in preassociations (which may be NULL)
+    // fresh.  The reaper is stopped when p is cleaned up.  An interval of 0 turns reaping off.
+    static void start(apr_pool_t *p, int interval, int batch_size, Preassociator *preassociations);
+
+    // reap every store this child has open if interval has passed since the last run
+    // (by any child), and renew preassociations.  Called by the reaper thread, or by the
+    // request handler when the reaper thread isn't running.
+    static void tick();
+
+    // true if this child's reaper thread is running
+    static bool running();
+
+  private:
+    // reap the store of the given type at location if no other child has done so this interval
+    static void reap(const string& type, const string& location, time_t now);
+
+#if APR_HAS_THREADS
+    static void * APR_THREAD_FUNC run(apr_thread_t *thread, void *data);
+#endif
+
+    // pool cleanup function - stop the reaper thread
+    static apr_status_t stop(void *data);
+  };
+}
+
@@ -0,0 +1,482 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// default redis port
+#define REDIS_DEFAULT_PORT 6379
+
+// how long to wait for the server to connect or answer before giving up on the connection
+#define REDIS_TIMEOUT apr_time_from_sec(2)
+
+// prefix for every key, so the server can be shared with other applications
+#define REDIS_KEY_PREFIX "moid:"
+
+namespace modauthopenid {
+  using namespace std;
+  using namespace opkele;
+
+  static string int_string(apr_int64_t i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%" APR_INT64_T_FMT, i);
+    return string(buf);
+  };
+
+  static string session_key(const string& session_id) {
+    return REDIS_KEY_PREFIX "session:" + session_id;
+  };
+
+  static string assoc_key(const string& server, const string& handle) {
+    return REDIS_KEY_PREFIX "assoc:" + server + '\n' + handle;
+  };
+
+  // a sorted set of the handles of server's associations, scored by when they expire
+  static string server_assocs_key(const string& server) {
+    return REDIS_KEY_PREFIX "server_assocs:" + server;
+  };
+
+  static string auth_session_key(const string& nonce) {
+    return REDIS_KEY_PREFIX "auth_session:" + nonce;
+  };
+
+  static string nonce_key(const string& server, const string& nonce) {
+    return REDIS_KEY_PREFIX "nonce:" + server + '\n' + nonce;
+  };
+
+  static string capabilities_key(const string& server) {
+    return REDIS_KEY_PREFIX "capabilities:" + server;
+  };
+
+  static string task_key(const string& task) {
+    return REDIS_KEY_PREFIX "task:" + task;
+  };
+
+  RedisStorage::RedisStorage(apr_pool_t *_pool, apr_socket_t *_sock) : pool(_pool), sock(_sock), queued(0), in_pos(0) {
+  };
+
+  RedisStorage *RedisStorage::open(const string& location) {
+    // location is host[:port][/db]
+    string host = location, db = "";
+    apr_port_t port = REDIS_DEFAULT_PORT;
+    string::size_type slash = host.find('/');
+    if(slash != string::npos) {
+      db = host.substr(slash + 1);
+      host = host.substr(0, slash);
+    }
+    // the port follows the last ':', unless that's part of an IPv6 address
+    string::size_type colon = host.rfind(':'), bracket = host.rfind(']');
+    if(colon != string::npos && ((bracket != string::npos) ? (colon > bracket) : (host.find(':') == colon))) {
+      port = (apr_port_t) atoi(host.substr(colon + 1).c_str());
+      host = host.substr(0, colon);
+    }
+    if(host.size() > 1 && host[0] == '[' && host[host.size() - 1] == ']')
+      host = host.substr(1, host.size() - 2);
+    if(host == "" || port == 0) {
+      print_to_error_log("invalid redis location \"" + location + "\" - should be host[:port][/db]");
+      return NULL;
+    }
+
+    apr_pool_t *pool;
+    if(apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+      print_to_error_log("could not create pool for redis connection");
+      return NULL;
+    }
+    apr_sockaddr_t *sa;
+    apr_socket_t *sock;
+    if(apr_sockaddr_info_get(&sa, host.c_str(), APR_UNSPEC, port, 0, pool) != APR_SUCCESS ||
+       apr_socket_create(&sock, sa->family, SOCK_STREAM, APR_PROTO_TCP, pool) != APR_SUCCESS) {
+      print_to_error_log("could not look up redis server " + location);
+      apr_pool_destroy(pool);
+      return NULL;
+    }
+    apr_socket_opt_set(sock, APR_TCP_NODELAY, 1);
+    apr_socket_opt_set(sock, APR_SO_KEEPALIVE, 1);
+    apr_socket_timeout_set(sock, REDIS_TIMEOUT);
+    if(apr_socket_connect(sock, sa) != APR_SUCCESS) {
+      print_to_error_log("could not connect to redis server " + location);
+      apr_socket_close(sock);
+      apr_pool_destroy(pool);
+      return NULL;
+    }
+
+    RedisStorage *storage = new RedisStorage(pool, sock);
+    if(db != "") {
+      redis_reply_t reply;
+      if(!storage->command("SELECT", 1).arg(db).run(reply)) {
+        delete storage;
+        return NULL;
+      }
+    }
+    debug("opened new connection to redis server " + location);
+    return storage;
+  };
+
+  RedisStorage::~RedisStorage() {
+    apr_socket_close(sock);
+    apr_pool_destroy(pool);
+  };
+
+  bool RedisStorage::fail(const string& context) {
+    print_to_error_log("Redis Error - " + context);
+    has_failed = true;
+    return false;
+  };
+
+  RedisStorage& RedisStorage::command(const char *name, int nargs) {
+    out += "*" + int_string(nargs + 1) + "\r\n";
+    queued++;
+    return arg(name);
+  };
+
+  RedisStorage& RedisStorage::arg(const string& value) {
+    out += "$" + int_string(value.size()) + "\r\n";
+    out += value;
+    out += "\r\n";
+    return *this;
+  };
+
+  bool RedisStorage::run(vector<redis_reply_t>& replies) {
+    int expected = queued;
+    string data;
+    data.swap(out);
+    queued = 0;
+    replies.clear();
+    if(has_failed)
+      return false;
+
+    // the whole pipeline goes out in as few writes as the socket allows
+    string::size_type sent = 0;
+    while(sent < data.size()) {
+      apr_size_t len = data.size() - sent;
+      if(apr_socket_send(sock, data.data() + sent, &len) != APR_SUCCESS)
+        return fail("problem sending commands");
+      sent += len;
+    }
+
+    bool ok = true;
+    for(int i = 0; i < expected; i++) {
+      redis_reply_t reply;
+      if(!read_reply(reply))
+        return fail("problem reading reply");
+      if(reply.type == '-') {
+        print_to_error_log("Redis Error - " + reply.str);
+        has_failed = true;
+        ok = false;
+      }
+      replies.push_back(reply);
+    }
+    return ok;
+  };
+
+  bool RedisStorage::run(redis_reply_t& reply) {
+    vector<redis_reply_t> replies;
+    bool ok = run(replies);
+    if(!replies.empty())
+      reply = replies.back();
+    return ok && !replies.empty();
+  };
+
+  bool RedisStorage::fill() {
+    // drop what's been used before reading more
+    if(in_pos > 0) {
+      in.erase(0, in_pos);
+      in_pos = 0;
+    }
+    char buf[4096];
+    apr_size_t len = sizeof(buf);
+    apr_status_t rv = apr_socket_recv(sock, buf, &len);
+    if(len > 0)
+      in.append(buf, len);
+    return len > 0 || rv == APR_SUCCESS;
+  };
+
+  bool RedisStorage::read_line(string& line) {
+    string::size_type end;
+    while((end = in.find("\r\n", in_pos)) == string::npos) {
+      if(!fill())
+        return false;
+    }
+    line = in.substr(in_pos, end - in_pos);
+    in_pos = end + 2;
+    return true;
+  };
+
+  bool RedisStorage::read_bytes(string::size_type n, string& s) {
+    while(in.size() - in_pos < n) {
+      if(!fill())
+        return false;
+    }
+    s = in.substr(in_pos, n);
+    in_pos += n;
+    return true;
+  };
+
+  bool RedisStorage::read_reply(redis_reply_t& reply) {
+    string line;
+    if(!read_line(line) || line.empty())
+      return false;
+    reply.type = line[0];
+    reply.nil = false;
+    reply.integer = 0;
+    reply.str = "";
+    reply.elements.clear();
+    string rest = line.substr(1);
+    switch(reply.type) {
+    case '+':
+    case '-':
+      reply.str = rest;
+      return true;
+    case ':':
+      reply.integer = apr_atoi64(rest.c_str());
+      return true;
+    case '$': {
+      apr_int64_t len = apr_atoi64(rest.c_str());
+      if(len < 0) {
+        reply.nil = true;
+        return true;
+      }
+      string crlf;
+      return read_bytes((string::size_type) len, reply.str) && read_bytes(2, crlf);
+    }
+    case '*': {
+      apr_int64_t count = apr_atoi64(rest.c_str());
+      if(count < 0) {
+        reply.nil = true;
+        return true;
+      }
+      for(apr_int64_t i = 0; i < count; i++) {
+        redis_reply_t element;
+        if(!read_reply(element))
+          return false;
+        reply.elements.push_back(element.str);
+      }
+      return true;
+    }
+    default:
+      return false;
+    }
+  };
+
+  void RedisStorage::set_until(const string& key, const string& value, time_t expires_on, bool only_new) {
+    apr_int64_t ttl = expires_on - time(0);
+    // something that has already expired can't be found any more, so whatever was stored
+    // under key goes (this still queues exactly one command)
+    if(ttl < 0 && !only_new) {
+      command("DEL", 1).arg(key);
+      return;
+    }
+    // entries last through their expiry second, and redis wants a TTL of at least a second
+    if(ttl < 1)
+      ttl = 1;
+    command("SET", only_new ? 5 : 4).arg(key).arg(value).arg("EX").arg(int_string(ttl));
+    if(only_new)
+      arg("NX");
+  };
+
+  bool RedisStorage::get(const string& key, string& value) {
+    redis_reply_t reply;
+    if(!command("GET", 1).arg(key).run(reply) || reply.nil)
+      return false;
+    value = reply.str;
+    return true;
+  };
+
+  bool RedisStorage::get_session(const string& session_id, session_t& session) {
+    string value;
+    if(!get(session_key(session_id), value))
+      return false;
+    if(!unserialize_session(value, session)) {
+      print_to_error_log("could not read session " + session_id + " - ignoring the session");
+      return false;
+    }
+    return true;
+  };
+
+  void RedisStorage::store_session(const session_t& session) {
+    string value;
+    serialize_session(session, value);
+    set_until(session_key(session.session_id), value, session.expires_on);
+    redis_reply_t reply;
+    run(reply);
+  };
+
+  void RedisStorage::store_assoc(const assoc_record_t& assoc) {
+    string value;
+    put_string(value, assoc.type);
+    put_string(value, string(assoc.secret.begin(), assoc.secret.end()));
+    put_varint(value, (apr_uint64_t) assoc.expires_on);
+    // store the association, index its handle, drop expired handles from the index and read
+    // back when the last one in it expires - all in one round trip
+    string index = server_assocs_key(assoc.server);
+    set_until(assoc_key(assoc.server, assoc.handle), value, assoc.expires_on);
+    command("ZADD", 3).arg(index).arg(int_string(assoc.expires_on)).arg(assoc.handle);
+    command("ZREMRANGEBYSCORE", 3).arg(index).arg("-inf").arg("(" + int_string(time(0)));
+    command("ZRANGE", 4).arg(index).arg("-1").arg("-1").arg("WITHSCORES");
+    vector<redis_reply_t> replies;
+    if(!run(replies) || replies.size() != 4 || replies[3].elements.size() != 2)
+      return;
+    // the index lasts as long as the association in it that expires last (an association
+    // stored at the same time on another node may cut that short, in which case find_assoc
+    // misses until the next one is stored)
+    redis_reply_t reply;
+    command("EXPIREAT", 2).arg(index).arg(replies[3].elements[1]).run(reply);
+  };
+
+  bool RedisStorage::get_assoc(const string& server, const string& handle, assoc_record_t& assoc) {
+    string value, secret;
+    if(!get(assoc_key(server, handle), value))
+      return false;
+    string::size_type pos = 0;
+    apr_uint64_t expires_on;
+    if(!get_string(value, pos, assoc.type) || !get_string(value, pos, secret) || !get_varint(value, pos, expires_on)) {
+      print_to_error_log("could not read association for server \"" + server + "\" and handle \"" + handle + "\"");
+      return false;
+    }
+    assoc.server = server;
+    assoc.handle = handle;
+    assoc.secret.assign(secret.begin(), secret.end());
+    assoc.expires_on = (time_t) expires_on;
+    return true;
+  };
+
+  bool RedisStorage::find_assoc(const string& server, assoc_record_t& assoc) {
+    // the handle that expires last, unless that's already passed
+    redis_reply_t reply;
+    command("ZREVRANGEBYSCORE", 6).arg(server_assocs_key(server)).arg("+inf").arg(int_string(time(0))).arg("LIMIT").arg("0").arg("1");
+    if(!run(reply) || reply.elements.empty())
+      return false;
+    return get_assoc(server, reply.elements[0], assoc);
+  };
+
+  void RedisStorage::remove_assoc(const string& server, const string& handle) {
+    command("DEL", 1).arg(assoc_key(server, handle));
+    command("ZREM", 2).arg(server_assocs_key(server)).arg(handle);
+    vector<redis_reply_t> replies;
+    run(replies);
+  };
+
+  bool RedisStorage::get_capabilities(const string& server, op_capabilities_t& caps) {
+    string value;
+    if(!get(capabilities_key(server), value))
+      return false;
+    string::size_type pos = 0;
+    apr_uint64_t stateless, expires_on;
+    if(!get_string(value, pos, caps.assoc_type) || !get_string(value, pos, caps.session_type) ||
+       !get_varint(value, pos, stateless) || !get_varint(value, pos, expires_on))
+      return false;
+    caps.server = server;
+    caps.stateless = (stateless != 0);
+    caps.expires_on = (time_t) expires_on;
+    return true;
+  };
+
+  void RedisStorage::store_capabilities(const op_capabilities_t& caps) {
+    string value;
+    put_string(value, caps.assoc_type);
+    put_string(value, caps.session_type);
+    put_varint(value, caps.stateless ? 1 : 0);
+    put_varint(value, (apr_uint64_t) caps.expires_on);
+    set_until(capabilities_key(caps.server), value, caps.expires_on);
+    redis_reply_t reply;
+    run(reply);
+  };
+
+  void RedisStorage::store_auth_session(const auth_session_t& auth_session) {
+    string value;
+    put_string(value, auth_session.endpoint.uri);
+    put_string(value, auth_session.endpoint.claimed_id);
+    put_string(value, auth_session.endpoint.local_id);
+    put_string(value, auth_session.normalized_id);
+    put_varint(value, (apr_uint64_t) auth_session.expires_on);
+    put_endpoints(value, auth_session.fallbacks);
+    set_until(auth_session_key(auth_session.nonce), value, auth_session.expires_on);
+    redis_reply_t reply;
+    run(reply);
+  };
+
+  bool RedisStorage::get_auth_session(const string& nonce, auth_session_t& auth_session) {
+    string value;
+    if(!get(auth_session_key(nonce), value))
+      return false;
+    string::size_type pos = 0;
+    apr_uint64_t expires_on;
+    if(!get_string(value, pos, auth_session.endpoint.uri) || !get_string(value, pos, auth_session.endpoint.claimed_id) ||
+       !get_string(value, pos, auth_session.endpoint.local_id) || !get_string(value, pos, auth_session.normalized_id) ||
+       !get_varint(value, pos, expires_on) || !get_endpoints(value, pos, auth_session.fallbacks)) {
+      print_to_error_log("could not read authentication session " + nonce);
+      return false;
+    }
+    auth_session.nonce = nonce;
+    auth_session.expires_on = (time_t) expires_on;
+    return true;
+  };
+
+  void RedisStorage::remove_auth_session(const string& nonce) {
+    redis_reply_t reply;
+    command("DEL", 1).arg(auth_session_key(nonce)).run(reply);
+  };
+
+  bool RedisStorage::add_nonce(const string& server, const string& nonce, time_t expires_on) {
+    // SET NX checks and adds in one step, so two nodes can't both accept the nonce
+    set_until(nonce_key(server, nonce), "1", expires_on, true);
+    redis_reply_t reply;
+    return run(reply) && !reply.nil;
+  };
+
+  void RedisStorage::ween_expired(int batch_size) {
+    // everything is stored with a TTL - redis removes expired keys itself
+  };
+
+  bool RedisStorage::claim_task(const string& task, time_t now, int interval) {
+    // the key only exists for interval seconds after the task was claimed
+    set_until(task_key(task), int_string(now), now + interval, true);
+    redis_reply_t reply;
+    return run(reply) && !reply.nil;
+  };
+
+  // This is a method to be used by a utility program, never the apache module
+  void RedisStorage::print() {
+    redis_reply_t keys;
+    if(!command("KEYS", 1).arg(REDIS_KEY_PREFIX "*").run(keys))
+      return;
+    // all TTLs in one round trip
+    for(vector<string>::size_type i = 0; i < keys.elements.size(); i++)
+      command("TTL", 1).arg(keys.elements[i]);
+    vector<redis_reply_t> ttls;
+    if(!run(ttls))
+      return;
+    fprintf(stdout, "There are %d keys.\n", (int) keys.elements.size());
+    for(vector<string>::size_type i = 0; i < keys.elements.size() && i < ttls.size(); i++) {
+      string key = keys.elements[i];
+      replace(key.begin(), key.end(), '\n', '\t');
+      fprintf(stdout, "%s\tttl: %ld\n", key.c_str(), (long) ttls[i].integer);
+    }
+    fprintf(stdout, "\n");
+  };
+}
+
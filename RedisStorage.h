@@ -0,0 +1,110 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+
+namespace modauthopenid {
+  using namespace opkele;
+  using namespace std;
+
+  // A reply from a redis server
+  typedef struct redis_reply {
+    char type;                // the RESP type: '+' status, '-' error, ':' integer, '$' bulk or '*' array
+    bool nil;                 // true for a nil bulk or array
+    string str;               // status, error or bulk string
+    apr_int64_t integer;
+    vector<string> elements;  // an array's elements (only arrays of bulk strings are used here)
+  } redis_reply_t;
+
+  // Storage on a redis server (AuthOpenIDStorage redis), so that several apache nodes can share
+  // sessions.  AuthOpenIDDBLocation is host[:port][/db] (the port defaults to 6379).  Each
+  // instance is one persistent connection - the ConnectionPool keeps them open between
+  // requests - and commands that go together are pipelined into a single round trip.
+  // Everything is stored with a redis TTL, so expired entries never need to be weened.
+  class RedisStorage : public Storage {
+  public:
+    // connect to the server at location (and select its db) - NULL if it can't be reached
+    static RedisStorage *open(const string& location);
+
+    // closes the connection
+    virtual ~RedisStorage();
+
+    virtual bool shared() const { return true; };
+    virtual bool get_session(const string& session_id, session_t& session);
+    virtual void store_session(const session_t& session);
+    virtual void store_assoc(const assoc_record_t& assoc);
+    virtual bool get_assoc(const string& server, const string& handle, assoc_record_t& assoc);
+    virtual bool find_assoc(const string& server, assoc_record_t& assoc);
+    virtual void remove_assoc(const string& server, const string& handle);
+    virtual bool get_capabilities(const string& server, op_capabilities_t& caps);
+    virtual void store_capabilities(const op_capabilities_t& caps);
+    virtual void store_auth_session(const auth_session_t& auth_session);
+    virtual bool get_auth_session(const string& nonce, auth_session_t& auth_session);
+    virtual void remove_auth_session(const string& nonce);
+    virtual bool add_nonce(const string& server, const string& nonce, time_t expires_on);
+    virtual void ween_expired(int batch_size);
+    virtual bool claim_task(const string& task, time_t now, int interval);
+    virtual void print();
+
+  private:
+    RedisStorage(apr_pool_t *_pool, apr_socket_t *_sock);
+
+    // add a command with nargs arguments to the pipeline - follow it with nargs calls to arg().
+    // Nothing is sent until run() is called.
+    RedisStorage& command(const char *name, int nargs);
+    RedisStorage& arg(const string& value);
+
+    // send every command in the pipeline and read their replies (in order) - false on a
+    // connection error or if any reply is an error
+    bool run(vector<redis_reply_t>& replies);
+    bool run(redis_reply_t& reply);
+
+    // SET key value with a TTL that runs out at expires_on (and NX if only_new) - or DEL key
+    // if expires_on has already passed and !only_new
+    void set_until(const string& key, const string& value, time_t expires_on, bool only_new = false);
+
+    // GET key - false if there's no such key (or on error)
+    bool get(const string& key, string& value);
+
+    // read from the connection
+    bool read_reply(redis_reply_t& reply);
+    bool read_line(string& line);
+    bool read_bytes(string::size_type n, string& s);
+    bool fill();
+
+    // log an error and mark this connection failed - always returns false
+    bool fail(const string& context);
+
+    apr_pool_t *pool;
+    apr_socket_t *sock;
+    string out;                 // pipelined commands that haven't been sent yet
+    int queued;                 // number of commands in out
+    string in;                  // data read but not used yet
+    string::size_type in_pos;
+  };
+}
+
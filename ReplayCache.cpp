@@ -0,0 +1,123 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// number of time slices the window is split into
+#define REPLAY_BUCKETS 16
+
+// how many slots in a bucket a nonce may end up in
+#define REPLAY_MAX_PROBES 16
+
+// slot state while its hashes are being written
+#define REPLAY_SLOT_BUSY 0xFFFFFFFFU
+
+// how many times to wait for a slot that's being written before giving up
+#define REPLAY_MAX_WAITS 10
+
+namespace modauthopenid {
+  using namespace std;
+
+  typedef struct replay_slot {
+    volatile apr_uint32_t slice; // the time slice the nonce belongs to, or REPLAY_SLOT_BUSY
+    apr_uint32_t hash1;
+    apr_uint32_t hash2;
+  } replay_slot_t;
+
+  static void replay_cache_cleanup(void *ptr) { delete (ReplayCache *) ptr; }
+
+  ReplayCache *ReplayCache::create(apr_pool_t *p, int nslots, int window) {
+    if(nslots <= 0 || window <= 0)
+      return NULL;
+    apr_uint32_t bucket_slots = nslots / REPLAY_BUCKETS;
+    if(bucket_slots < REPLAY_MAX_PROBES)
+      bucket_slots = REPLAY_MAX_PROBES;
+
+    // nonces are accepted from window seconds in the past to window seconds in the future -
+    // all but one of the buckets have to cover that
+    apr_uint32_t width = (2 * window) / (REPLAY_BUCKETS - 1) + 1;
+
+    apr_shm_t *shm;
+    apr_status_t rv = apr_shm_create(&shm, sizeof(replay_slot_t) * bucket_slots * REPLAY_BUCKETS, NULL, p);
+    if(rv != APR_SUCCESS) {
+      char err[256];
+      print_to_error_log("could not create shared memory nonce cache: " + string(apr_strerror(rv, err, sizeof(err))));
+      return NULL;
+    }
+    ReplayCache *cache = new ReplayCache(shm, bucket_slots, width);
+    apr_pool_cleanup_register(p, (void *) cache, (apr_status_t(*)(void *)) replay_cache_cleanup, apr_pool_cleanup_null);
+    return cache;
+  };
+
+  ReplayCache::ReplayCache(apr_shm_t *_shm, apr_uint32_t _bucket_slots, apr_uint32_t _width) :
+    shm(_shm), bucket_slots(_bucket_slots), width(_width) {
+    slots = (replay_slot_t *) apr_shm_baseaddr_get(shm);
+    memset(slots, 0, sizeof(replay_slot_t) * bucket_slots * REPLAY_BUCKETS);
+  };
+
+  nonce_check_t ReplayCache::check(const string& key, time_t timestamp) {
+    apr_uint32_t slice = (apr_uint32_t) (timestamp / width);
+    apr_uint32_t hash1 = hash_string(key);
+    apr_uint32_t hash2 = hash_string("\n" + key);
+    replay_slot_t *bucket = slots + (apr_size_t) (slice % REPLAY_BUCKETS) * bucket_slots;
+
+    // every check for the same key walks the same slots, and a slot is never given up while
+    // its slice is current - so two requests with the same nonce can't both miss it
+    for(apr_uint32_t i = 0; i < REPLAY_MAX_PROBES; i++) {
+      replay_slot_t *s = bucket + ((hash1 + i) % bucket_slots);
+      int waits = 0;
+      while(true) {
+        apr_uint32_t state = apr_atomic_read32(&s->slice);
+        if(state == REPLAY_SLOT_BUSY) {
+          // the writer may be adding this very key, so the slot can't be skipped
+          if(++waits > REPLAY_MAX_WAITS)
+            return NONCE_BUSY;
+          apr_sleep(1000);
+          continue;
+        }
+        if(state == slice) {
+          memory_barrier();
+          if(s->hash1 == hash1 && s->hash2 == hash2)
+            return NONCE_SEEN;
+          break;
+        }
+
+        // empty, or left over from an old slice - claim it
+        if(apr_atomic_cas32(&s->slice, REPLAY_SLOT_BUSY, state) != state)
+          continue;
+        s->hash1 = hash1;
+        s->hash2 = hash2;
+        memory_barrier();
+        apr_atomic_set32(&s->slice, slice);
+        return NONCE_NEW;
+      }
+    }
+    return NONCE_FULL;
+  };
+}
+
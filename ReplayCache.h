@@ -0,0 +1,66 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace std;
+
+  // Results of ReplayCache::check
+  typedef enum { NONCE_NEW, NONCE_SEEN, NONCE_FULL, NONCE_BUSY } nonce_check_t;
+
+  // A set of response nonces in shared memory, split into buckets by the time stamp in the
+  // nonce.  Each bucket covers a slice of time, and the buckets together cover a little more
+  // than the whole window nonces are accepted in, so a bucket is only reused once everything
+  // in it is too old to be accepted anyway.  Slots are tagged with the slice they were written
+  // in, so reusing a bucket doesn't require clearing it - slots tagged with an old slice are
+  // simply treated as empty.
+  class ReplayCache {
+  public:
+    // make a cache with room for about nslots nonces whose time stamps are at most window
+    // seconds from now.  Must be called before children are forked (i.e., in post_config).
+    // Returns NULL if the shared memory segment can't be created.  The cache is destroyed
+    // with p.
+    static ReplayCache *create(apr_pool_t *p, int nslots, int window);
+
+    // add key (with the given nonce time stamp) to the set.  Returns NONCE_SEEN if it was
+    // already there, and NONCE_FULL if there was no room - in which case the same key will
+    // keep coming back NONCE_FULL until its time stamp leaves the window, so the caller can
+    // safely keep track of it somewhere else.  Returns NONCE_BUSY if a slot the key may be
+    // in stayed locked by another writer for too long.  That writer may be adding this very
+    // key and will then get NONCE_NEW without recording it anywhere else, so the caller has
+    // to treat the key as already seen.
+    nonce_check_t check(const string& key, time_t timestamp);
+
+  private:
+    ReplayCache(apr_shm_t *_shm, apr_uint32_t _bucket_slots, apr_uint32_t _width);
+
+    apr_shm_t *shm;
+    struct replay_slot *slots;
+    apr_uint32_t bucket_slots, width;
+  };
+}
+
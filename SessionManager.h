@@ -32,8 +32,9 @@ namespace modauthopenid {
   // This class keeps track of cookie based sessions
   class SessionManager {
   public:
-    // storage_location is db location
-    SessionManager(const string& storage_location);
+    // storage_type is the backend (AuthOpenIDStorage) and storage_location its location - a
+    // Storage is taken from the ConnectionPool
+    SessionManager(const string& storage_type, const string& storage_location);
     ~SessionManager() { close(); };
 
     // get session with id session_id and set values in session
@@ -43,22 +44,24 @@ namespace modauthopenid {
     // store given session information in a new session entry
     void store_session(const session_t& session);
 
-    // print session table to stdout
-    void print_table();
-    
-    // close database
+    // give the storage back to the pool
     void close();
+
+    // set up the shared memory session cache with room for entries sessions - must be called
+    // before children are forked.  Sessions are put in the cache by store_session and when
+    // get_session finds them in the db.
+    static void init_cache(apr_pool_t *p, int entries);
+
+    // look for session_id in the shared memory cache only - returns false on a miss
+    static bool get_cached_session(const string& session_id, session_t& session);
   private:
-    sqlite3 *db;
-    
-    // delete all expired sessions
-    void ween_expired();
+    // the shared memory session cache - NULL if there isn't one
+    static SharedCache *cache;
 
-    // db status
-    bool is_closed;
+    // put session in the shared memory cache
+    static void cache_session(const session_t& session);
 
-    // test sqlite query result - print any errors to stderr
-    bool test_result(int result, const string& context);
+    Storage *storage;
   };
 }
 
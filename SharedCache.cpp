@@ -0,0 +1,207 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// how many slots after the home slot a key may end up in
+#define MAX_PROBES 8
+
+// how many times a reader retries a slot that's being written before giving up
+#define MAX_READ_RETRIES 3
+
+// how many times (a millisecond apart) a writer waits for a key that's being written
+#define MAX_WRITE_WAITS 10
+
+namespace modauthopenid {
+  using namespace std;
+
+  typedef struct cache_slot {
+    volatile apr_uint32_t seq; // odd while the slot is being written
+    apr_uint32_t hash;
+    apr_int64_t expires_on;    // 0 if the slot is empty
+    apr_uint32_t key_len;
+    apr_uint32_t value_len;
+    // followed by slot_size bytes holding the key and then the value
+  } cache_slot_t;
+
+  static void cache_cleanup(void *ptr) { delete (SharedCache *) ptr; }
+
+  // try to take the write lock on a slot without waiting
+  static bool lock_slot(cache_slot_t *s) {
+    apr_uint32_t seq = apr_atomic_read32(&s->seq);
+    if(seq & 1)
+      return false;
+    return apr_atomic_cas32(&s->seq, seq + 1, seq) == seq;
+  };
+
+  static void unlock_slot(cache_slot_t *s) {
+    memory_barrier();
+    apr_atomic_inc32(&s->seq);
+  };
+
+  SharedCache *SharedCache::create(apr_pool_t *p, int nslots, int slot_size) {
+    if(nslots <= 0 || slot_size <= 0)
+      return NULL;
+    apr_uint32_t stride = (sizeof(cache_slot_t) + slot_size + 7) & ~7;
+    apr_size_t locks_size = (sizeof(apr_uint32_t) * nslots + 7) & ~7;
+    apr_shm_t *shm;
+    apr_status_t rv = apr_shm_create(&shm, locks_size + (apr_size_t) stride * nslots, NULL, p);
+    if(rv != APR_SUCCESS) {
+      char err[256];
+      print_to_error_log("could not create shared memory cache: " + string(apr_strerror(rv, err, sizeof(err))));
+      return NULL;
+    }
+    SharedCache *cache = new SharedCache(shm, nslots, slot_size);
+    apr_pool_cleanup_register(p, (void *) cache, (apr_status_t(*)(void *)) cache_cleanup, apr_pool_cleanup_null);
+    return cache;
+  };
+
+  SharedCache::SharedCache(apr_shm_t *_shm, int _nslots, int _slot_size) : shm(_shm), nslots(_nslots), slot_size(_slot_size) {
+    stride = (sizeof(cache_slot_t) + slot_size + 7) & ~7;
+    apr_size_t locks_size = (sizeof(apr_uint32_t) * nslots + 7) & ~7;
+    key_locks = (volatile apr_uint32_t *) apr_shm_baseaddr_get(shm);
+    base = (char *) key_locks + locks_size;
+    memset((void *) key_locks, 0, locks_size + (apr_size_t) stride * nslots);
+  };
+
+  bool SharedCache::lock_key(apr_uint32_t hash) {
+    volatile apr_uint32_t *lock = key_locks + (hash % nslots);
+    for(int waits = 0; apr_atomic_cas32(lock, 1, 0) != 0; waits++) {
+      if(waits >= MAX_WRITE_WAITS)
+        return false;
+      apr_sleep(1000);
+    }
+    return true;
+  };
+
+  void SharedCache::unlock_key(apr_uint32_t hash) {
+    memory_barrier();
+    apr_atomic_set32(key_locks + (hash % nslots), 0);
+  };
+
+  cache_slot_t *SharedCache::slot(apr_uint32_t i) const {
+    return (cache_slot_t *) (base + (apr_size_t) stride * (i % nslots));
+  };
+
+  cache_slot_t *SharedCache::find(const string& key, apr_uint32_t hash, bool write_lock) const {
+    for(apr_uint32_t i = 0; i < MAX_PROBES && i < nslots; i++) {
+      cache_slot_t *s = slot(hash + i);
+      if(s->expires_on == 0 || s->hash != hash || s->key_len != key.size())
+        continue;
+      if(write_lock && !lock_slot(s))
+        continue;
+      if(s->expires_on != 0 && s->hash == hash && s->key_len == key.size() && 
+         memcmp((char *) s + sizeof(cache_slot_t), key.data(), key.size()) == 0)
+        return s;
+      if(write_lock)
+        unlock_slot(s);
+    }
+    return NULL;
+  };
+
+  bool SharedCache::get(const string& key, string& value) const {
+    apr_uint32_t hash = hash_string(key);
+    time_t now = time(0);
+    for(apr_uint32_t i = 0; i < MAX_PROBES && i < nslots; i++) {
+      cache_slot_t *s = slot(hash + i);
+      for(int tries = 0; tries < MAX_READ_RETRIES; tries++) {
+        apr_uint32_t seq = apr_atomic_read32(&s->seq);
+        if(seq & 1)
+          continue;
+        memory_barrier();
+        apr_int64_t expires_on = s->expires_on;
+        apr_uint32_t key_len = s->key_len;
+        apr_uint32_t value_len = s->value_len;
+        bool match = (expires_on >= now && s->hash == hash && key_len == key.size() && key_len + value_len <= slot_size &&
+                      memcmp((char *) s + sizeof(cache_slot_t), key.data(), key_len) == 0);
+        if(match)
+          value.assign((char *) s + sizeof(cache_slot_t) + key_len, value_len);
+        memory_barrier();
+        if(apr_atomic_read32(&s->seq) != seq)
+          continue; // written while we were reading - try again
+        if(match)
+          return true;
+        break;
+      }
+    }
+    return false;
+  };
+
+  void SharedCache::put(const string& key, const string& value, time_t expires_on) {
+    if(key.size() + value.size() > slot_size)
+      return;
+    apr_uint32_t hash = hash_string(key);
+    time_t now = time(0);
+    if(!lock_key(hash))
+      return;
+
+    // overwrite the key if it's already here, otherwise use the first free (or expired) slot,
+    // otherwise the slot that expires soonest.  Nobody else can be storing this key now, so a
+    // slot holding it that find() can't lock is being taken over for another key and won't
+    // hold it any more.
+    cache_slot_t *s = find(key, hash, true);
+    if(s == NULL) {
+      cache_slot_t *victim = NULL;
+      for(apr_uint32_t i = 0; i < MAX_PROBES && i < nslots; i++) {
+        cache_slot_t *candidate = slot(hash + i);
+        if(candidate->expires_on < now) {
+          victim = candidate;
+          break;
+        }
+        if(victim == NULL || candidate->expires_on < victim->expires_on)
+          victim = candidate;
+      }
+      if(victim == NULL || !lock_slot(victim)) {
+        unlock_key(hash);
+        return;
+      }
+      s = victim;
+    }
+
+    s->hash = hash;
+    s->expires_on = expires_on;
+    s->key_len = key.size();
+    s->value_len = value.size();
+    memcpy((char *) s + sizeof(cache_slot_t), key.data(), key.size());
+    memcpy((char *) s + sizeof(cache_slot_t) + key.size(), value.data(), value.size());
+    unlock_slot(s);
+    unlock_key(hash);
+  };
+
+  void SharedCache::remove(const string& key) {
+    apr_uint32_t hash = hash_string(key);
+    if(!lock_key(hash))
+      return;
+    cache_slot_t *s = find(key, hash, true);
+    if(s != NULL) {
+      s->expires_on = 0;
+      unlock_slot(s);
+    }
+    unlock_key(hash);
+  };
+}
@@ -0,0 +1,74 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace std;
+
+  // A fixed size, open addressed hash table in shared memory that all children can read
+  // and write.  Every slot is protected by its own seqlock: readers never block (they retry
+  // a couple of times and then treat the lookup as a miss) and writers that find a slot
+  // busy just skip it, since everything stored here can be found elsewhere.  Writers of the
+  // same key also take a lock on the key's home slot, so a key is never stored twice.
+  class SharedCache {
+  public:
+    // make a cache with nslots slots that can each hold slot_size bytes of key and value.
+    // Must be called before children are forked (i.e., in post_config).  Returns NULL if
+    // the shared memory segment can't be created.  The cache is destroyed with p.
+    static SharedCache *create(apr_pool_t *p, int nslots, int slot_size);
+
+    // find an unexpired value for key - returns false on a miss
+    bool get(const string& key, string& value) const;
+
+    // store value under key until expires_on (unix time) - silently does nothing if the
+    // key and value are too big for a slot or if the slot is being written by someone else
+    // (or the key is, for too long)
+    void put(const string& key, const string& value, time_t expires_on);
+
+    // remove key from the cache
+    void remove(const string& key);
+
+  private:
+    SharedCache(apr_shm_t *_shm, int _nslots, int _slot_size);
+
+    // get slot i
+    struct cache_slot *slot(apr_uint32_t i) const;
+
+    // find the slot holding key (if write_lock, locked for writing) - NULL if not found
+    struct cache_slot *find(const string& key, apr_uint32_t hash, bool write_lock) const;
+
+    // take (waiting a little if needed) or release the lock for writing keys with this hash
+    bool lock_key(apr_uint32_t hash);
+    void unlock_key(apr_uint32_t hash);
+
+    apr_shm_t *shm;
+    volatile apr_uint32_t *key_locks;
+    char *base;
+    apr_uint32_t nslots, slot_size, stride;
+  };
+}
+
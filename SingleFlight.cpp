@@ -0,0 +1,84 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+// how often (in microseconds) waiters check whether a marker has been released
+#define SINGLE_FLIGHT_POLL 25000
+
+namespace modauthopenid {
+  using namespace std;
+
+  static void single_flight_cleanup(void *ptr) { delete (SingleFlight *) ptr; }
+
+  SingleFlight *SingleFlight::create(apr_pool_t *p, int nslots) {
+    if(nslots <= 0)
+      return NULL;
+    apr_shm_t *shm;
+    apr_status_t rv = apr_shm_create(&shm, sizeof(apr_uint32_t) * nslots, NULL, p);
+    if(rv != APR_SUCCESS) {
+      char err[256];
+      print_to_error_log("could not create shared memory in-flight table: " + string(apr_strerror(rv, err, sizeof(err))));
+      return NULL;
+    }
+    SingleFlight *flights = new SingleFlight(shm, nslots);
+    apr_pool_cleanup_register(p, (void *) flights, (apr_status_t(*)(void *)) single_flight_cleanup, apr_pool_cleanup_null);
+    return flights;
+  };
+
+  SingleFlight::SingleFlight(apr_shm_t *_shm, apr_uint32_t _nslots) : shm(_shm), nslots(_nslots) {
+    slots = (volatile apr_uint32_t *) apr_shm_baseaddr_get(shm);
+    memset((void *) slots, 0, sizeof(apr_uint32_t) * nslots);
+  };
+
+  volatile apr_uint32_t *SingleFlight::slot(const string& key) const {
+    return slots + (hash_string(key) % nslots);
+  };
+
+  bool SingleFlight::claim(const string& key, int ttl) {
+    volatile apr_uint32_t *s = slot(key);
+    apr_uint32_t now = (apr_uint32_t) time(0);
+    apr_uint32_t expires_on = apr_atomic_read32(s);
+    if(expires_on > now)
+      return false;
+    // empty or expired - whoever swaps in their own expiry time first has it
+    return apr_atomic_cas32(s, now + ttl, expires_on) == expires_on;
+  };
+
+  void SingleFlight::release(const string& key) {
+    apr_atomic_set32(slot(key), 0);
+  };
+
+  void SingleFlight::wait(const string& key, int timeout) const {
+    volatile apr_uint32_t *s = slot(key);
+    apr_time_t give_up = apr_time_now() + apr_time_from_sec(timeout);
+    while(apr_atomic_read32(s) > (apr_uint32_t) time(0) && apr_time_now() < give_up)
+      apr_sleep(SINGLE_FLIGHT_POLL);
+  };
+}
+
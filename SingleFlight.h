@@ -0,0 +1,67 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+
+namespace modauthopenid {
+  using namespace std;
+
+  // In-flight markers in shared memory, so that when many requests (in any child) need the same
+  // slow result at once - discovering an identifier, or associating with an OP - only one of
+  // them fetches it while the rest wait for it to show up wherever it's cached.  Each key hashes
+  // to a single slot holding the time the marker expires; different keys that share a slot
+  // just wait on each other, and a marker that's never released expires on its own, so a
+  // waiter never waits longer than the timeout.
+  class SingleFlight {
+  public:
+    // make a table with nslots markers.  Must be called before children are forked (i.e., in
+    // post_config).  Returns NULL if the shared memory segment can't be created.  The table is
+    // destroyed with p.
+    static SingleFlight *create(apr_pool_t *p, int nslots);
+
+    // claim key for at most ttl seconds - true if the caller should do the work (and then
+    // release it), false if someone else is already doing it
+    bool claim(const string& key, int ttl);
+
+    // give up the claim on key
+    void release(const string& key);
+
+    // wait (for at most timeout seconds) until no one has key claimed
+    void wait(const string& key, int timeout) const;
+
+  private:
+    SingleFlight(apr_shm_t *_shm, apr_uint32_t _nslots);
+
+    // the slot key hashes to
+    volatile apr_uint32_t *slot(const string& key) const;
+
+    apr_shm_t *shm;
+    volatile apr_uint32_t *slots;
+    apr_uint32_t nslots;
+  };
+}
+
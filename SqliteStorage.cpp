@@ -0,0 +1,444 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+namespace modauthopenid {
+  using namespace std;
+  using namespace opkele;
+
+  SqliteStorage::SqliteStorage(sqlite3 *_db) : db(_db) {
+  };
+
+  SqliteStorage *SqliteStorage::open(const string& location) {
+    sqlite3 *db;
+    int rc = sqlite3_open(location.c_str(), &db);
+    if(!test_sqlite_return(db, rc, "problem opening database")) {
+      sqlite3_close(db);
+      return NULL;
+    }
+    sqlite3_busy_timeout(db, 5000);
+    SqliteStorage *storage = new SqliteStorage(db);
+    if(!storage->create_tables()) {
+      delete storage;
+      return NULL;
+    }
+    debug("opened new connection to database " + location);
+    return storage;
+  };
+
+  SqliteStorage::~SqliteStorage() {
+    for(map<string, sqlite3_stmt *>::iterator it = statements.begin(); it != statements.end(); ++it)
+      sqlite3_finalize(it->second);
+    test_sqlite_return(db, sqlite3_close(db), "problem closing database");
+  };
+
+  bool SqliteStorage::create_tables() {
+    // one row per session - env_vars is a blob made by serialize_env_vars
+    string query = "CREATE TABLE IF NOT EXISTS sessions "
+      "(session_id VARCHAR(33) PRIMARY KEY, hostname VARCHAR(255), path VARCHAR(255), identity VARCHAR(255), expires_on INT, env_vars BLOB)";
+    int rc = sqlite3_exec(db, query.c_str(), 0, 0, 0);
+    if(!test_sqlite_return(db, rc, "problem creating table if it didn't exist already"))
+      return false;
+
+    rc = sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS sessions_expires_on_index ON sessions (expires_on)", 0, 0, 0);
+    if(!test_sqlite_return(db, rc, "problem creating index if it didn't exist already"))
+      return false;
+
+    // fallbacks is a blob made by put_endpoints
+    query = "CREATE TABLE IF NOT EXISTS authentication_sessions "
+      "(nonce VARCHAR(255), uri VARCHAR(255), claimed_id VARCHAR(255), local_id VARCHAR(255), normalized_id VARCHAR(255), expires_on INT, fallbacks BLOB)";
+    rc = sqlite3_exec(db, query.c_str(), 0, 0, 0);
+    if(!test_sqlite_return(db, rc, "problem creating sessions table if it didn't exist already"))
+      return false;
+    if(!has_column("authentication_sessions", "fallbacks")) {
+      rc = sqlite3_exec(db, "ALTER TABLE authentication_sessions ADD COLUMN fallbacks BLOB", 0, 0, 0);
+      if(!test_sqlite_return(db, rc, "problem adding fallbacks column to authentication_sessions table"))
+        return false;
+    }
+
+    query = "CREATE TABLE IF NOT EXISTS associations "
+      "(server VARCHAR(255), handle VARCHAR(100), encryption_type VARCHAR(50), secret VARCHAR(30), expires_on INT)";
+    rc = sqlite3_exec(db, query.c_str(), 0, 0, 0);
+    if(!test_sqlite_return(db, rc, "problem creating associations table if it didn't exist already"))
+      return false;
+
+    query = "CREATE TABLE IF NOT EXISTS response_nonces "
+      "(server VARCHAR(255), response_nonce VARCHAR(100), expires_on INT)";
+    rc = sqlite3_exec(db, query.c_str(), 0, 0, 0);
+    if(!test_sqlite_return(db, rc, "problem creating response_nonces table if it didn't exist already"))
+      return false;
+
+    rc = sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS response_nonce_index ON response_nonces (response_nonce)", 0, 0, 0);
+    if(!test_sqlite_return(db, rc, "problem creating index if it didn't exist already"))
+      return false;
+
+    query = "CREATE TABLE IF NOT EXISTS op_capabilities "
+      "(server VARCHAR(255) PRIMARY KEY, assoc_type VARCHAR(50), session_type VARCHAR(50), stateless INT, expires_on INT)";
+    rc = sqlite3_exec(db, query.c_str(), 0, 0, 0);
+    if(!test_sqlite_return(db, rc, "problem creating op_capabilities table if it didn't exist already"))
+      return false;
+
+    rc = sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS maintenance (task VARCHAR(25) PRIMARY KEY, last_run INT)", 0, 0, 0);
+    return test_sqlite_return(db, rc, "problem creating maintenance table if it didn't exist already");
+  };
+
+  bool SqliteStorage::has_column(const string& table, const string& column) {
+    sqlite3_stmt *st = NULL;
+    string query = "PRAGMA table_info(" + table + ")";
+    if(sqlite3_prepare_v2(db, query.c_str(), -1, &st, NULL) != SQLITE_OK) {
+      sqlite3_finalize(st);
+      return false;
+    }
+    bool found = false;
+    // each row describes a column - the second field is its name
+    while(!found && sqlite3_step(st) == SQLITE_ROW) {
+      const char *name = (const char *) sqlite3_column_text(st, 1);
+      found = (name != NULL && column == name);
+    }
+    sqlite3_finalize(st);
+    return found;
+  };
+
+  bool SqliteStorage::test_result(int result, const string& context) {
+    if(result != SQLITE_OK){
+      string msg = "SQLite Error - " + context + ": %s\n";
+      fprintf(stderr, msg.c_str(), sqlite3_errmsg(db));
+      has_failed = true;
+      return false;
+    }
+    return true;
+  };
+
+  sqlite3_stmt *SqliteStorage::prepare(const char *sql) {
+    map<string, sqlite3_stmt *>::iterator it = statements.find(sql);
+    if(it != statements.end())
+      return it->second;
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if(!test_result(rc, "problem preparing statement \"" + string(sql) + "\"")) {
+      sqlite3_finalize(stmt);
+      return NULL;
+    }
+    statements[sql] = stmt;
+    return stmt;
+  };
+
+  bool SqliteStorage::get_session(const string& session_id, session_t& session) {
+    Statement st(this, "SELECT hostname,path,identity,expires_on,env_vars FROM sessions WHERE session_id=? AND expires_on>=?");
+    st.bind(1, session_id);
+    st.bind(2, (sqlite3_int64) time(0));
+    int rc = st.step();
+    if(rc != SQLITE_ROW) {
+      test_result((rc == SQLITE_DONE) ? SQLITE_OK : rc, "problem fetching session with id " + session_id);
+      return false;
+    }
+    if(!unserialize_env_vars(st.column_blob(4), session.env_vars)) {
+      print_to_error_log("could not read env_vars for session " + session_id + " - ignoring the session");
+      return false;
+    }
+    session.session_id = session_id;
+    session.hostname = st.column_string(0);
+    session.path = st.column_string(1);
+    session.identity = st.column_string(2);
+    session.expires_on = st.column_int(3);
+    return true;
+  };
+
+  void SqliteStorage::store_session(const session_t& session) {
+    string env_vars;
+    serialize_env_vars(session.env_vars, env_vars);
+    Statement st(this, "INSERT OR REPLACE INTO sessions (session_id,hostname,path,identity,expires_on,env_vars) VALUES(?,?,?,?,?,?)");
+    st.bind(1, session.session_id);
+    st.bind(2, session.hostname);
+    st.bind(3, session.path);
+    st.bind(4, session.identity);
+    st.bind(5, (sqlite3_int64) session.expires_on);
+    st.bind_blob(6, env_vars);
+    test_result(st.exec(), "problem inserting session into db");
+  };
+
+  void SqliteStorage::store_assoc(const assoc_record_t& assoc) {
+    Statement st(this, "INSERT INTO associations (server, handle, secret, expires_on, encryption_type) VALUES(?,?,?,?,?)");
+    st.bind(1, assoc.server);
+    st.bind(2, assoc.handle);
+    st.bind(3, util::encode_base64(&(assoc.secret.front()), assoc.secret.size()));
+    st.bind(4, (sqlite3_int64) assoc.expires_on);
+    st.bind(5, assoc.type);
+    test_result(st.exec(), "problem storing association in associations table");
+  };
+
+  void SqliteStorage::row_to_assoc(const Statement& st, assoc_record_t& assoc) {
+    // resulting row has columns: 
+    // server  handle  secret  expires_on  encryption_type
+    // 0       1       2       3           4
+    assoc.server = st.column_string(0);
+    assoc.handle = st.column_string(1);
+    assoc.secret.clear();
+    util::decode_base64(st.column_string(2), assoc.secret);
+    assoc.expires_on = st.column_int(3);
+    assoc.type = st.column_string(4);
+  };
+
+  bool SqliteStorage::get_assoc(const string& server, const string& handle, assoc_record_t& assoc) {
+    Statement st(this, "SELECT server,handle,secret,expires_on,encryption_type FROM associations WHERE server=? AND handle=? AND expires_on>=? LIMIT 1");
+    st.bind(1, server);
+    st.bind(2, handle);
+    st.bind(3, (sqlite3_int64) time(0));
+    int rc = st.step();
+    if(rc != SQLITE_ROW) {
+      test_result((rc == SQLITE_DONE) ? SQLITE_OK : rc, "problem fetching association");
+      return false;
+    }
+    row_to_assoc(st, assoc);
+    return true;
+  };
+
+  bool SqliteStorage::find_assoc(const string& server, assoc_record_t& assoc) {
+    Statement st(this, "SELECT server,handle,secret,expires_on,encryption_type FROM associations WHERE server=? AND expires_on>=? ORDER BY expires_on DESC LIMIT 1");
+    st.bind(1, server);
+    st.bind(2, (sqlite3_int64) time(0));
+    int rc = st.step();
+    if(rc != SQLITE_ROW) {
+      test_result((rc == SQLITE_DONE) ? SQLITE_OK : rc, "problem fetching association");
+      return false;
+    }
+    row_to_assoc(st, assoc);
+    return true;
+  };
+
+  void SqliteStorage::remove_assoc(const string& server, const string& handle) {
+    Statement st(this, "DELETE FROM associations WHERE server=? AND handle=?");
+    st.bind(1, server);
+    st.bind(2, handle);
+    test_result(st.exec(), "problem invalidating assocation for server \"" + server + "\" and handle \"" + handle + "\"");
+  };
+
+  bool SqliteStorage::get_capabilities(const string& server, op_capabilities_t& caps) {
+    Statement st(this, "SELECT assoc_type,session_type,stateless,expires_on FROM op_capabilities WHERE server=? AND expires_on>=?");
+    st.bind(1, server);
+    st.bind(2, (sqlite3_int64) time(0));
+    int rc = st.step();
+    if(rc != SQLITE_ROW) {
+      test_result((rc == SQLITE_DONE) ? SQLITE_OK : rc, "problem fetching capabilities of " + server);
+      return false;
+    }
+    caps.server = server;
+    caps.assoc_type = st.column_string(0);
+    caps.session_type = st.column_string(1);
+    caps.stateless = (st.column_int(2) != 0);
+    caps.expires_on = st.column_int(3);
+    return true;
+  };
+
+  void SqliteStorage::store_capabilities(const op_capabilities_t& caps) {
+    Statement st(this, "INSERT OR REPLACE INTO op_capabilities (server,assoc_type,session_type,stateless,expires_on) VALUES(?,?,?,?,?)");
+    st.bind(1, caps.server);
+    st.bind(2, caps.assoc_type);
+    st.bind(3, caps.session_type);
+    st.bind(4, (sqlite3_int64) (caps.stateless ? 1 : 0));
+    st.bind(5, (sqlite3_int64) caps.expires_on);
+    test_result(st.exec(), "problem storing capabilities of " + caps.server);
+  };
+
+  void SqliteStorage::store_auth_session(const auth_session_t& auth_session) {
+    remove_auth_session(auth_session.nonce);
+    if(has_failed)
+      return;
+    string fallbacks;
+    put_endpoints(fallbacks, auth_session.fallbacks);
+    Statement st(this, "INSERT INTO authentication_sessions (nonce,uri,claimed_id,local_id,normalized_id,expires_on,fallbacks) VALUES(?,?,?,?,?,?,?)");
+    st.bind(1, auth_session.nonce);
+    st.bind(2, auth_session.endpoint.uri);
+    st.bind(3, auth_session.endpoint.claimed_id);
+    st.bind(4, auth_session.endpoint.local_id);
+    st.bind(5, auth_session.normalized_id);
+    st.bind(6, (sqlite3_int64) auth_session.expires_on);
+    st.bind_blob(7, fallbacks);
+    test_result(st.exec(), "problem queuing endpoint");
+  };
+
+  bool SqliteStorage::get_auth_session(const string& nonce, auth_session_t& auth_session) {
+    Statement st(this, "SELECT uri,claimed_id,local_id,normalized_id,expires_on,fallbacks FROM authentication_sessions WHERE nonce=? AND expires_on>=? LIMIT 1");
+    st.bind(1, nonce);
+    st.bind(2, (sqlite3_int64) time(0));
+    int rc = st.step();
+    if(rc != SQLITE_ROW) {
+      test_result((rc == SQLITE_DONE) ? SQLITE_OK : rc, "problem fetching authentication session");
+      return false;
+    }
+    auth_session.nonce = nonce;
+    auth_session.endpoint.uri = st.column_string(0);
+    auth_session.endpoint.claimed_id = st.column_string(1);
+    auth_session.endpoint.local_id = st.column_string(2);
+    auth_session.normalized_id = st.column_string(3);
+    auth_session.expires_on = st.column_int(4);
+    string fallbacks = st.column_blob(5);
+    string::size_type pos = 0;
+    if(!get_endpoints(fallbacks, pos, auth_session.fallbacks)) {
+      print_to_error_log("could not read fallback endpoints for authentication session " + nonce + " - ignoring them");
+      auth_session.fallbacks.clear();
+    }
+    return true;
+  };
+
+  void SqliteStorage::remove_auth_session(const string& nonce) {
+    Statement st(this, "DELETE FROM authentication_sessions WHERE nonce=?");
+    st.bind(1, nonce);
+    test_result(st.exec(), "problem deleting authentication session");
+  };
+
+  bool SqliteStorage::add_nonce(const string& server, const string& nonce, time_t expires_on) {
+    {
+      Statement st(this, "SELECT response_nonce FROM response_nonces WHERE server=? AND response_nonce=? AND expires_on>=?");
+      st.bind(1, server);
+      st.bind(2, nonce);
+      st.bind(3, (sqlite3_int64) time(0));
+      int rc = st.step();
+      if(rc == SQLITE_ROW)
+        return false;
+      if(!test_result((rc == SQLITE_DONE) ? SQLITE_OK : rc, "problem looking up nonce"))
+        return false;
+    }
+
+    Statement st(this, "INSERT INTO response_nonces (server,response_nonce,expires_on) VALUES(?,?,?)");
+    st.bind(1, server);
+    st.bind(2, nonce);
+    st.bind(3, (sqlite3_int64) expires_on);
+    return test_result(st.exec(), "problem adding new nonce to resposne_nonces table");
+  };
+
+  void SqliteStorage::ween_expired(int batch_size) {
+    const char *queries[] = {
+      "DELETE FROM sessions WHERE rowid IN (SELECT rowid FROM sessions WHERE ? > expires_on LIMIT ?)",
+      "DELETE FROM associations WHERE rowid IN (SELECT rowid FROM associations WHERE ? > expires_on LIMIT ?)",
+      "DELETE FROM authentication_sessions WHERE rowid IN (SELECT rowid FROM authentication_sessions WHERE ? > expires_on LIMIT ?)",
+      "DELETE FROM response_nonces WHERE rowid IN (SELECT rowid FROM response_nonces WHERE ? > expires_on LIMIT ?)",
+      "DELETE FROM op_capabilities WHERE rowid IN (SELECT rowid FROM op_capabilities WHERE ? > expires_on LIMIT ?)",
+      NULL
+    };
+    time_t rawtime;
+    time (&rawtime);
+    for(int i = 0; queries[i] != NULL; i++) {
+      Statement st(this, queries[i]);
+      st.bind(1, (sqlite3_int64) rawtime);
+      st.bind(2, (sqlite3_int64) batch_size);
+      if(!test_result(st.exec(), "problem weening expired entries"))
+        return;
+    }
+  };
+
+  bool SqliteStorage::claim_task(const string& task, time_t now, int interval) {
+    {
+      Statement st(this, "INSERT OR IGNORE INTO maintenance (task,last_run) VALUES(?,0)");
+      st.bind(1, task);
+      if(!test_result(st.exec(), "problem creating " + task + " entry in maintenance table"))
+        return false;
+    }
+    Statement st(this, "UPDATE maintenance SET last_run=? WHERE task=? AND last_run<=?");
+    st.bind(1, (sqlite3_int64) now);
+    st.bind(2, task);
+    st.bind(3, (sqlite3_int64) (now - interval));
+    int rc = st.exec();
+    if(rc == SQLITE_BUSY) // another child is busy with the database - let it have this run
+      return false;
+    return test_result(rc, "problem claiming " + task + " run") && st.changes() == 1;
+  };
+
+  // This is a method to be used by a utility program, never the apache module
+  void SqliteStorage::print() {
+    print_sqlite_table(db, "sessions");
+    print_sqlite_table(db, "authentication_sessions");
+    print_sqlite_table(db, "response_nonces");
+    print_sqlite_table(db, "associations");
+    print_sqlite_table(db, "op_capabilities");
+  };
+
+  Statement::Statement(SqliteStorage *storage, const char *sql) {
+    db = (storage == NULL) ? NULL : storage->handle();
+    stmt = (storage == NULL) ? NULL : storage->prepare(sql);
+  };
+
+  Statement::~Statement() {
+    if(stmt == NULL)
+      return;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+  };
+
+  void Statement::bind(int index, const string& value) {
+    if(stmt != NULL)
+      sqlite3_bind_text(stmt, index, value.data(), value.size(), SQLITE_TRANSIENT);
+  };
+
+  void Statement::bind(int index, sqlite3_int64 value) {
+    if(stmt != NULL)
+      sqlite3_bind_int64(stmt, index, value);
+  };
+
+  void Statement::bind_blob(int index, const string& value) {
+    if(stmt != NULL)
+      sqlite3_bind_blob(stmt, index, value.data(), value.size(), SQLITE_TRANSIENT);
+  };
+
+  int Statement::step() {
+    if(stmt == NULL)
+      return SQLITE_MISUSE;
+    return sqlite3_step(stmt);
+  };
+
+  int Statement::exec() {
+    int rc;
+    while((rc = step()) == SQLITE_ROW);
+    return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+  };
+
+  string Statement::column_string(int index) const {
+    const unsigned char *value = sqlite3_column_text(stmt, index);
+    if(value == NULL)
+      return "";
+    return string((const char *) value, sqlite3_column_bytes(stmt, index));
+  };
+
+  sqlite3_int64 Statement::column_int(int index) const {
+    return sqlite3_column_int64(stmt, index);
+  };
+
+  string Statement::column_blob(int index) const {
+    const void *value = sqlite3_column_blob(stmt, index);
+    if(value == NULL)
+      return "";
+    return string((const char *) value, sqlite3_column_bytes(stmt, index));
+  };
+
+  int Statement::changes() const {
+    return (db == NULL) ? 0 : sqlite3_changes(db);
+  };
+}
+
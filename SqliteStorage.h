@@ -0,0 +1,124 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace opkele;
+  using namespace std;
+
+  class SqliteStorage;
+
+  // A statement from the SqliteStorage's statement cache.  The sql is only parsed the first
+  // time it's used on a connection; after that the cached statement is reset and reused.
+  // Bindings are cleared and the statement is reset when the Statement goes out of scope,
+  // so no read locks are held on pooled connections.
+  class Statement {
+  public:
+    Statement(SqliteStorage *storage, const char *sql);
+    ~Statement();
+
+    // false if the statement couldn't be prepared
+    bool ok() const { return stmt != NULL; };
+
+    // bind parameters - indexes start at 1
+    void bind(int index, const string& value);
+    void bind(int index, sqlite3_int64 value);
+    void bind_blob(int index, const string& value);
+
+    // step once - returns SQLITE_ROW, SQLITE_DONE, or an error code
+    int step();
+
+    // run until done - returns SQLITE_OK on success, or an error code
+    int exec();
+
+    // column values of the current row - indexes start at 0, NULL comes back as "" / 0
+    string column_string(int index) const;
+    sqlite3_int64 column_int(int index) const;
+    string column_blob(int index) const;
+
+    // number of rows changed by the last exec()
+    int changes() const;
+  private:
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+  };
+
+  // Storage in an SQLite database (the default backend).  Each instance is one connection;
+  // tables are created when the connection is opened.
+  class SqliteStorage : public Storage {
+  public:
+    // open a connection to the database at location and make sure all tables exist - NULL if
+    // the database can't be opened
+    static SqliteStorage *open(const string& location);
+
+    // finalizes all cached statements and closes the connection
+    virtual ~SqliteStorage();
+
+    virtual bool get_session(const string& session_id, session_t& session);
+    virtual void store_session(const session_t& session);
+    virtual void store_assoc(const assoc_record_t& assoc);
+    virtual bool get_assoc(const string& server, const string& handle, assoc_record_t& assoc);
+    virtual bool find_assoc(const string& server, assoc_record_t& assoc);
+    virtual void remove_assoc(const string& server, const string& handle);
+    virtual bool get_capabilities(const string& server, op_capabilities_t& caps);
+    virtual void store_capabilities(const op_capabilities_t& caps);
+    virtual void store_auth_session(const auth_session_t& auth_session);
+    virtual bool get_auth_session(const string& nonce, auth_session_t& auth_session);
+    virtual void remove_auth_session(const string& nonce);
+    virtual bool add_nonce(const string& server, const string& nonce, time_t expires_on);
+    virtual void ween_expired(int batch_size);
+    virtual bool claim_task(const string& task, time_t now, int interval);
+    virtual void print();
+
+    // get the cached statement for sql, preparing it if this is the first time it's used on
+    // this connection.  Returns NULL if the statement can't be prepared.
+    sqlite3_stmt *prepare(const char *sql);
+
+    sqlite3 *handle() const { return db; };
+
+  private:
+    SqliteStorage(sqlite3 *_db);
+
+    // create all tables if they don't exist yet, and bring tables made by older versions up to date
+    bool create_tables();
+
+    // true if table has a column called column
+    bool has_column(const string& table, const string& column);
+
+    // test result from sqlite query - print error to stderr and set failed() if there is one
+    bool test_result(int result, const string& context);
+
+    // read an association from the current row of an associations query
+    static void row_to_assoc(const Statement& st, assoc_record_t& assoc);
+
+    sqlite3 *db;
+
+    // statements prepared on this connection, keyed by their sql
+    map<string, sqlite3_stmt *> statements;
+  };
+}
+
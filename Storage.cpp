@@ -0,0 +1,75 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include "mod_auth_openid.h"
+
+namespace modauthopenid {
+  using namespace std;
+
+  void Storage::init(apr_pool_t *p) {
+#ifdef HAVE_LMDB
+    LmdbStorage::init(p);
+#endif
+  };
+
+  Storage *Storage::create(const string& type, const string& location) {
+    Storage *storage = NULL;
+    if(type == "sqlite")
+      storage = SqliteStorage::open(location);
+    else if(type == "redis")
+      storage = RedisStorage::open(location);
+#ifdef HAVE_LMDB
+    else if(type == "lmdb")
+      storage = LmdbStorage::open(location);
+#endif
+    else
+      print_to_error_log("unknown storage type \"" + type + "\"");
+    if(storage != NULL) {
+      storage->storage_type = type;
+      storage->storage_location = location;
+    }
+    return storage;
+  };
+
+  bool Storage::has_type(const string& type) {
+#ifdef HAVE_LMDB
+    if(type == "lmdb")
+      return true;
+#endif
+    return type == "sqlite" || type == "redis";
+  };
+
+  string Storage::type_names() {
+#ifdef HAVE_LMDB
+    return "sqlite, redis, lmdb";
+#else
+    return "sqlite, redis";
+#endif
+  };
+}
+
@@ -0,0 +1,151 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+namespace modauthopenid {
+  using namespace opkele;
+  using namespace std;
+
+  // An association as it's kept in storage
+  typedef struct assoc_record {
+    string server;
+    string handle;
+    string type;
+    secret_t secret;
+    time_t expires_on;
+  } assoc_record_t;
+
+  // An authentication session (a login that has been started but hasn't come back from the
+  // OP yet) as it's kept in storage
+  typedef struct auth_session {
+    string nonce;
+    openid_endpoint_t endpoint;              // the endpoint the user was sent to
+    vector<openid_endpoint_t> fallbacks;     // the endpoints to try after it, in order
+    string normalized_id;
+    time_t expires_on;
+  } auth_session_t;
+
+  // What associating with an OP showed it supports, so later associations can go straight to
+  // what works
+  typedef struct op_capabilities {
+    string server;
+    string assoc_type;    // the association type the OP accepted ("" if stateless)
+    string session_type;  // the session type the OP accepted ("" if stateless)
+    bool stateless;       // true if the OP wouldn't associate at all
+    time_t expires_on;    // when to find out again
+  } op_capabilities_t;
+
+  // Everything the module keeps between requests: sessions, associations, authentication
+  // sessions and response nonces.  Each backend (selected per location with AuthOpenIDStorage)
+  // implements this interface; SessionManager and MoidConsumer only ever talk to a Storage.
+  // Instances are handed out by the ConnectionPool and are only used by one thread at a time.
+  // Lookups never return expired entries.  Errors are logged by the backend and set failed(),
+  // after which the instance isn't pooled again.
+  class Storage {
+  public:
+    virtual ~Storage() {};
+
+    // set up anything backends share within a child process (called from the child_init hook,
+    // before the ConnectionPool is set up so that it's torn down after the pool)
+    static void init(apr_pool_t *p);
+
+    // make a new instance of the backend called type for location - NULL if there's no such
+    // backend or location can't be opened
+    static Storage *create(const string& type, const string& location);
+
+    // true if there's a backend called type
+    static bool has_type(const string& type);
+
+    // a comma separated list of the available backends (for error messages)
+    static string type_names();
+
+    // true if there was an error using this instance
+    bool failed() const { return has_failed; };
+
+    // true if other web servers may use the same storage, so that something only kept in this
+    // server's shared memory (like a response nonce in the ReplayCache) isn't enough
+    virtual bool shared() const { return false; };
+
+    // the backend name and location this instance was created for
+    const string& type() const { return storage_type; };
+    const string& location() const { return storage_location; };
+
+    // get the session with id session_id - false if there isn't one
+    virtual bool get_session(const string& session_id, session_t& session) = 0;
+
+    // store a session (replacing any session with the same id)
+    virtual void store_session(const session_t& session) = 0;
+
+    // store an association
+    virtual void store_assoc(const assoc_record_t& assoc) = 0;
+
+    // get the association for server and handle - false if there isn't one
+    virtual bool get_assoc(const string& server, const string& handle, assoc_record_t& assoc) = 0;
+
+    // get the association for server that expires last - false if there isn't one
+    virtual bool find_assoc(const string& server, assoc_record_t& assoc) = 0;
+
+    // delete the association for server and handle
+    virtual void remove_assoc(const string& server, const string& handle) = 0;
+
+    // get what server is known to support - false if nothing is known
+    virtual bool get_capabilities(const string& server, op_capabilities_t& caps) = 0;
+
+    // store what an OP supports (replacing anything known about it)
+    virtual void store_capabilities(const op_capabilities_t& caps) = 0;
+
+    // store an authentication session (replacing any with the same nonce)
+    virtual void store_auth_session(const auth_session_t& auth_session) = 0;
+
+    // get the authentication session for nonce - false if there isn't one
+    virtual bool get_auth_session(const string& nonce, auth_session_t& auth_session) = 0;
+
+    // delete the authentication session for nonce
+    virtual void remove_auth_session(const string& nonce) = 0;
+
+    // remember a response nonce from server until expires_on - returns false if it was already
+    // there (or if there was an error - check failed())
+    virtual bool add_nonce(const string& server, const string& nonce, time_t expires_on) = 0;
+
+    // delete at most batch_size expired entries of each kind (all of them if batch_size is
+    // negative).  Backends that expire entries on their own can do nothing.
+    virtual void ween_expired(int batch_size) = 0;
+
+    // claim the maintenance task called task for this interval: returns true if it hasn't been
+    // run (by any child) in the last interval seconds, and marks it as run at now
+    virtual bool claim_task(const string& task, time_t now, int interval) = 0;
+
+    // print everything to stdout (for db_info)
+    virtual void print() = 0;
+
+  protected:
+    Storage() : has_failed(false) {};
+    bool has_failed;
+    string storage_type, storage_location;
+  };
+}
+
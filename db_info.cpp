@@ -33,26 +33,32 @@ Created by bmuller <bmuller@butterfat.net>
 using namespace std;
 using namespace modauthopenid;
 
-void print_databases(string db_location) {
+void print_databases(string storage_type, string db_location) {
   cout << "Current time: " << time(0) << endl;
-  SessionManager s(db_location);
-  s.print_table();
-  s.close();
-
-  MoidConsumer c(db_location, "blah", "balh");
-  c.print_tables();
-  c.close();
+  Storage *storage = Storage::create(storage_type, db_location);
+  if(storage == NULL)
+    return;
+  storage->ween_expired(-1);
+  storage->print();
+  delete storage;
 };
 
 int main(int argc, char **argv) { 
-  if(argc != 2) {
-    cout << "usage: ./" << argv[0] << " <sqlite database location>";
+  if(argc != 2 && argc != 3) {
+    cout << "usage: ./" << argv[0] << " <database location> [storage type (" << Storage::type_names() << ") - default is sqlite]";
+    return -1;
+  }
+  string storage_type = (argc == 3) ? argv[2] : "sqlite";
+  if(!Storage::has_type(storage_type)) {
+    cout << "Unknown storage type \"" << storage_type << "\" - available types are " << Storage::type_names() << "\n";
     return -1;
   }
-  if(access(argv[1], 0) == -1) {
+  if(storage_type != "redis" && access(argv[1], 0) == -1) {
     cout << "File \"" << argv[1] << "\" does not exist or cannot be read.\n";
     return -1;
   }
-  print_databases(string(argv[1]));
+  apr_initialize();
+  print_databases(storage_type, string(argv[1]));
+  apr_terminate();
   return 0; 
 }
@@ -86,16 +86,12 @@ namespace modauthopenid {
     }
   };
 
-  int show_html_input(request_rec *r, string msg) {
-    opkele::params_t params;
-    if(r->args != NULL)
-      params = parse_query_string(string(r->args));
-    string identity = params.has_param("openid_identifier") ? params.get_param("openid_identifier") : "";
-    remove_openid_vars(params);
-    map<string,string>::iterator iter;
+  int show_html_input(request_rec *r, string msg, const split_params_t& query) {
+    string identity = query.openid.has_param("openid_identifier") ? query.openid.get_param("openid_identifier") : "";
+    map<string,string>::const_iterator iter;
     string args = "";
     string key, value;
-    for(iter = params.begin(); iter != params.end(); iter++) {
+    for(iter = query.other.begin(); iter != query.other.end(); iter++) {
       key = html_escape(iter->first);
       value = html_escape(iter->second);
       args += "<input type=\"hidden\" name=\"" + key + "\" value = \"" + value + "\" />";
@@ -127,25 +123,44 @@ namespace modauthopenid {
     return http_sendstring(r, result);
   };
 
-  void get_session_id(request_rec *r, string cookie_name, string& session_id) {
-    const char * cookies_c = apr_table_get(r->headers_in, "Cookie");
-    if(cookies_c == NULL)
+  static bool is_cookie_space(char c) {
+    return c == ' ' || c == '\t';
+  };
+
+  void get_session_id(request_rec *r, const string& cookie_name, string& session_id) {
+    const char *p = apr_table_get(r->headers_in, "Cookie");
+    if(p == NULL)
       return;
-    string cookies(cookies_c);
-    vector<string> pairs = explode(cookies, ";");
-    for(string::size_type i = 0; i < pairs.size(); i++) {
-      vector<string> pair = explode(pairs[i], "=");
-      if(pair.size() == 2) {
-	string key = pair[0];
-	strip(key);
-	string value = pair[1];
-	strip(value);
-	debug("cookie sent by client: \""+key+"\"=\""+value+"\"");
-	if(key == cookie_name) {
-	  session_id = pair[1];
-	  return;
-	}
+    // name=value pairs separated by ';' - the value runs up to the next ';', so it may contain '='
+    while(*p != '\0') {
+      while(*p == ';' || is_cookie_space(*p))
+        p++;
+      const char *name = p;
+      while(*p != '\0' && *p != ';' && *p != '=')
+        p++;
+      const char *name_end = p;
+      while(name_end > name && is_cookie_space(name_end[-1]))
+        name_end--;
+      if(*p != '=')
+        continue;
+      const char *value = ++p;
+      while(*p != '\0' && *p != ';')
+        p++;
+      if((string::size_type) (name_end - name) != cookie_name.size() || cookie_name.compare(0, string::npos, name, name_end - name) != 0)
+        continue;
+
+      const char *value_end = p;
+      while(value < value_end && is_cookie_space(*value))
+        value++;
+      while(value_end > value && is_cookie_space(value_end[-1]))
+        value_end--;
+      // the value may be quoted
+      if(value_end - value >= 2 && *value == '"' && value_end[-1] == '"') {
+        value++;
+        value_end--;
       }
+      session_id.assign(value, value_end - value);
+      return;
     }
   };
 
@@ -176,31 +191,28 @@ namespace modauthopenid {
     return "";
   };
 
+  bool is_openid_param(const string& key) {
+    // openid. or modauthopenid. (for the nonce) or openid_identifier (the login)
+    return key.compare(0, 7, "openid.") == 0 || key.compare(0, 14, "modauthopenid.") == 0 || key == "openid_identifier";
+  };
+
   void remove_openid_vars(params_t& params) {
-    map<string,string>::iterator iter;
-    for(iter = params.begin(); iter != params.end(); iter++) {
-      string param_key(iter->first);
-      // if starts with openid. or modauthopenid. (for the nonce) or openid_identifier (the login) remove it
-      if((param_key.substr(0, 7) == "openid." || param_key.substr(0, 14) == "modauthopenid." || param_key == "openid_identifier")) {
-        params.erase(param_key);
-        // stupid map iterator screws up if we just continue the iteration... 
-	// so recursion to the rescue - we'll delete them one at a time    
-	remove_openid_vars(params);
-        return;
-      }
+    map<string,string>::iterator iter = params.begin();
+    while(iter != params.end()) {
+      if(is_openid_param(iter->first))
+        params.erase(iter++);
+      else
+        ++iter;
     }
   };
 
   // gets the params, which are prefixed with 'openid.' and removes the prefix
-  void get_openid_params(params_t& openidparams, params_t& params) {
-    map<string,string>::iterator iter;
+  void get_openid_params(params_t& openidparams, const params_t& params) {
+    map<string,string>::const_iterator iter;
     openidparams.reset_fields();
     for(iter = params.begin(); iter != params.end(); iter++) {
-      string param_key(iter->first);
-      vector<string> parts = explode(param_key, ".");
-      if(!strncmp(param_key.c_str(), "openid.", strlen("openid."))) {
-	openidparams[param_key.substr(strlen("openid."))] = params[param_key];
-      }
+      if(iter->first.compare(0, 7, "openid.") == 0)
+	openidparams[iter->first.substr(7)] = iter->second;
     }
   };
 
@@ -213,32 +225,93 @@ namespace modauthopenid {
     return s;
   };
 
+  static int hex_value(char c) {
+    if(c >= '0' && c <= '9')
+      return c - '0';
+    if(c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+  };
+
+  // url decode str from begin up to end into out.  Like curl_unescape (which this used to
+  // call), only %XX escapes are decoded, malformed ones are left alone, and the result stops
+  // at an escaped NUL.
+  static void url_decode_range(const string& str, string::size_type begin, string::size_type end, string& out) {
+    out.clear();
+    out.reserve(end - begin);
+    for(string::size_type i = begin; i < end; i++) {
+      char c = str[i];
+      if(c == '%' && end - i > 2) {
+        int high = hex_value(str[i + 1]);
+        int low = hex_value(str[i + 2]);
+        if(high >= 0 && low >= 0) {
+          c = (char) (high * 16 + low);
+          i += 2;
+          if(c == '\0')
+            return;
+        }
+      }
+      out += c;
+    }
+  };
+
   string url_decode(const string& str) {
-    char * t = curl_unescape(str.c_str(),str.length());
-    if(!t)
-      throw failed_conversion(OPKELE_CP_ "failed to curl_unescape()");
-    string rv(t);
-    curl_free(t);
+    string rv;
+    url_decode_range(str, 0, str.size(), rv);
     return rv;
   };
 
-  params_t parse_query_string(const string& str) {
-    params_t p;
-    if(str.size() == 0) return p;
-
-    vector<string> pairs = explode(str, "&");
-    for(unsigned int i=0; i < pairs.size(); i++) {
-      string::size_type loc = pairs[i].find( "=", 0 );
-      // if loc found and loc isn't last char in string 
-      if( loc != string::npos && loc != str.size()-1) {
-        string key = url_decode(pairs[i].substr(0, loc));
-        string value = url_decode(pairs[i].substr(loc+1));
-        p[key] = value;
+  // parse str, putting each parameter in the params chosen by pick
+  template <class Picker>
+  static void parse_pairs(const string& str, Picker pick) {
+    string key, value;
+    string::size_type start = 0, size = str.size();
+    // one pass over str, decoding each key and value straight out of it
+    while(start < size) {
+      string::size_type end = str.find('&', start);
+      if(end == string::npos)
+        end = size;
+      string::size_type eq = find(str.begin() + start, str.begin() + end, '=') - str.begin();
+      // pairs without an = are skipped, as is a string that's just one pair with an empty value
+      if(eq < end && eq - start != size - 1) {
+        url_decode_range(str, start, eq, key);
+        url_decode_range(str, eq + 1, end, value);
+        pick(key)[key].swap(value);
       }
+      start = end + 1;
     }
+  };
+
+  // puts every parameter in the same params
+  class pick_all {
+  public:
+    pick_all(params_t& _params) : params(_params) {};
+    params_t& operator()(const string& key) const { return params; };
+  private:
+    params_t& params;
+  };
+
+  // puts this module's parameters in split.openid and the rest in split.other
+  class pick_split {
+  public:
+    pick_split(split_params_t& _split) : split(_split) {};
+    params_t& operator()(const string& key) const { return is_openid_param(key) ? split.openid : split.other; };
+  private:
+    split_params_t& split;
+  };
+
+  params_t parse_query_string(const string& str) {
+    params_t p;
+    parse_pairs(str, pick_all(p));
     return p;
   };
 
+  void parse_query_string(const string& str, split_params_t& split) {
+    parse_pairs(str, pick_split(split));
+  };
+
   void make_cookie_value(string& cookie_value, const string& name, const string& session_id, const string& path, int cookie_lifespan) {
     if(cookie_lifespan == 0) {
       cookie_value = name + "=" + session_id + "; path=" + path;
@@ -264,7 +337,7 @@ namespace modauthopenid {
     apr_status_t ret;
     int seen_eos, child_stopped_reading;
     seen_eos = child_stopped_reading = 0; 
-    char *query_string = NULL;
+    qs = "";
 
     do { 
       ret = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES, APR_BLOCK_READ, 8192); 
@@ -288,28 +361,29 @@ namespace modauthopenid {
 	if(ret != APR_SUCCESS) {
 	  child_stopped_reading = 1;
 	} else {
-	  if (query_string == NULL) 
-	    query_string = apr_pstrdup(r->pool, data);
-	  else 
-	    query_string = apr_pstrcat(r->pool, query_string, data, NULL);
+	  qs.append(data, len);
 	}
       } 
       apr_brigade_cleanup(bb); 
     } while (!seen_eos); 
 
-    qs = (query_string == NULL) ? "" : string(query_string);
     return true; 
   };
 
-  // Get request parameters - whether POST or GET
-  void get_request_params(request_rec *r, params_t& params) {
+  RequestParams::RequestParams(request_rec *r) {
     string query;
-    if(r->method_number == M_GET && r->args != NULL) {
-      debug("Request GET params: " + string(r->args));
-      params = parse_query_string(string(r->args));
-    } else if(r->method_number == M_POST && get_post_data(r, query)) {
-      debug("Request POST params: " + query);
-      params = parse_query_string(query);
+    if(r->args != NULL)
+      parse_query_string(string(r->args), query_params);
+    if(r->method_number == M_GET) {
+      if(r->args != NULL)
+        debug("Request GET params: " + string(r->args));
+      request_params = &query_params;
+    } else {
+      if(r->method_number == M_POST && get_post_data(r, query)) {
+        debug("Request POST params: " + query);
+        parse_query_string(query, posted_params);
+      }
+      request_params = &posted_params;
     }
   };
   
@@ -35,12 +35,41 @@ namespace modauthopenid {
   //send Location header to given location
   int http_redirect(request_rec *r, string location);
 
-  // show login page with given message string
-  int show_html_input(request_rec *r, string msg);
+  // A set of parameters split into the ones this module uses (openid.*, modauthopenid.* and
+  // openid_identifier) and the rest
+  typedef struct split_params {
+    params_t openid;
+    params_t other;
+  } split_params_t;
+
+  // The parameters of a request, parsed once (and split) when the request is first handled,
+  // and kept in the request config for everything else that needs them
+  class RequestParams {
+  public:
+    // parse r's query string and, for a POST, its body
+    RequestParams(request_rec *r);
+
+    // the parameters in the query string
+    const split_params_t& query() const { return query_params; };
+
+    // the parameters of the request - the query string's for a GET, the body's for a POST
+    // (none for anything else)
+    const split_params_t& request() const { return *request_params; };
+  private:
+    // not copyable - request_params points into the object
+    RequestParams(const RequestParams&);
+    RequestParams& operator=(const RequestParams&);
+
+    split_params_t query_params, posted_params;
+    const split_params_t *request_params;
+  };
+
+  // show login page with given message string, keeping the query's (non openid) parameters
+  int show_html_input(request_rec *r, string msg, const split_params_t& query);
 
   // get session id from cookie, if it exists, and put in session_id string - return if no cookie
-  // with given name
-  void get_session_id(request_rec *r, string cookie_name, string& session_id);
+  // with given name.  Only scans the Cookie header as far as the first cookie with that name.
+  void get_session_id(request_rec *r, const string& cookie_name, string& session_id);
 
   // get the base location of the url (everything up to the last '/')
   void base_dir(string path, string& s);
@@ -48,6 +77,9 @@ namespace modauthopenid {
   // return a url without the query string
   string get_queryless_url(string url);
 
+  // true if key is one of this module's parameters (openid.*, modauthopenid.* or openid_identifier)
+  bool is_openid_param(const string& key);
+
   // remove all openid.*, modauthopenid.* parameters (except sreg and ax params)
   void remove_openid_vars(params_t& params);
 
@@ -57,6 +89,9 @@ namespace modauthopenid {
   // create a params_t object from a query string
   params_t parse_query_string(const string& str);
 
+  // parse a query string straight into this module's parameters and the rest
+  void parse_query_string(const string& str, split_params_t& split);
+
   // url decode a string
   string url_decode(const string& str);
 
@@ -65,10 +100,7 @@ namespace modauthopenid {
 
   // Get the 'openid.' parameters from the parameter list, strip 'openid.'
   // and put them in openidparams
-  void get_openid_params(params_t &openidparams, params_t &params);
-
-  // Get request parameters - whether POST or GET
-  void get_request_params(request_rec *r, params_t& params);
+  void get_openid_params(params_t &openidparams, const params_t &params);
 
   // Get the post query string from a HTTP POST
   bool get_post_data(request_rec *r, string& query_string);
@@ -39,24 +39,60 @@ typedef std::map<std::string, modauthopenid_ax_t> modauthopenid_ax_map;
 
 void modauthopenid_ax_map_cleanup(void* ptr) { delete (modauthopenid_ax_map*)ptr ; }
 
+void modauthopenid_keyring_cleanup(void* ptr) { delete (modauthopenid::KeyRing*)ptr ; }
+
+void modauthopenid_provider_matcher_cleanup(void* ptr) { delete (modauthopenid::ProviderMatcher*)ptr ; }
+
+void modauthopenid_preassociator_cleanup(void* ptr) { delete (modauthopenid::Preassociator*)ptr ; }
+
+void modauthopenid_request_params_cleanup(void* ptr) { delete (modauthopenid::RequestParams*)ptr ; }
+
 
 typedef struct {
   const char *db_location;
+  const char *storage_type;
   char *trust_root;
   const char *cookie_name;
   char *login_page;
   bool enabled;
   bool use_cookie;
-  apr_array_header_t *trusted;
-  apr_array_header_t *distrusted;
+  modauthopenid::ProviderMatcher *trusted;
+  modauthopenid::ProviderMatcher *distrusted;
   int cookie_lifespan;
   char *server_name;
   char *auth_program;
   char *cookie_path;
   bool use_auth_program;
   modauthopenid_ax_map *attr;
+  bool stateless_sessions;
+  bool encrypt_sessions;
+  bool stateless_login;
+  modauthopenid::KeyRing *keys;
 } modauthopenid_config;
 
+// settings that apply to a whole child process rather than to a location - only read from the main server
+typedef struct {
+  int db_max_locations;
+  int db_max_idle;
+  int curl_max_idle;
+  int auth_program_instances;
+  int auth_program_timeout;
+  int decision_cache_size;
+  int decision_allow_ttl;
+  int decision_deny_ttl;
+  const char *decision_flush_file;
+  int reap_interval;
+  int reap_batch_size;
+  int session_cache_size;
+  int nonce_skew;
+  int nonce_cache_size;
+  int discovery_cache_size;
+  int discovery_ttl;
+  int discovery_negative_ttl;
+  int single_flight_timeout;
+  modauthopenid::Preassociator *preassociations;
+} modauthopenid_server_config;
+
 typedef const char *(*CMD_HAND_TYPE) ();
 
 // determine if a connection is using https - only took 1000 years to figure this one out
@@ -66,12 +102,15 @@ static void *create_modauthopenid_config(apr_pool_t *p, char *s) {
   modauthopenid_config *newcfg;
   newcfg = (modauthopenid_config *) apr_pcalloc(p, sizeof(modauthopenid_config));
   newcfg->db_location = "/tmp/mod_auth_openid.db";
+  newcfg->storage_type = "sqlite";
   newcfg->enabled = false;
   newcfg->use_cookie = true;
   newcfg->cookie_name = "open_id_session_id";
   newcfg->cookie_path = NULL; 
-  newcfg->trusted = apr_array_make(p, 5, sizeof(char *));
-  newcfg->distrusted = apr_array_make(p, 5, sizeof(char *));
+  newcfg->trusted = new modauthopenid::ProviderMatcher(p);
+  apr_pool_cleanup_register(p, (void*)newcfg->trusted, (apr_status_t(*)(void *))modauthopenid_provider_matcher_cleanup, apr_pool_cleanup_null) ;
+  newcfg->distrusted = new modauthopenid::ProviderMatcher(p);
+  apr_pool_cleanup_register(p, (void*)newcfg->distrusted, (apr_status_t(*)(void *))modauthopenid_provider_matcher_cleanup, apr_pool_cleanup_null) ;
   newcfg->trust_root = NULL;
   newcfg->cookie_lifespan = 0;
   newcfg->server_name = NULL;
@@ -79,6 +118,37 @@ static void *create_modauthopenid_config(apr_pool_t *p, char *s) {
   newcfg->use_auth_program = false;
   newcfg->attr = new modauthopenid_ax_map;
   apr_pool_cleanup_register(p, (void*)newcfg->attr, (apr_status_t(*)(void *))modauthopenid_ax_map_cleanup, apr_pool_cleanup_null) ;
+  newcfg->stateless_sessions = false;
+  newcfg->encrypt_sessions = false;
+  newcfg->stateless_login = false;
+  newcfg->keys = new modauthopenid::KeyRing;
+  apr_pool_cleanup_register(p, (void*)newcfg->keys, (apr_status_t(*)(void *))modauthopenid_keyring_cleanup, apr_pool_cleanup_null) ;
+  return (void *) newcfg;
+}
+
+static void *create_modauthopenid_server_config(apr_pool_t *p, server_rec *s) {
+  modauthopenid_server_config *newcfg;
+  newcfg = (modauthopenid_server_config *) apr_pcalloc(p, sizeof(modauthopenid_server_config));
+  newcfg->db_max_locations = 16;
+  newcfg->db_max_idle = 8;
+  newcfg->curl_max_idle = 8;
+  newcfg->auth_program_instances = 4;
+  newcfg->auth_program_timeout = 10;
+  newcfg->decision_cache_size = 1024;
+  newcfg->decision_allow_ttl = 0;
+  newcfg->decision_deny_ttl = 0;
+  newcfg->decision_flush_file = NULL;
+  newcfg->reap_interval = 300;
+  newcfg->reap_batch_size = 1000;
+  newcfg->session_cache_size = 1024;
+  newcfg->nonce_skew = DEFAULT_NONCE_SKEW;
+  newcfg->nonce_cache_size = 16384;
+  newcfg->discovery_cache_size = 1024;
+  newcfg->discovery_ttl = 3600;
+  newcfg->discovery_negative_ttl = 60;
+  newcfg->single_flight_timeout = 10;
+  newcfg->preassociations = new modauthopenid::Preassociator;
+  apr_pool_cleanup_register(p, (void*)newcfg->preassociations, (apr_status_t(*)(void *))modauthopenid_preassociator_cleanup, apr_pool_cleanup_null) ;
   return (void *) newcfg;
 }
 
@@ -88,6 +158,15 @@ static const char *set_modauthopenid_db_location(cmd_parms *parms, void *mconfig
   return NULL;
 }
 
+static const char *set_modauthopenid_storage(cmd_parms *parms, void *mconfig, const char *arg) {
+  modauthopenid_config *s_cfg = (modauthopenid_config *) mconfig;
+  if(!modauthopenid::Storage::has_type(std::string(arg)))
+    return apr_pstrcat(parms->pool, "AuthOpenIDStorage: unknown storage type \"", arg, "\" - available types are ", 
+		       modauthopenid::Storage::type_names().c_str(), NULL);
+  s_cfg->storage_type = arg;
+  return NULL;
+}
+
 static const char *set_modauthopenid_cookie_path(cmd_parms *parms, void *mconfig, const char *arg) { 
   modauthopenid_config *s_cfg = (modauthopenid_config *) mconfig; 
   s_cfg->cookie_path = (char *) arg; 
@@ -130,16 +209,24 @@ static const char *set_modauthopenid_cookie_lifespan(cmd_parms *parms, void *mco
   return NULL;
 }
 
+// add a pattern to a trusted/distrusted list - lists read from the server config are compiled
+// in post_config, lists in .htaccess files the first time they're used
+static const char *add_provider_pattern(cmd_parms *cmd, modauthopenid::ProviderMatcher *matcher, const char *arg) {
+  const char *err = matcher->add_pattern(arg);
+  // .htaccess files are read with the request pool as both pool and temp_pool
+  if(err == NULL && cmd->pool != cmd->temp_pool)
+    matcher->prepare_at_startup();
+  return err;
+}
+
 static const char *add_modauthopenid_trusted(cmd_parms *cmd, void *mconfig, const char *arg) {
   modauthopenid_config *s_cfg = (modauthopenid_config *) mconfig;
-  *(const char **)apr_array_push(s_cfg->trusted) = arg;
-  return NULL;
+  return add_provider_pattern(cmd, s_cfg->trusted, arg);
 }
 
 static const char *add_modauthopenid_distrusted(cmd_parms *cmd, void *mconfig, const char *arg) {
   modauthopenid_config *s_cfg = (modauthopenid_config *) mconfig;
-  *(const char **)apr_array_push(s_cfg->distrusted) = arg;
-  return NULL;
+  return add_provider_pattern(cmd, s_cfg->distrusted, arg);
 }
 
 static const char *set_modauthopenid_server_name(cmd_parms *parms, void *mconfig, const char *arg) {
@@ -155,6 +242,245 @@ static const char *set_modauthopenid_auth_program(cmd_parms *parms, void *mconfi
   return NULL;
 } 
 
+static const char *set_modauthopenid_stateless_sessions(cmd_parms *parms, void *mconfig, int flag) {
+  modauthopenid_config *s_cfg = (modauthopenid_config *) mconfig;
+  s_cfg->stateless_sessions = (bool) flag;
+  return NULL;
+}
+
+static const char *set_modauthopenid_encrypt_sessions(cmd_parms *parms, void *mconfig, int flag) {
+  modauthopenid_config *s_cfg = (modauthopenid_config *) mconfig;
+  s_cfg->encrypt_sessions = (bool) flag;
+  return NULL;
+}
+
+static const char *set_modauthopenid_stateless_login(cmd_parms *parms, void *mconfig, int flag) {
+  modauthopenid_config *s_cfg = (modauthopenid_config *) mconfig;
+  s_cfg->stateless_login = (bool) flag;
+  return NULL;
+}
+
+static const char *add_modauthopenid_session_key(cmd_parms *parms, void *mconfig, const char *id, const char *secret) {
+  modauthopenid_config *s_cfg = (modauthopenid_config *) mconfig;
+  std::string err = s_cfg->keys->add_key(std::string(id), std::string(secret));
+  if(!err.empty())
+    return apr_pstrcat(parms->pool, "AuthOpenIDSessionKey ", id, ": ", err.c_str(), NULL);
+  return NULL;
+}
+
+static const char *set_modauthopenid_db_max_locations(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->db_max_locations = atoi(arg);
+  if(s_cfg->db_max_locations < 1)
+    return "AuthOpenIDDBMaxOpen must be at least 1";
+  return NULL;
+}
+
+static const char *set_modauthopenid_db_max_idle(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->db_max_idle = atoi(arg);
+  if(s_cfg->db_max_idle < 1)
+    return "AuthOpenIDDBMaxIdle must be at least 1";
+  return NULL;
+}
+
+static const char *set_modauthopenid_curl_max_idle(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->curl_max_idle = atoi(arg);
+  if(s_cfg->curl_max_idle < 1)
+    return "AuthOpenIDCurlMaxIdle must be at least 1";
+  return NULL;
+}
+
+static const char *set_modauthopenid_auth_program_instances(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->auth_program_instances = atoi(arg);
+  if(s_cfg->auth_program_instances < 1)
+    return "AuthOpenIDUserProgramInstances must be at least 1";
+  return NULL;
+}
+
+static const char *set_modauthopenid_auth_program_timeout(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->auth_program_timeout = atoi(arg);
+  if(s_cfg->auth_program_timeout < 1)
+    return "AuthOpenIDUserProgramTimeout must be at least 1";
+  return NULL;
+}
+
+static const char *set_modauthopenid_decision_cache_size(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->decision_cache_size = atoi(arg);
+  if(s_cfg->decision_cache_size < 0)
+    return "AuthOpenIDUserProgramCacheSize must not be negative";
+  return NULL;
+}
+
+static const char *set_modauthopenid_decision_allow_ttl(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->decision_allow_ttl = atoi(arg);
+  if(s_cfg->decision_allow_ttl < 0)
+    return "AuthOpenIDUserProgramAllowTTL must not be negative";
+  return NULL;
+}
+
+static const char *set_modauthopenid_decision_deny_ttl(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->decision_deny_ttl = atoi(arg);
+  if(s_cfg->decision_deny_ttl < 0)
+    return "AuthOpenIDUserProgramDenyTTL must not be negative";
+  return NULL;
+}
+
+static const char *set_modauthopenid_decision_flush_file(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->decision_flush_file = arg;
+  return NULL;
+}
+
+static const char *set_modauthopenid_reap_interval(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->reap_interval = atoi(arg);
+  if(s_cfg->reap_interval < 0)
+    return "AuthOpenIDReapInterval must be 0 (off) or a number of seconds";
+  return NULL;
+}
+
+static const char *set_modauthopenid_reap_batch_size(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->reap_batch_size = atoi(arg);
+  if(s_cfg->reap_batch_size < 1)
+    return "AuthOpenIDReapBatchSize must be at least 1";
+  return NULL;
+}
+
+static const char *set_modauthopenid_session_cache_size(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->session_cache_size = atoi(arg);
+  if(s_cfg->session_cache_size < 0)
+    return "AuthOpenIDSessionCacheSize must be 0 (off) or a number of sessions";
+  return NULL;
+}
+
+static const char *set_modauthopenid_nonce_skew(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->nonce_skew = atoi(arg);
+  if(s_cfg->nonce_skew <= 0)
+    return "AuthOpenIDNonceSkew must be a positive number of seconds";
+  return NULL;
+}
+
+static const char *set_modauthopenid_nonce_cache_size(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->nonce_cache_size = atoi(arg);
+  if(s_cfg->nonce_cache_size < 0)
+    return "AuthOpenIDNonceCacheSize must be 0 (off) or a number of nonces";
+  return NULL;
+}
+
+static const char *set_modauthopenid_discovery_cache_size(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->discovery_cache_size = atoi(arg);
+  if(s_cfg->discovery_cache_size < 0)
+    return "AuthOpenIDDiscoveryCacheSize must be 0 (off) or a number of identifiers";
+  return NULL;
+}
+
+static const char *set_modauthopenid_discovery_ttl(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->discovery_ttl = atoi(arg);
+  if(s_cfg->discovery_ttl < 0)
+    return "AuthOpenIDDiscoveryTTL must be 0 (off) or a number of seconds";
+  return NULL;
+}
+
+static const char *set_modauthopenid_discovery_negative_ttl(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->discovery_negative_ttl = atoi(arg);
+  if(s_cfg->discovery_negative_ttl < 0)
+    return "AuthOpenIDDiscoveryNegativeTTL must be 0 (off) or a number of seconds";
+  return NULL;
+}
+
+static const char *set_modauthopenid_single_flight_timeout(cmd_parms *parms, void *mconfig, const char *arg) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  s_cfg->single_flight_timeout = atoi(arg);
+  if(s_cfg->single_flight_timeout < 0)
+    return "AuthOpenIDSingleFlightTimeout must be 0 (off) or a number of seconds";
+  return NULL;
+}
+
+static const char *set_modauthopenid_preassociate(cmd_parms *parms, void *mconfig, const char *server, const char *type, const char *location) {
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  if(err != NULL)
+    return err;
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(parms->server->module_config, &authopenid_module);
+  // without a store, use the same defaults as AuthOpenIDStorage and AuthOpenIDDBLocation
+  if(type == NULL)
+    type = "sqlite";
+  if(location == NULL)
+    location = "/tmp/mod_auth_openid.db";
+  if(!modauthopenid::Storage::has_type(std::string(type)))
+    return apr_pstrcat(parms->pool, "AuthOpenIDPreassociate: unknown storage type \"", type, "\" - available types are ", 
+		       modauthopenid::Storage::type_names().c_str(), NULL);
+  s_cfg->preassociations->add(std::string(type), std::string(location), std::string(server));
+  return NULL;
+}
+
 static const char *set_modauthopenid_attribute_exchange_add(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg2, const char *arg3) {
     modauthopenid_config *s_cfg = (modauthopenid_config *) mconfig;
     std::string alias = std::string(arg1);
@@ -177,6 +503,8 @@ static const char *set_modauthopenid_attribute_exchange_add(cmd_parms *parms, vo
 static const command_rec mod_authopenid_cmds[] = {
   AP_INIT_TAKE1("AuthOpenIDCookieLifespan", (CMD_HAND_TYPE) set_modauthopenid_cookie_lifespan, NULL, OR_AUTHCFG,
 		"AuthOpenIDCookieLifespan <number seconds>"),
+  AP_INIT_TAKE1("AuthOpenIDStorage", (CMD_HAND_TYPE) set_modauthopenid_storage, NULL, OR_AUTHCFG,
+		"AuthOpenIDStorage <where sessions, associations and nonces are kept - sqlite is the default>"),
   AP_INIT_TAKE1("AuthOpenIDDBLocation", (CMD_HAND_TYPE) set_modauthopenid_db_location, NULL, OR_AUTHCFG,
 		"AuthOpenIDDBLocation <string>"),
   AP_INIT_TAKE1("AuthOpenIDLoginPage", (CMD_HAND_TYPE) set_modauthopenid_login_page, NULL, OR_AUTHCFG,
@@ -198,13 +526,71 @@ static const command_rec mod_authopenid_cmds[] = {
   AP_INIT_TAKE1("AuthOpenIDServerName", (CMD_HAND_TYPE) set_modauthopenid_server_name, NULL, OR_AUTHCFG,
 		"AuthOpenIDServerName <server name and port prefix>"),
   AP_INIT_TAKE1("AuthOpenIDUserProgram", (CMD_HAND_TYPE) set_modauthopenid_auth_program, NULL, OR_AUTHCFG,
-		"AuthOpenIDUserProgram <full path to authentication program>"),
+		"AuthOpenIDUserProgram <full path to authentication program, prefixed with prg: to keep it running>"),
   AP_INIT_TAKE23("AuthOpenIDAXAdd", (CMD_HAND_TYPE) set_modauthopenid_attribute_exchange_add, NULL, OR_AUTHCFG,
 		 "AuthOpenIDAXAdd <alias> <uri> <required(default=true)>"),
+  AP_INIT_FLAG("AuthOpenIDStatelessSessions", (CMD_HAND_TYPE) set_modauthopenid_stateless_sessions, NULL, OR_AUTHCFG,
+	       "AuthOpenIDStatelessSessions <On | Off> - keep sessions in signed cookies instead of the db?"),
+  AP_INIT_FLAG("AuthOpenIDEncryptSessions", (CMD_HAND_TYPE) set_modauthopenid_encrypt_sessions, NULL, OR_AUTHCFG,
+	       "AuthOpenIDEncryptSessions <On | Off> - encrypt stateless session cookies?"),
+  AP_INIT_FLAG("AuthOpenIDStatelessLogin", (CMD_HAND_TYPE) set_modauthopenid_stateless_login, NULL, OR_AUTHCFG,
+	       "AuthOpenIDStatelessLogin <On | Off> - carry the login state in a signed return_to token instead of the db?"),
+  AP_INIT_TAKE2("AuthOpenIDSessionKey", (CMD_HAND_TYPE) add_modauthopenid_session_key, NULL, OR_AUTHCFG,
+		"AuthOpenIDSessionKey <key id> <secret> - the first key signs new cookies, all of them are accepted"),
+  AP_INIT_TAKE1("AuthOpenIDDBMaxOpen", (CMD_HAND_TYPE) set_modauthopenid_db_max_locations, NULL, RSRC_CONF,
+		"AuthOpenIDDBMaxOpen <number of databases each child keeps open>"),
+  AP_INIT_TAKE1("AuthOpenIDDBMaxIdle", (CMD_HAND_TYPE) set_modauthopenid_db_max_idle, NULL, RSRC_CONF,
+		"AuthOpenIDDBMaxIdle <number of idle connections kept per database>"),
+  AP_INIT_TAKE1("AuthOpenIDCurlMaxIdle", (CMD_HAND_TYPE) set_modauthopenid_curl_max_idle, NULL, RSRC_CONF,
+		"AuthOpenIDCurlMaxIdle <number of idle connections to OPs kept per child>"),
+  AP_INIT_TAKE1("AuthOpenIDUserProgramInstances", (CMD_HAND_TYPE) set_modauthopenid_auth_program_instances, NULL, RSRC_CONF,
+		"AuthOpenIDUserProgramInstances <max copies of each prg: authentication program running per child>"),
+  AP_INIT_TAKE1("AuthOpenIDUserProgramTimeout", (CMD_HAND_TYPE) set_modauthopenid_auth_program_timeout, NULL, RSRC_CONF,
+		"AuthOpenIDUserProgramTimeout <seconds to wait for the authentication program's answer>"),
+  AP_INIT_TAKE1("AuthOpenIDUserProgramCacheSize", (CMD_HAND_TYPE) set_modauthopenid_decision_cache_size, NULL, RSRC_CONF,
+		"AuthOpenIDUserProgramCacheSize <number of authentication program decisions kept in shared memory, 0 for none>"),
+  AP_INIT_TAKE1("AuthOpenIDUserProgramAllowTTL", (CMD_HAND_TYPE) set_modauthopenid_decision_allow_ttl, NULL, RSRC_CONF,
+		"AuthOpenIDUserProgramAllowTTL <seconds to remember that a user was authorized, 0 for not at all>"),
+  AP_INIT_TAKE1("AuthOpenIDUserProgramDenyTTL", (CMD_HAND_TYPE) set_modauthopenid_decision_deny_ttl, NULL, RSRC_CONF,
+		"AuthOpenIDUserProgramDenyTTL <seconds to remember that a user was refused, 0 for not at all>"),
+  AP_INIT_TAKE1("AuthOpenIDUserProgramFlushFile", (CMD_HAND_TYPE) set_modauthopenid_decision_flush_file, NULL, RSRC_CONF,
+		"AuthOpenIDUserProgramFlushFile <file to touch to forget all remembered decisions>"),
+  AP_INIT_TAKE1("AuthOpenIDReapInterval", (CMD_HAND_TYPE) set_modauthopenid_reap_interval, NULL, RSRC_CONF,
+		"AuthOpenIDReapInterval <seconds between removing expired entries, 0 for never>"),
+  AP_INIT_TAKE1("AuthOpenIDReapBatchSize", (CMD_HAND_TYPE) set_modauthopenid_reap_batch_size, NULL, RSRC_CONF,
+		"AuthOpenIDReapBatchSize <max number of expired entries removed from each table per run>"),
+  AP_INIT_TAKE1("AuthOpenIDSessionCacheSize", (CMD_HAND_TYPE) set_modauthopenid_session_cache_size, NULL, RSRC_CONF,
+		"AuthOpenIDSessionCacheSize <number of sessions kept in shared memory, 0 for none>"),
+  AP_INIT_TAKE1("AuthOpenIDNonceSkew", (CMD_HAND_TYPE) set_modauthopenid_nonce_skew, NULL, RSRC_CONF,
+		"AuthOpenIDNonceSkew <max seconds between a response nonce's time stamp and now>"),
+  AP_INIT_TAKE1("AuthOpenIDNonceCacheSize", (CMD_HAND_TYPE) set_modauthopenid_nonce_cache_size, NULL, RSRC_CONF,
+		"AuthOpenIDNonceCacheSize <number of response nonces kept in shared memory, 0 for none>"),
+  AP_INIT_TAKE1("AuthOpenIDDiscoveryCacheSize", (CMD_HAND_TYPE) set_modauthopenid_discovery_cache_size, NULL, RSRC_CONF,
+		"AuthOpenIDDiscoveryCacheSize <number of discovery results kept in shared memory, 0 for none>"),
+  AP_INIT_TAKE1("AuthOpenIDDiscoveryTTL", (CMD_HAND_TYPE) set_modauthopenid_discovery_ttl, NULL, RSRC_CONF,
+		"AuthOpenIDDiscoveryTTL <seconds a discovery result is kept, 0 for not at all>"),
+  AP_INIT_TAKE1("AuthOpenIDDiscoveryNegativeTTL", (CMD_HAND_TYPE) set_modauthopenid_discovery_negative_ttl, NULL, RSRC_CONF,
+		"AuthOpenIDDiscoveryNegativeTTL <seconds an identifier that couldn't be discovered is remembered, 0 for not at all>"),
+  AP_INIT_TAKE1("AuthOpenIDSingleFlightTimeout", (CMD_HAND_TYPE) set_modauthopenid_single_flight_timeout, NULL, RSRC_CONF,
+		"AuthOpenIDSingleFlightTimeout <max seconds to wait for another request's discovery or association, 0 to never wait>"),
+  AP_INIT_TAKE13("AuthOpenIDPreassociate", (CMD_HAND_TYPE) set_modauthopenid_preassociate, NULL, RSRC_CONF,
+		"AuthOpenIDPreassociate <OP endpoint URL to keep an association with> [<storage type> <db location>]"),
   {NULL}
 };
 
 
+// Get the request's parameters - they're parsed the first time this is called for a request and
+// kept in its request config
+static const modauthopenid::RequestParams& request_params(request_rec *r) {
+  modauthopenid::RequestParams *params = (modauthopenid::RequestParams *) ap_get_module_config(r->request_config, &authopenid_module);
+  if(params == NULL) {
+    params = new modauthopenid::RequestParams(r);
+    apr_pool_cleanup_register(r->pool, (void*)params, (apr_status_t(*)(void *))modauthopenid_request_params_cleanup, apr_pool_cleanup_null) ;
+    ap_set_module_config(r->request_config, &authopenid_module, params);
+  }
+  return *params;
+}
+
 // Get the full URI of the request_rec's request location 
 // clean_params specifies whether or not all openid.* and modauthopenid.* params should be cleared
 static void full_uri(request_rec *r, std::string& result, modauthopenid_config *s_cfg, bool clean_params=false) {
@@ -217,10 +603,7 @@ static void full_uri(request_rec *r, std::string& result, modauthopenid_config *
 
   std::string args;
   if(clean_params) {
-    opkele::params_t params;
-    if(r->args != NULL) params = modauthopenid::parse_query_string(std::string(r->args));
-    modauthopenid::remove_openid_vars(params);
-    args = params.append_query("", "");
+    args = request_params(r).query().other.append_query("", "");
   } else {
     args = (r->args == NULL) ? "" : "?" + std::string(r->args);
   }
@@ -234,12 +617,9 @@ static void full_uri(request_rec *r, std::string& result, modauthopenid_config *
 static int show_input(request_rec *r, modauthopenid_config *s_cfg, modauthopenid::error_result_t e) {
   if(s_cfg->login_page == NULL) {
     std::string msg = modauthopenid::error_to_string(e, false);
-    return modauthopenid::show_html_input(r, msg);
+    return modauthopenid::show_html_input(r, msg, request_params(r).query());
   }
-  opkele::params_t params;
-  if(r->args != NULL) 
-    params = modauthopenid::parse_query_string(std::string(r->args));
-  modauthopenid::remove_openid_vars(params);  
+  opkele::params_t params = request_params(r).query().other;
 
   std::string uri_location;
   full_uri(r, uri_location, s_cfg, true);
@@ -251,11 +631,8 @@ static int show_input(request_rec *r, modauthopenid_config *s_cfg, modauthopenid
 
 static int show_input(request_rec *r, modauthopenid_config *s_cfg) {
   if(s_cfg->login_page == NULL) 
-    return modauthopenid::show_html_input(r, "");
-  opkele::params_t params;
-  if(r->args != NULL) 
-    params = modauthopenid::parse_query_string(std::string(r->args));
-  modauthopenid::remove_openid_vars(params);
+    return modauthopenid::show_html_input(r, "", request_params(r).query());
+  opkele::params_t params = request_params(r).query().other;
   std::string uri_location;
   full_uri(r, uri_location, s_cfg, true);
   params["modauthopenid.referrer"] = uri_location;
@@ -263,35 +640,81 @@ static int show_input(request_rec *r, modauthopenid_config *s_cfg) {
 }
 
 static bool is_trusted_provider(modauthopenid_config *s_cfg, std::string url) {
-  if(apr_is_empty_array(s_cfg->trusted))
+  if(s_cfg->trusted->empty())
     return true;
-  char **trusted_sites = (char **) s_cfg->trusted->elts;
   std::string base_url = modauthopenid::get_queryless_url(url);
-  for (int i = 0; i < s_cfg->trusted->nelts; i++) {
-    if(modauthopenid::regex_match(base_url, trusted_sites[i])) {
-      modauthopenid::debug(base_url + " is a trusted identity provider");
-      return true;
-    }
+  if(s_cfg->trusted->matches(base_url)) {
+    modauthopenid::debug(base_url + " is a trusted identity provider");
+    return true;
   }
   modauthopenid::debug(base_url + " is NOT a trusted identity provider");
   return false;
 }
 
 static bool is_distrusted_provider(modauthopenid_config *s_cfg, std::string url) {
-  if(apr_is_empty_array(s_cfg->distrusted))
+  if(s_cfg->distrusted->empty())
     return false;
-  char **distrusted_sites = (char **) s_cfg->distrusted->elts;
   std::string base_url = modauthopenid::get_queryless_url(url);
-  for (int i = 0; i < s_cfg->distrusted->nelts; i++) {
-    if(modauthopenid::regex_match(base_url, distrusted_sites[i])) {
-      modauthopenid::debug(base_url + " is a distrusted (on black list) identity provider");
-      return true;
-    }
+  if(s_cfg->distrusted->matches(base_url)) {
+    modauthopenid::debug(base_url + " is a distrusted (on black list) identity provider");
+    return true;
   }
   modauthopenid::debug(base_url + " is NOT a distrusted identity provider (not blacklisted)");
   return false;
 };
 
+// set once a child has complained about a stateless mode without keys, so the complaint isn't
+// repeated on every request
+static volatile apr_uint32_t warned_no_session_keys = 0;
+static volatile apr_uint32_t warned_no_login_keys = 0;
+
+// true if sessions for this location are kept in signed cookies rather than the db
+static bool use_stateless_sessions(modauthopenid_config *s_cfg) {
+  if(s_cfg->stateless_sessions && s_cfg->keys->empty()) {
+    if(apr_atomic_cas32(&warned_no_session_keys, 1, 0) == 0)
+      modauthopenid::print_to_error_log("AuthOpenIDStatelessSessions is on but no AuthOpenIDSessionKey is set - using the db instead");
+    return false;
+  }
+  return s_cfg->stateless_sessions;
+};
+
+// true if authentication sessions for this location are carried in signed tokens rather than the db
+static bool use_stateless_login(modauthopenid_config *s_cfg) {
+  if(s_cfg->stateless_login && s_cfg->keys->empty()) {
+    if(apr_atomic_cas32(&warned_no_login_keys, 1, 0) == 0)
+      modauthopenid::print_to_error_log("AuthOpenIDStatelessLogin is on but no AuthOpenIDSessionKey is set - using the db instead");
+    return false;
+  }
+  return s_cfg->stateless_login;
+};
+
+// find the session for session_id, either by checking the signed cookie or by looking in the
+// session cache and then the db - session.identity is "" if there isn't a valid one
+static void find_session(modauthopenid_config *s_cfg, const std::string& session_id, modauthopenid::session_t& session) {
+  session.identity = "";
+  if(use_stateless_sessions(s_cfg) && session_id.find('.') != std::string::npos) {
+    std::string payload;
+    if(!s_cfg->keys->open(modauthopenid::TOKEN_SESSION, session_id, payload) || !modauthopenid::unserialize_session(payload, session)) {
+      modauthopenid::debug("session cookie is not valid");
+      session.identity = "";
+    } else if(session.expires_on < time(0)) {
+      modauthopenid::debug("session cookie has expired");
+      session.identity = "";
+    }
+    return;
+  }
+  // don't bother looking for an id that can't be one of ours
+  if(!modauthopenid::is_rstring(session_id, SESSION_ID_LENGTH)) {
+    modauthopenid::debug("session id in cookie is malformed");
+    return;
+  }
+  if(!modauthopenid::SessionManager::get_cached_session(session_id, session)) {
+    modauthopenid::SessionManager sm(std::string(s_cfg->storage_type), std::string(s_cfg->db_location));
+    sm.get_session(session_id, session);
+    sm.close();
+  }
+};
+
 static bool has_valid_session(request_rec *r, modauthopenid_config *s_cfg) {
   // test for valid session - if so, return DECLINED
   std::string session_id = "";
@@ -299,9 +722,7 @@ static bool has_valid_session(request_rec *r, modauthopenid_config *s_cfg) {
   if(session_id != "" && s_cfg->use_cookie) {
     modauthopenid::debug("found session_id in cookie: " + session_id);
     modauthopenid::session_t session;
-    modauthopenid::SessionManager sm(std::string(s_cfg->db_location));
-    sm.get_session(session_id, session);
-    sm.close();
+    find_session(s_cfg, session_id, session);
 
     // if session found 
     if(std::string(session.identity) != "") {
@@ -329,26 +750,29 @@ static bool has_valid_session(request_rec *r, modauthopenid_config *s_cfg) {
 };
 
 
-static int start_authentication_session(request_rec *r, modauthopenid_config *s_cfg, opkele::params_t& params, 
+static int start_authentication_session(request_rec *r, modauthopenid_config *s_cfg, const modauthopenid::split_params_t& request, 
 					std::string& return_to, std::string& trust_root) {
   // remove all openid GET query params (openid.*) - we don't want that maintained through
   // the redirection process.  We do, however, want to keep all other GET params.
   // also, add a nonce for security 
-  std::string identity = params.get_param("openid_identifier");
-  modauthopenid::remove_openid_vars(params);
+  std::string identity = request.openid.get_param("openid_identifier");
+  opkele::params_t params = request.other;
 
-  // add a nonce and reset what return_to is
+  // add a nonce (or, for a stateless login, a token holding the whole authentication session) and
+  // reset what return_to is - the token can only be made once the endpoint has been discovered
   std::string nonce, re_direct;
-  modauthopenid::make_rstring(10, nonce);
-  modauthopenid::MoidConsumer consumer(std::string(s_cfg->db_location), nonce, return_to);    
-  params["modauthopenid.nonce"] = nonce;
-  full_uri(r, return_to, s_cfg);
-  return_to = params.append_query(return_to, "");
+  bool stateless = use_stateless_login(s_cfg);
+  if(!stateless)
+    modauthopenid::make_rstring(10, nonce);
+  modauthopenid::MoidConsumer consumer(std::string(s_cfg->storage_type), std::string(s_cfg->db_location), nonce, return_to);    
+  if(stateless)
+    consumer.use_session_token();
 
   // get identity provider and redirect
   try {
     consumer.initiate(identity);
-    opkele::openid_message_t cm; 
+    full_uri(r, return_to, s_cfg);
+    std::string base_return_to = return_to;
 
     opkele::ax_t ax;
     for(modauthopenid_ax_map::const_iterator it = (*s_cfg->attr).begin(); it != (*s_cfg->attr).end(); ++it) {
@@ -356,7 +780,28 @@ static int start_authentication_session(request_rec *r, modauthopenid_config *s_
       ax.add_attribute(attr.uri.c_str(), attr.required, NULL, attr.count);
     }
 
-    re_direct = consumer.checkid_(cm, opkele::mode_checkid_setup, return_to, trust_root, &ax).append_query(consumer.get_endpoint().uri);
+    // if the OP at an endpoint can't be reached while associating, move on to the next endpoint
+    // rather than sending the user to it - and don't try endpoints that failed recently (in this
+    // request or another) while there are others left
+    while(true) {
+      if(consumer.has_next_endpoint() && !modauthopenid::EndpointHealth::healthy(consumer.get_endpoint().uri)) {
+        modauthopenid::debug("skipping " + consumer.get_endpoint().uri + " - it failed recently");
+        consumer.next_endpoint();
+        continue;
+      }
+      if(stateless)
+        nonce = consumer.make_session_token(*s_cfg->keys);
+      params["modauthopenid.nonce"] = nonce;
+      return_to = params.append_query(base_return_to, "");
+      opkele::openid_message_t cm; 
+      try {
+        re_direct = consumer.checkid_(cm, opkele::mode_checkid_setup, return_to, trust_root, &ax).append_query(consumer.get_endpoint().uri);
+        break;
+      } catch (opkele::exception_network &e) {
+        modauthopenid::debug("could not reach " + consumer.get_endpoint().uri + " - trying the next endpoint");
+        consumer.next_endpoint();
+      }
+    }
   } catch (opkele::failed_xri_resolution &e) {
     consumer.close();
     return show_input(r, s_cfg, modauthopenid::invalid_id);
@@ -378,23 +823,17 @@ static int start_authentication_session(request_rec *r, modauthopenid_config *s_
 };
 
 
-static int set_session_cookie(request_rec *r, modauthopenid_config *s_cfg, opkele::params_t& params, std::string identity, std::map<std::string,std::string>& env_vars) {
+static int set_session_cookie(request_rec *r, modauthopenid_config *s_cfg, const modauthopenid::split_params_t& request, std::string identity, std::map<std::string,std::string>& env_vars) {
   // now set auth cookie, if we're doing session based auth
   std::string session_id, hostname, path, cookie_value, redirect_location, args;
   if(s_cfg->cookie_path != NULL) 
     path = std::string(s_cfg->cookie_path); 
   else 
     modauthopenid::base_dir(std::string(r->uri), path); 
-  modauthopenid::make_rstring(32, session_id);
-  modauthopenid::make_cookie_value(cookie_value, std::string(s_cfg->cookie_name), session_id, path, s_cfg->cookie_lifespan); 
-  modauthopenid::debug("setting cookie: " + cookie_value);
-  apr_table_set(r->err_headers_out, "Set-Cookie", cookie_value.c_str());
   hostname = std::string(r->hostname);
 
-
   // save session values
   modauthopenid::session_t session;
-  session.session_id = session_id;
   session.hostname = hostname;
   session.path = path;
   session.identity = identity;
@@ -408,12 +847,31 @@ static int set_session_cookie(request_rec *r, modauthopenid_config *s_cfg, opkel
   else
     session.expires_on = rawtime + s_cfg->cookie_lifespan;
 
-  modauthopenid::SessionManager sm(std::string(s_cfg->db_location));
-  sm.store_session(session);
-  sm.close();
+  // in stateless mode the whole session goes in the (signed) cookie - unless it's too big for
+  // browsers to keep, in which case it's stored in the db like any other session
+  if(use_stateless_sessions(s_cfg)) {
+    std::string payload;
+    modauthopenid::serialize_session(session, payload);
+    session_id = s_cfg->keys->seal(modauthopenid::TOKEN_SESSION, payload, s_cfg->encrypt_sessions);
+    if(session_id.size() > 3800) {
+      modauthopenid::print_to_error_log("session for " + identity + " is too big for a cookie - storing it in the db instead");
+      session_id = "";
+    }
+  }
 
-  modauthopenid::remove_openid_vars(params);
-  args = params.append_query("", "").substr(1);
+  if(session_id.empty()) {
+    modauthopenid::make_rstring(SESSION_ID_LENGTH, session_id);
+    session.session_id = session_id;
+    modauthopenid::SessionManager sm(std::string(s_cfg->storage_type), std::string(s_cfg->db_location));
+    sm.store_session(session);
+    sm.close();
+  }
+
+  modauthopenid::make_cookie_value(cookie_value, std::string(s_cfg->cookie_name), session_id, path, s_cfg->cookie_lifespan); 
+  modauthopenid::debug("setting cookie: " + cookie_value);
+  apr_table_set(r->err_headers_out, "Set-Cookie", cookie_value.c_str());
+
+  args = request.other.append_query("", "").substr(1);
   if(args.length() == 0)
     r->args = NULL;
   else
@@ -423,16 +881,22 @@ static int set_session_cookie(request_rec *r, modauthopenid_config *s_cfg, opkel
 };
 
 
-static int validate_authentication_session(request_rec *r, modauthopenid_config *s_cfg, opkele::params_t& params, std::string& return_to) {
+static int validate_authentication_session(request_rec *r, modauthopenid_config *s_cfg, const modauthopenid::split_params_t& request, std::string& return_to) {
   // make sure nonce is present
-  if(!params.has_param("modauthopenid.nonce")) 
+  if(!request.openid.has_param("modauthopenid.nonce")) 
     return show_input(r, s_cfg, modauthopenid::invalid_nonce);
 
-  modauthopenid::MoidConsumer consumer(std::string(s_cfg->db_location), params.get_param("modauthopenid.nonce"), return_to);
+  // a nonce with a '.' in it is a token holding the whole authentication session
+  std::string nonce = request.openid.get_param("modauthopenid.nonce");
+  modauthopenid::MoidConsumer consumer(std::string(s_cfg->storage_type), std::string(s_cfg->db_location), nonce, return_to);
+  if(nonce.find('.') != std::string::npos && (!use_stateless_login(s_cfg) || !consumer.read_session_token(*s_cfg->keys, nonce))) {
+    consumer.close();
+    return show_input(r, s_cfg, modauthopenid::invalid_nonce);
+  }
   try {
     opkele::ax_t ax;
     opkele::params_t openidparams;
-    modauthopenid::get_openid_params(openidparams, params);
+    modauthopenid::get_openid_params(openidparams, request.openid);
     consumer.id_res(openidparams, &ax);
     
     // if no exception raised, check nonce
@@ -442,7 +906,7 @@ static int validate_authentication_session(request_rec *r, modauthopenid_config
     }
 
     // if we should be using a user specified auth program, run it to see if user is authorized
-    if(s_cfg->use_auth_program && !modauthopenid::exec_auth(std::string(s_cfg->auth_program), consumer.get_claimed_id())) {
+    if(s_cfg->use_auth_program && !modauthopenid::AuthorizerPool::authorize(std::string(s_cfg->auth_program), consumer.get_claimed_id())) {
       consumer.close();
       return show_input(r, s_cfg, modauthopenid::unauthorized);       
     }
@@ -463,7 +927,7 @@ static int validate_authentication_session(request_rec *r, modauthopenid_config
     }
 
     if(s_cfg->use_cookie) 
-      return set_session_cookie(r, s_cfg, params, identity, env_vars);
+      return set_session_cookie(r, s_cfg, request, identity, env_vars);
       
     // if we're not setting cookie - don't redirect, just show page
     modauthopenid::debug("setting REMOTE_USER to \"" + identity + "\"");
@@ -492,13 +956,17 @@ static int mod_authopenid_method_handler(request_rec *r) {
 
   // make a record of our being called
   modauthopenid::debug("***" + std::string(PACKAGE_STRING) + " module has been called***");
+
+  // no reaper thread - remove expired entries and renew preassociations from here instead (at
+  // most once per interval)
+  if(!modauthopenid::Reaper::running())
+    modauthopenid::Reaper::tick();
   
   if(has_valid_session(r, s_cfg))
     return DECLINED;
 
   // parse the get/post params
-  opkele::params_t params;
-  modauthopenid::get_request_params(r, params);
+  const modauthopenid::split_params_t& request = request_params(r).request();
 
   // get our current url and trust root
   std::string return_to, trust_root;
@@ -509,18 +977,43 @@ static int mod_authopenid_method_handler(request_rec *r) {
     trust_root = std::string(s_cfg->trust_root);
 
   // if user is posting id (only openid_identifier will contain a value)
-  if(params.has_param("openid_identifier") && !params.has_param("openid.assoc_handle")) {
-    return start_authentication_session(r, s_cfg, params, return_to, trust_root);
-  } else if(params.has_param("openid.assoc_handle")) { // user has been redirected, authenticate them and set cookie
-    return validate_authentication_session(r, s_cfg, params, return_to);
+  if(request.openid.has_param("openid_identifier") && !request.openid.has_param("openid.assoc_handle")) {
+    return start_authentication_session(r, s_cfg, request, return_to, trust_root);
+  } else if(request.openid.has_param("openid.assoc_handle")) { // user has been redirected, authenticate them and set cookie
+    return validate_authentication_session(r, s_cfg, request, return_to);
   } else { //display an input form
-    if(params.has_param("openid.mode") && params.get_param("openid.mode") == "cancel")
+    if(request.openid.has_param("openid.mode") && request.openid.get_param("openid.mode") == "cancel")
       return show_input(r, s_cfg, modauthopenid::canceled);
     return show_input(r, s_cfg);
   }
 }
 
+static int mod_authopenid_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s) {
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(s->module_config, &authopenid_module);
+  modauthopenid::ProviderMatcher::prepare_all();
+  modauthopenid::SessionManager::init_cache(pconf, s_cfg->session_cache_size);
+  modauthopenid::MoidConsumer::init_nonce_cache(pconf, s_cfg->nonce_cache_size, s_cfg->nonce_skew);
+  modauthopenid::DiscoveryCache::init(pconf, s_cfg->discovery_cache_size, s_cfg->discovery_ttl, s_cfg->discovery_negative_ttl);
+  modauthopenid::MoidConsumer::init_single_flight(pconf, SINGLE_FLIGHT_SLOTS, s_cfg->single_flight_timeout);
+  modauthopenid::DecisionCache::init(pconf, s_cfg->decision_cache_size, s_cfg->decision_allow_ttl, s_cfg->decision_deny_ttl,
+				     s_cfg->decision_flush_file);
+  return OK;
+}
+
+static void mod_authopenid_child_init(apr_pool_t *p, server_rec *s) {
+  modauthopenid_server_config *s_cfg = (modauthopenid_server_config *) ap_get_module_config(s->module_config, &authopenid_module);
+  modauthopenid::Storage::init(p);
+  modauthopenid::ConnectionPool::init(p, s_cfg->db_max_locations, s_cfg->db_max_idle);
+  modauthopenid::CurlPool::init(p, s_cfg->curl_max_idle);
+  modauthopenid::AuthorizerPool::init(p, s_cfg->auth_program_instances, s_cfg->auth_program_timeout);
+  modauthopenid::AssociationCache::init(p);
+  modauthopenid::EndpointHealth::init(p);
+  modauthopenid::Reaper::start(p, s_cfg->reap_interval, s_cfg->reap_batch_size, s_cfg->preassociations);
+}
+
 static void mod_authopenid_register_hooks (apr_pool_t *p) {
+  ap_hook_post_config(mod_authopenid_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_child_init(mod_authopenid_child_init, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_handler(mod_authopenid_method_handler, NULL, NULL, APR_HOOK_FIRST);
 }
 
@@ -529,7 +1022,7 @@ module AP_MODULE_DECLARE_DATA authopenid_module = {
 	STANDARD20_MODULE_STUFF,
 	create_modauthopenid_config,
 	NULL, // config merge function - default is to override
-	NULL,
+	create_modauthopenid_server_config,
 	NULL,
 	mod_authopenid_cmds,
 	mod_authopenid_register_hooks,
@@ -40,11 +40,21 @@ Created by bmuller <bmuller@butterfat.net>
 #include "apr.h"
 #include "apr_general.h"
 #include "apr_time.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_proc.h"
+#include "apr_shm.h"
+#include "apr_atomic.h"
+#include "apr_hash.h"
+#include "apr_network_io.h"
 
 /* other general lib includes */
 #include <curl/curl.h>
 #include <pcre.h>
 #include <sqlite3.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/bn.h>
 
 #include <ctime>
 #include <cstdlib>
@@ -52,8 +62,11 @@ Created by bmuller <bmuller@butterfat.net>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <signal.h>
 
 #include <algorithm>
+#include <iterator>
 #include <string>
 #include <vector>
 #include <map>
@@ -77,10 +90,44 @@ Created by bmuller <bmuller@butterfat.net>
 /* Header enctype for POSTed form data */
 #define DEFAULT_POST_ENCTYPE "application/x-www-form-urlencoded"
 
+/* How far (in seconds) the time stamp in a response nonce may be from now */
+#define DEFAULT_NONCE_SKEW 300
+
+/* Length of the random session ids of sessions that are stored */
+#define SESSION_ID_LENGTH 32
+
+/* Number of in-flight markers for discoveries and associations shared by all children */
+#define SINGLE_FLIGHT_SLOTS 4096
+
+/* Seconds before they expire that associations are renewed (and no longer taken from the cache) */
+#define PREASSOCIATE_MARGIN 600
+
 /* mod_auth_openid includes */
 #include "config.h"
+#ifdef HAVE_LMDB
+#include <lmdb.h>
+#endif
 #include "types.h"
 #include "http_helpers.h"
 #include "moid_utils.h"
+#include "Storage.h"
+#include "SqliteStorage.h"
+#include "LmdbStorage.h"
+#include "RedisStorage.h"
+#include "ConnectionPool.h"
+#include "EndpointHealth.h"
+#include "CurlPool.h"
+#include "AuthorizerPool.h"
+#include "Associator.h"
+#include "Preassociator.h"
+#include "Reaper.h"
+#include "SharedCache.h"
+#include "ReplayCache.h"
+#include "SingleFlight.h"
+#include "KeyRing.h"
+#include "ProviderMatcher.h"
+#include "AssociationCache.h"
+#include "DiscoveryCache.h"
+#include "DecisionCache.h"
 #include "SessionManager.h"
 #include "MoidConsumer.h"
@@ -104,16 +104,16 @@ namespace modauthopenid {
 
   vector<string> explode(string s, string e) {
     vector<string> ret;
-    int iPos = s.find(e, 0);
-    int iPit = e.length();
-    while(iPos>-1) {
-      if(iPos!=0)
-        ret.push_back(s.substr(0,iPos));
-      s.erase(0,iPos+iPit);
-      iPos = s.find(e, 0);
+    string::size_type start = 0;
+    string::size_type pos = s.find(e, start);
+    while(pos != string::npos) {
+      if(pos != start)
+        ret.push_back(s.substr(start, pos - start));
+      start = pos + e.length();
+      pos = s.find(e, start);
     }
-    if(s!="")
-      ret.push_back(s);
+    if(start < s.size())
+      ret.push_back(s.substr(start));
     return ret;
   };
 
@@ -125,7 +125,49 @@ namespace modauthopenid {
       print_to_error_log("regex compilation failed for regex \"" + pattern + "\": " + error);
       return false;
     }
-    return (pcre_exec(re, NULL, subject.c_str(), subject.size(), 0, 0, NULL, 0) >= 0);
+    bool result = (pcre_exec(re, NULL, subject.c_str(), subject.size(), 0, 0, NULL, 0) >= 0);
+    pcre_free(re);
+    return result;
+  };
+
+  bool regex_match(const string& subject, const compiled_regex_t *re) {
+    return (pcre_exec(re->re, re->extra, subject.c_str(), subject.size(), 0, 0, NULL, 0) >= 0);
+  };
+
+  static apr_status_t regex_cleanup(void *data) {
+    pcre_free(data);
+    return APR_SUCCESS;
+  };
+
+  static apr_status_t regex_study_cleanup(void *data) {
+#ifdef PCRE_CONFIG_JIT
+    pcre_free_study((pcre_extra *) data);
+#else
+    pcre_free(data);
+#endif
+    return APR_SUCCESS;
+  };
+
+  const char *regex_compile(apr_pool_t *p, const char *pattern, compiled_regex_t *re) {
+    const char *error;
+    int erroffset;
+    re->pattern = pattern;
+    re->extra = NULL;
+    re->re = pcre_compile(pattern, 0, &error, &erroffset, NULL);
+    if(re->re == NULL)
+      return apr_psprintf(p, "regex compilation failed for regex \"%s\" at offset %d: %s", pattern, erroffset, error);
+
+    // studying is worth it since every pattern is matched again and again - use the JIT if
+    // this pcre has one
+#ifdef PCRE_STUDY_JIT_COMPILE
+    re->extra = pcre_study(re->re, PCRE_STUDY_JIT_COMPILE, &error);
+#else
+    re->extra = pcre_study(re->re, 0, &error);
+#endif
+    apr_pool_cleanup_register(p, (void *) re->re, regex_cleanup, apr_pool_cleanup_null);
+    if(re->extra != NULL)
+      apr_pool_cleanup_register(p, (void *) re->extra, regex_study_cleanup, apr_pool_cleanup_null);
+    return NULL;
   };
 
   void strip(string& s) {
@@ -141,6 +183,17 @@ namespace modauthopenid {
       s += cs[true_random()%62];
   }
 
+  bool is_rstring(const string& s, int size) {
+    if(s.size() != (string::size_type) size)
+      return false;
+    for(string::size_type i = 0; i < s.size(); i++) {
+      char c = s[i];
+      if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+        return false;
+    }
+    return true;
+  };
+
   void print_sqlite_table(sqlite3 *db, string tablename) {
     fprintf(stdout, "Printing table: %s.  ", tablename.c_str());
     string sql = "SELECT * FROM " + tablename;
@@ -167,7 +220,7 @@ namespace modauthopenid {
     return true;
   };
 
-  bool exec_auth(string exec_location, string username) {
+  bool exec_auth(string exec_location, string username, int timeout, bool& decided) {
     if(exec_location.size() > 255)
       exec_location.resize(255);
     if(username.size() > 255)
@@ -176,6 +229,7 @@ namespace modauthopenid {
     char *const argv[] = { (char *) exec_location.c_str(), (char *) username.c_str(), NULL };
     bool result = false;
     int rvalue = 0;
+    decided = false;
     
     pid_t pid = fork();
     switch(pid) {
@@ -192,13 +246,23 @@ namespace modauthopenid {
       print_to_error_log("Could not execv \"" + exec_location + "\" - does the file exist?");
       exit(1);
     default:
-      // you're an adult parent, act responsibly
-      if(waitpid(pid, &rvalue, 0) == -1) {	
+      // you're an adult parent, act responsibly - but don't wait forever
+      pid_t done;
+      time_t until = time(0) + timeout;
+      while((done = waitpid(pid, &rvalue, WNOHANG)) == 0 && time(0) < until)
+	usleep(10000);
+      if(done == 0) {
+	print_to_error_log(exec_location + " took too long to decide about " + username + " - killing it");
+	kill(pid, SIGKILL);
+	waitpid(pid, &rvalue, 0);
+	result = false;
+      } else if(done == -1) {
 	char c_pid[100];
 	sprintf(c_pid, "%i", (int) pid);
 	print_to_error_log("Problem waiting for child with pid of " + string(c_pid) + " to return");
 	result = false;
       } else { 
+	decided = true;
 	result = (rvalue == 0);
 	if(result) debug(username + " deemed authenticated by " + exec_location);
 	else debug(username + " deemed not authenticated by " + exec_location);
@@ -220,5 +284,174 @@ namespace modauthopenid {
     return rand() & 0x0FFFF;
   };
 
+  void memory_barrier() {
+#if defined(__GNUC__)
+    __sync_synchronize();
+#else
+    // a compare and swap implies a full barrier on every platform apr supports
+    static volatile apr_uint32_t dummy = 0;
+    apr_atomic_cas32(&dummy, 0, 0);
+#endif
+  };
+
+  apr_uint32_t hash_string(const string& s) {
+    apr_uint32_t hash = 2166136261U;
+    for(string::size_type i = 0; i < s.size(); i++) {
+      hash ^= (unsigned char) s[i];
+      hash *= 16777619U;
+    }
+    return hash;
+  };
+
+  void put_varint(string& s, apr_uint64_t v) {
+    while(v >= 0x80) {
+      s += (char) ((v & 0x7f) | 0x80);
+      v >>= 7;
+    }
+    s += (char) v;
+  };
+
+  bool get_varint(const string& data, string::size_type& pos, apr_uint64_t& v) {
+    v = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+      if(pos >= data.size())
+        return false;
+      unsigned char c = (unsigned char) data[pos++];
+      v |= ((apr_uint64_t) (c & 0x7f)) << shift;
+      if(!(c & 0x80))
+        return true;
+    }
+    return false;
+  };
+
+  void put_string(string& s, const string& v) {
+    put_varint(s, v.size());
+    s += v;
+  };
+
+  bool get_string(const string& data, string::size_type& pos, string& v) {
+    apr_uint64_t len;
+    if(!get_varint(data, pos, len) || len > data.size() - pos)
+      return false;
+    v = data.substr(pos, len);
+    pos += len;
+    return true;
+  };
+
+  // format version 1: version byte, session_id, hostname, path, identity, expires_on,
+  // number of env vars, then each env var key and value
+  void serialize_session(const session_t& session, string& s) {
+    s = "";
+    s += (char) 1;
+    put_string(s, session.session_id);
+    put_string(s, session.hostname);
+    put_string(s, session.path);
+    put_string(s, session.identity);
+    put_varint(s, (apr_uint64_t) session.expires_on);
+    put_env_vars(s, session.env_vars);
+  };
+
+  bool unserialize_session(const string& s, session_t& session) {
+    string::size_type pos = 1;
+    apr_uint64_t expires_on;
+    if(s.empty() || s[0] != 1)
+      return false;
+    if(!get_string(s, pos, session.session_id) || !get_string(s, pos, session.hostname) || 
+       !get_string(s, pos, session.path) || !get_string(s, pos, session.identity) ||
+       !get_varint(s, pos, expires_on))
+      return false;
+    session.expires_on = (int) expires_on;
+    return get_env_vars(s, pos, session.env_vars);
+  };
+
+  void put_env_vars(string& s, const map<string,string>& env_vars) {
+    put_varint(s, env_vars.size());
+    for(map<string,string>::const_iterator it = env_vars.begin(); it != env_vars.end(); ++it) {
+      put_string(s, it->first);
+      put_string(s, it->second);
+    }
+  };
+
+  bool get_env_vars(const string& data, string::size_type& pos, map<string,string>& env_vars) {
+    apr_uint64_t count;
+    env_vars.clear();
+    if(!get_varint(data, pos, count))
+      return false;
+    for(apr_uint64_t i = 0; i < count; i++) {
+      string key, value;
+      if(!get_string(data, pos, key) || !get_string(data, pos, value))
+        return false;
+      env_vars[key] = value;
+    }
+    return true;
+  };
+
+  void put_endpoints(string& s, const vector<openid_endpoint_t>& endpoints) {
+    put_varint(s, endpoints.size());
+    for(vector<openid_endpoint_t>::const_iterator it = endpoints.begin(); it != endpoints.end(); ++it) {
+      put_string(s, it->uri);
+      put_string(s, it->claimed_id);
+      put_string(s, it->local_id);
+    }
+  };
+
+  bool get_endpoints(const string& data, string::size_type& pos, vector<openid_endpoint_t>& endpoints) {
+    apr_uint64_t count;
+    endpoints.clear();
+    if(!get_varint(data, pos, count))
+      return false;
+    for(apr_uint64_t i = 0; i < count; i++) {
+      openid_endpoint_t ep;
+      if(!get_string(data, pos, ep.uri) || !get_string(data, pos, ep.claimed_id) || !get_string(data, pos, ep.local_id))
+        return false;
+      endpoints.push_back(ep);
+    }
+    return true;
+  };
+
+  void serialize_env_vars(const map<string,string>& env_vars, string& s) {
+    s = "";
+    s += (char) 1;
+    put_env_vars(s, env_vars);
+  };
+
+  bool unserialize_env_vars(const string& s, map<string,string>& env_vars) {
+    string::size_type pos = 1;
+    if(s.empty() || s[0] != 1)
+      return false;
+    return get_env_vars(s, pos, env_vars);
+  };
+
+
+  bool parse_nonce_time(const string& nonce, time_t& timestamp) {
+    // YYYY-MM-DDTHH:MM:SSZ
+    const char *format = "dddd-dd-ddTdd:dd:ddZ";
+    if(nonce.size() < 20)
+      return false;
+    for(int i = 0; i < 20; i++) {
+      if(format[i] == 'd' ? !isdigit((unsigned char) nonce[i]) : nonce[i] != format[i])
+        return false;
+    }
+    long year = atol(nonce.substr(0, 4).c_str());
+    int month = atoi(nonce.substr(5, 2).c_str());
+    int day = atoi(nonce.substr(8, 2).c_str());
+    int hour = atoi(nonce.substr(11, 2).c_str());
+    int minute = atoi(nonce.substr(14, 2).c_str());
+    int second = atoi(nonce.substr(17, 2).c_str());
+    if(month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+      return false;
+
+    // days since the epoch for a proleptic gregorian date (done by hand since timegm isn't
+    // everywhere)
+    if(month <= 2)
+      year--;
+    long era = year / 400;
+    long yoe = year - era * 400;
+    long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long days = era * 146097 + doe - 719468;
+    timestamp = (time_t) days * 86400 + hour * 3600 + minute * 60 + second;
+    return true;
+  };
 } // end namespace
 
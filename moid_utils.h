@@ -46,15 +46,32 @@ namespace modauthopenid {
   // print a string to the error log (called by debug if DEBUG is defined)
   void print_to_error_log(string s);
 
+  // a regular expression that is compiled (and studied) once, when the config is read
+  typedef struct compiled_regex {
+    const char *pattern;
+    pcre *re;
+    pcre_extra *extra;
+  } compiled_regex_t;
+
   // return true if pattern found in subject
   bool regex_match(string subject, string pattern);
 
+  // return true if the compiled regex re is found in subject
+  bool regex_match(const string& subject, const compiled_regex_t *re);
+
+  // compile pattern into re - it is freed when p is cleaned up.  Returns an error message,
+  // or NULL if the pattern compiled
+  const char *regex_compile(apr_pool_t *p, const char *pattern, compiled_regex_t *re);
+
   // strip any spaces before or after actual string in s
   void strip(string& s);
 
   // make a random string of size size
   void make_rstring(int size, string& s);
 
+  // true if s could have been made by make_rstring(size, ...)
+  bool is_rstring(const string& s, int size);
+
   // print an sqlite table to stdout
   void print_sqlite_table(sqlite3 *db, string tablename);
 
@@ -63,11 +80,60 @@ namespace modauthopenid {
   bool test_sqlite_return(sqlite3 *db, int result, const string& context);
 
   // Exec a program located at exec_location with a single parameter of username
-  // program should return a 0 if authorized, anything else otherwise
-  // NOTE: if program hangs, so does apache
-  bool exec_auth(string exec_location, string username);
+  // program should return a 0 if authorized, anything else otherwise.  A program still
+  // running after timeout seconds is killed, and the user isn't authorized.  decided is set
+  // to false if the program couldn't be run or was killed.
+  bool exec_auth(string exec_location, string username, int timeout, bool& decided);
 
   // Generate a random integer - taken from getuuid.c file in apr-util program
   int true_random();
+
+  // full memory barrier - used around reads and writes of seqlock protected shared memory
+  void memory_barrier();
+
+  // 32 bit FNV-1a hash of s
+  apr_uint32_t hash_string(const string& s);
+
+  // append v to s as a varint (7 bits per byte, least significant first)
+  void put_varint(string& s, apr_uint64_t v);
+
+  // read a varint from data at pos and move pos past it - false if data is truncated
+  bool get_varint(const string& data, string::size_type& pos, apr_uint64_t& v);
+
+  // append v to s prefixed with its length as a varint
+  void put_string(string& s, const string& v);
+
+  // read a length prefixed string from data at pos and move pos past it - false if data is truncated
+  bool get_string(const string& data, string::size_type& pos, string& v);
+
+  // append env vars to s as a count followed by keys and values
+  void put_env_vars(string& s, const map<string,string>& env_vars);
+
+  // read env vars written by put_env_vars from data at pos and move pos past them - false if
+  // data is truncated
+  bool get_env_vars(const string& data, string::size_type& pos, map<string,string>& env_vars);
+
+  // append endpoints to s as a count followed by each one's uri, claimed id and local id
+  void put_endpoints(string& s, const vector<openid_endpoint_t>& endpoints);
+
+  // read endpoints written by put_endpoints from data at pos and move pos past them - false if
+  // data is truncated
+  bool get_endpoints(const string& data, string::size_type& pos, vector<openid_endpoint_t>& endpoints);
+
+  // serialize env vars into a compact, versioned binary string (for the sessions table)
+  void serialize_env_vars(const map<string,string>& env_vars, string& s);
+
+  // read env vars serialized by serialize_env_vars - false if s isn't valid
+  bool unserialize_env_vars(const string& s, map<string,string>& env_vars);
+
+  // serialize a session into a compact binary string
+  void serialize_session(const session_t& session, string& s);
+
+  // read a session serialized by serialize_session - false if s isn't a valid session
+  bool unserialize_session(const string& s, session_t& session);
+
+  // read the UTC time stamp (like 2005-05-15T17:11:51Z) an OpenID 2.0 response nonce starts
+  // with - false if the nonce doesn't start with one
+  bool parse_nonce_time(const string& nonce, time_t& timestamp);
 }
 
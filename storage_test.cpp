@@ -0,0 +1,267 @@
+/*
+Copyright (C) 2007-2010 Butterfat, LLC (http://butterfat.net)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+Created by bmuller <bmuller@butterfat.net>
+*/
+
+
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+#include <time.h>
+#include "mod_auth_openid.h"
+
+using namespace std;
+using namespace modauthopenid;
+
+// The cases every storage backend has to pass.  Run by "make check" against each backend that
+// was compiled in; each case uses keys made from a per-run tag, so a shared server can be used.
+// The redis cases use the server in $MOID_TEST_REDIS (host[:port][/db], default localhost) and
+// are skipped if there's no server there.
+
+static int failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+void check(bool passed, const char *what, int line) {
+  if(passed)
+    return;
+  cout << "  FAILED (line " << line << "): " << what << endl;
+  failures++;
+};
+
+void check_sessions(Storage *storage, const string& tag) {
+  time_t now = time(0);
+  session_t session, found;
+  session.session_id = tag + "session";
+  session.hostname = "example.com";
+  session.path = "/private/";
+  session.identity = "http://example.com/me";
+  session.expires_on = now + 100;
+  session.env_vars["openid.ax.value.email"] = "me@example.com";
+  session.env_vars["weird"] = string("a=b;c\nd\0e", 9);
+  storage->store_session(session);
+  CHECK(storage->get_session(session.session_id, found));
+  CHECK(found.session_id == session.session_id);
+  CHECK(found.hostname == session.hostname && found.path == session.path && found.identity == session.identity);
+  CHECK(found.expires_on == session.expires_on);
+  CHECK(found.env_vars == session.env_vars);
+
+  // storing the same id again replaces the session
+  session.identity = "http://example.com/someone-else";
+  session.env_vars.clear();
+  storage->store_session(session);
+  CHECK(storage->get_session(session.session_id, found));
+  CHECK(found.identity == session.identity && found.env_vars.empty());
+
+  CHECK(!storage->get_session(tag + "no-such-session", found));
+
+  session.session_id = tag + "expired-session";
+  session.expires_on = now - 10;
+  storage->store_session(session);
+  CHECK(!storage->get_session(session.session_id, found));
+};
+
+void check_associations(Storage *storage, const string& tag) {
+  time_t now = time(0);
+  string server = "http://" + tag + "op.example.com/";
+  assoc_record_t assoc, found;
+  assoc.server = server;
+  assoc.handle = "first";
+  assoc.type = "HMAC-SHA1";
+  for(int i = 0; i < 20; i++)
+    assoc.secret.push_back((unsigned char) (i * 13));
+  assoc.expires_on = now + 100;
+  storage->store_assoc(assoc);
+  CHECK(storage->get_assoc(server, "first", found));
+  CHECK(found.server == server && found.handle == "first" && found.type == "HMAC-SHA1");
+  CHECK(found.secret.size() == assoc.secret.size() && equal(found.secret.begin(), found.secret.end(), assoc.secret.begin()));
+  CHECK(found.expires_on == assoc.expires_on);
+  CHECK(storage->find_assoc(server, found) && found.handle == "first");
+
+  // find_assoc picks the association that expires last
+  assoc.handle = "second";
+  assoc.type = "HMAC-SHA256";
+  assoc.secret.resize(32, 0);
+  assoc.expires_on = now + 200;
+  storage->store_assoc(assoc);
+  CHECK(storage->find_assoc(server, found) && found.handle == "second" && found.type == "HMAC-SHA256");
+  CHECK(storage->get_assoc(server, "first", found));
+
+  storage->remove_assoc(server, "second");
+  CHECK(!storage->get_assoc(server, "second", found));
+  CHECK(storage->find_assoc(server, found) && found.handle == "first");
+  CHECK(!storage->get_assoc(server + "other/", "first", found));
+  CHECK(!storage->find_assoc(server + "other/", found));
+
+  assoc.server = server + "expired/";
+  assoc.expires_on = now - 10;
+  storage->store_assoc(assoc);
+  CHECK(!storage->get_assoc(assoc.server, assoc.handle, found));
+  CHECK(!storage->find_assoc(assoc.server, found));
+};
+
+void check_capabilities(Storage *storage, const string& tag) {
+  time_t now = time(0);
+  op_capabilities_t caps, found;
+  caps.server = "http://" + tag + "op.example.com/";
+  caps.assoc_type = "HMAC-SHA256";
+  caps.session_type = "DH-SHA256";
+  caps.stateless = false;
+  caps.expires_on = now + 100;
+  storage->store_capabilities(caps);
+  CHECK(storage->get_capabilities(caps.server, found));
+  CHECK(found.server == caps.server && found.assoc_type == caps.assoc_type && found.session_type == caps.session_type);
+  CHECK(!found.stateless && found.expires_on == caps.expires_on);
+
+  // storing them again replaces what was known
+  caps.assoc_type = caps.session_type = "";
+  caps.stateless = true;
+  storage->store_capabilities(caps);
+  CHECK(storage->get_capabilities(caps.server, found));
+  CHECK(found.stateless && found.assoc_type == "" && found.session_type == "");
+
+  CHECK(!storage->get_capabilities(caps.server + "other/", found));
+
+  caps.server += "expired/";
+  caps.expires_on = now - 10;
+  storage->store_capabilities(caps);
+  CHECK(!storage->get_capabilities(caps.server, found));
+};
+
+void check_auth_sessions(Storage *storage, const string& tag) {
+  time_t now = time(0);
+  auth_session_t auth_session, found;
+  auth_session.nonce = tag + "asnonce";
+  auth_session.endpoint.uri = "http://op.example.com/server";
+  auth_session.endpoint.claimed_id = "http://example.com/me";
+  auth_session.endpoint.local_id = "http://op.example.com/me";
+  auth_session.normalized_id = "";
+  auth_session.expires_on = now + 100;
+  openid_endpoint_t fallback;
+  fallback.uri = "http://backup1.example.com/server";
+  fallback.claimed_id = auth_session.endpoint.claimed_id;
+  fallback.local_id = "";
+  auth_session.fallbacks.push_back(fallback);
+  fallback.uri = "http://backup2.example.com/server";
+  auth_session.fallbacks.push_back(fallback);
+  storage->store_auth_session(auth_session);
+  CHECK(storage->get_auth_session(auth_session.nonce, found));
+  CHECK(found.nonce == auth_session.nonce && found.endpoint.uri == auth_session.endpoint.uri);
+  CHECK(found.endpoint.claimed_id == auth_session.endpoint.claimed_id && found.endpoint.local_id == auth_session.endpoint.local_id);
+  CHECK(found.normalized_id == "" && found.expires_on == auth_session.expires_on);
+  CHECK(found.fallbacks.size() == 2);
+  if(found.fallbacks.size() == 2)
+    CHECK(found.fallbacks[1].uri == fallback.uri && found.fallbacks[1].claimed_id == fallback.claimed_id && found.fallbacks[1].local_id == "");
+
+  // storing the same nonce again replaces the authentication session
+  auth_session.normalized_id = "http://example.com/me";
+  auth_session.fallbacks.clear();
+  storage->store_auth_session(auth_session);
+  CHECK(storage->get_auth_session(auth_session.nonce, found));
+  CHECK(found.normalized_id == auth_session.normalized_id && found.fallbacks.empty());
+
+  storage->remove_auth_session(auth_session.nonce);
+  CHECK(!storage->get_auth_session(auth_session.nonce, found));
+
+  auth_session.nonce = tag + "expired-asnonce";
+  auth_session.expires_on = now - 10;
+  storage->store_auth_session(auth_session);
+  CHECK(!storage->get_auth_session(auth_session.nonce, found));
+};
+
+void check_nonces(Storage *storage, const string& tag) {
+  time_t now = time(0);
+  string server = "http://" + tag + "op.example.com/";
+  string nonce = "2010-01-01T00:00:00Z" + tag;
+  CHECK(storage->add_nonce(server, nonce, now + 100));
+  CHECK(!storage->add_nonce(server, nonce, now + 100));
+  CHECK(!storage->failed());
+  CHECK(storage->add_nonce(server + "other/", nonce, now + 100));
+  CHECK(storage->add_nonce(server, nonce + "x", now + 100));
+};
+
+void check_tasks(Storage *storage, const string& tag) {
+  time_t now = time(0);
+  CHECK(storage->claim_task(tag + "task", now, 100));
+  CHECK(!storage->claim_task(tag + "task", now, 100));
+  CHECK(storage->claim_task(tag + "other-task", now, 100));
+};
+
+// run every case against a new instance of type at location
+void check_backend(const string& type, const string& location) {
+  cout << "checking " << type << " storage at " << location << endl;
+  int failures_before = failures;
+  Storage *storage = Storage::create(type, location);
+  CHECK(storage != NULL);
+  if(storage == NULL)
+    return;
+
+  ostringstream tag;
+  tag << "test" << getpid() << "-" << time(0) << "-";
+  check_sessions(storage, tag.str());
+  check_associations(storage, tag.str());
+  check_capabilities(storage, tag.str());
+  check_auth_sessions(storage, tag.str());
+  check_nonces(storage, tag.str());
+  check_tasks(storage, tag.str());
+  storage->ween_expired(-1);
+  CHECK(!storage->failed());
+  delete storage;
+  cout << "  " << ((failures == failures_before) ? "ok" : "failed") << endl;
+};
+
+int main() {
+  apr_initialize();
+  atexit(apr_terminate);
+
+  const char *tmpdir = getenv("TMPDIR");
+  ostringstream base;
+  base << ((tmpdir == NULL) ? "/tmp" : tmpdir) << "/moid_storage_test." << getpid();
+
+  string sqlite_location = base.str() + ".sqlite";
+  check_backend("sqlite", sqlite_location);
+  unlink(sqlite_location.c_str());
+
+#ifdef HAVE_LMDB
+  // the environment is a single file, plus its lock file
+  string lmdb_location = base.str() + ".lmdb";
+  check_backend("lmdb", lmdb_location);
+  unlink(lmdb_location.c_str());
+  unlink((lmdb_location + "-lock").c_str());
+#endif
+
+  const char *redis_location = getenv("MOID_TEST_REDIS");
+  if(redis_location == NULL)
+    redis_location = "localhost";
+  Storage *redis = Storage::create("redis", redis_location);
+  if(redis == NULL)
+    cout << "skipping redis storage: no server at " << redis_location << endl;
+  else {
+    delete redis;
+    check_backend("redis", redis_location);
+  }
+
+  return (failures == 0) ? 0 : 1;
+}